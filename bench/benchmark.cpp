@@ -0,0 +1,576 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "scenes.hpp"
+#include "sphere_batch.hpp"
+#include "triangle_mesh.hpp"
+
+// Benchmark suite: the intersection and texture kernels, BVH construction, BVHs over moving
+// primitives, triangle meshes (OBJ reading, building and intersection) and their instancing,
+// and fixed-seed renders of every demo scene. Results are printed as a table and, with
+// --json, written as a JSON file that can be diffed between releases.
+//
+// Usage: RayTracerBenchmark [--json file] [--filter text] [--threads n] [--samples n]
+//   --filter   only run the benchmarks whose name contains the text
+//   --threads  render and parallel BVH build threads, 0 (the default) uses every hardware thread
+//   --samples  samples per pixel of the scene renders (default 16)
+
+struct BenchmarkResult
+{
+  std::string name;
+  std::string unit;    // "ns/op" or "Mrays/s"
+  double value = 0;    // Result in the unit above
+  double operations = 0; // Operations (or rays) timed in the best pass
+  double seconds = 0;  // Duration of the best pass
+};
+
+struct BenchmarkOptions
+{
+  std::string json_file;
+  std::string filter;
+  int thread_count = 0;
+  int sample_per_pixel = 16;
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Results of the timed functions are added here so the compiler cannot drop the work.
+volatile double benchmark_sink = 0;
+
+class BenchmarkSuite
+{
+  public:
+    BenchmarkSuite(const BenchmarkOptions& options) : options(options) {}
+
+    int threadCount() const
+    {
+      return options.thread_count;
+    }
+
+    bool selected(const std::string& name) const
+    {
+      return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    void timeKernel(const std::string& name, double operations_per_call, const std::function<double()>& call)
+    {
+      // Repeat the call until a pass lasts long enough to time, then keep the best of a few
+      // passes so the noise of a busy machine stays out of the result.
+      if (!selected(name)) return;
+
+      size_t calls = 1;
+      while (true)
+      {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t call_index = 0; call_index < calls; call_index++) benchmark_sink = benchmark_sink + call();
+        if (secondsSince(start) >= min_pass_seconds) break;
+        calls *= 2;
+      }
+
+      double best_seconds = infinity;
+      for (int pass = 0; pass < pass_count; pass++)
+      {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t call_index = 0; call_index < calls; call_index++) benchmark_sink = benchmark_sink + call();
+        best_seconds = std::min(best_seconds, secondsSince(start));
+      }
+
+      double operations = operations_per_call * calls;
+      report({name, "ns/op", best_seconds * 1e9 / operations, operations, best_seconds});
+    }
+
+    void timeRender(Scene scene)
+    {
+      std::string name = "render/" + scene.name;
+      if (!selected(name)) return;
+
+      // Render at a fixed small size and sample count, keeping the scene's depth and framing.
+      Camera& camera = scene.camera;
+      double aspect = double(camera.image_width) / camera.image_height;
+      camera.image_width = render_width;
+      camera.image_height = int(render_width / aspect);
+      camera.sample_per_pixel = options.sample_per_pixel;
+      camera.thread_count = options.thread_count;
+      camera.random_seed = 0;
+
+      Framebuffer framebuffer;
+      camera.render(scene.world, framebuffer, scene.lights);
+      const Camera::RenderStatistics& statistics = camera.statistics;
+      report({name, "Mrays/s", statistics.raysPerSecond() / 1e6, double(statistics.rays + statistics.shadow_rays), statistics.seconds});
+    }
+
+    void check(bool passed, const std::string& message)
+    {
+      // Correctness checks run beside the timings; a failed one makes the suite exit with an error.
+      if (passed) return;
+      std::cerr << "ERROR: " << message << '\n';
+      failed_checks++;
+    }
+
+    bool passed() const
+    {
+      return failed_checks == 0;
+    }
+
+    bool writeJSON(const std::string& filename) const
+    {
+      std::ofstream out(filename);
+      if (!out) return false;
+
+      out << "{\n";
+      out << "  \"threads\": " << WorkStealingScheduler::resolveThreadCount(options.thread_count) << ",\n";
+      out << "  \"render_samples_per_pixel\": " << options.sample_per_pixel << ",\n";
+      out << "  \"benchmarks\": [\n";
+      for (size_t index = 0; index < results.size(); index++)
+      {
+        const BenchmarkResult& result = results[index];
+        out << "    { \"name\": \"" << result.name << "\", \"unit\": \"" << result.unit
+            << "\", \"value\": " << result.value << ", \"operations\": " << result.operations
+            << ", \"seconds\": " << result.seconds << " }" << (index + 1 < results.size() ? "," : "") << '\n';
+      }
+      out << "  ]\n}\n";
+      return bool(out);
+    }
+
+  private:
+    static constexpr double min_pass_seconds = 0.05;
+    static const int pass_count = 5;
+    static const int render_width = 400;
+
+    BenchmarkOptions options;
+    std::vector<BenchmarkResult> results;
+    int failed_checks = 0;
+
+    void report(const BenchmarkResult& result)
+    {
+      results.push_back(result);
+      std::printf("%-36s %12.3f %s\n", result.name.c_str(), result.value, result.unit.c_str());
+      std::fflush(stdout);
+    }
+};
+
+std::vector<Ray> makeRays(RandomEngine& engine, size_t count, double target_extent)
+{
+  // Rays from a plane in front of the origin towards points around it, about half of which
+  // hit a unit sized object at the origin.
+  std::vector<Ray> rays;
+  for (size_t index = 0; index < count; index++)
+  {
+    Point3 origin(randomDouble(engine, -3, 3), randomDouble(engine, -3, 3), 5);
+    Point3 target(randomDouble(engine, -target_extent, target_extent),
+                  randomDouble(engine, -target_extent, target_extent), randomDouble(engine, -1, 1));
+    rays.push_back(Ray(origin, target - origin, engine.nextDouble()));
+  }
+  return rays;
+}
+
+template <typename Object>
+double hitAll(const Object& object, const std::vector<Ray>& rays)
+{
+  double checksum = 0;
+  for (const Ray& ray : rays)
+  {
+    HitRecord record;
+    if (object.hit(ray, Interval(0.001, infinity), record)) checksum += record.t;
+  }
+  return checksum;
+}
+
+std::string writeTestImage()
+{
+  // A 1024x512 gradient written as a PNG with the framebuffer writer, for ImageTexture to load.
+  Framebuffer image(1024, 512);
+  for (int y = 0; y < image.height(); y++)
+  {
+    for (int x = 0; x < image.width(); x++)
+    {
+      image.setPixel(x, y, Color(double(x) / image.width(), double(y) / image.height(), 0.5));
+    }
+  }
+
+  std::string filename = (std::filesystem::temp_directory_path() / "rtw_benchmark_texture.png").string();
+  return image.write(filename) ? filename : std::string();
+}
+
+void kernelBenchmarks(BenchmarkSuite& suite)
+{
+  RandomEngine engine(42);
+  const size_t ray_count = 4096;
+  std::vector<Ray> rays = makeRays(engine, ray_count, 1.5);
+  auto material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+
+  Sphere sphere(Point3(0, 0, 0), 1.0, material);
+  suite.timeKernel("Sphere::hit", ray_count, [&] { return hitAll(sphere, rays); });
+
+  Sphere moving_sphere(Point3(0, 0, 0), Point3(0, 0.5, 0), 1.0, material);
+  suite.timeKernel("Sphere::hit moving", ray_count, [&] { return hitAll(moving_sphere, rays); });
+
+  // Groups of 8 small spheres, half of them moving, tested one by one through a HittableList
+  // and through each SphereBatch kernel. A batch must find the same hits as its spheres.
+  const size_t group_count = 64;
+  std::vector<HittableList> sphere_lists(group_count);
+  std::vector<std::vector<shared_ptr<Sphere>>> sphere_groups(group_count);
+  for (size_t group = 0; group < group_count; group++)
+  {
+    for (int index = 0; index < 8; index++)
+    {
+      Point3 center(randomDouble(engine, -1, 1), randomDouble(engine, -1, 1), randomDouble(engine, -1, 1));
+      Point3 center2 = center + Vector3(0, randomDouble(engine, 0, 0.5), 0);
+      sphere_groups[group].push_back(index % 2 ? make_shared<Sphere>(center, 0.2, material)
+                                               : make_shared<Sphere>(center, center2, 0.2, material));
+      sphere_lists[group].add(sphere_groups[group].back());
+    }
+  }
+  auto hitGroups = [&](const auto& groups)
+  {
+    double checksum = 0;
+    for (const auto& group : groups) checksum += hitAll(group, rays);
+    return checksum;
+  };
+  suite.timeKernel("HittableList::hit 8 spheres", ray_count * group_count, [&] { return hitGroups(sphere_lists); });
+
+  const std::pair<SphereBatch::Kernel, const char*> batch_kernels[] = {
+    {SphereBatch::Kernel::Scalar, "scalar"}, {SphereBatch::Kernel::SSE2, "SSE2"}, {SphereBatch::Kernel::AVX2, "AVX2"}
+  };
+  for (const auto& kernel : batch_kernels)
+  {
+    std::vector<SphereBatch> batches;
+    for (const auto& spheres : sphere_groups) batches.emplace_back(spheres, kernel.first);
+    if (batches.front().activeKernel() != kernel.first) continue;
+    suite.timeKernel(std::string("SphereBatch::hit 8 spheres ") + kernel.second, ray_count * group_count,
+                     [&] { return hitGroups(batches); });
+    suite.check(hitGroups(batches) == hitGroups(sphere_lists),
+                std::string("the SphereBatch ") + kernel.second + " kernel finds other hits than Sphere::hit");
+  }
+
+  Quad quad(Point3(-1, -1, 0), Vector3(2, 0, 0), Vector3(0, 2, 0), material);
+  suite.timeKernel("Quad::hit", ray_count, [&] { return hitAll(quad, rays); });
+
+  AABB box(Point3(-1, -1, -1), Point3(1, 1, 1));
+  suite.timeKernel("AABB::hit", ray_count, [&]
+  {
+    double hits = 0;
+    for (const Ray& ray : rays) hits += box.hit(ray, Interval(0.001, infinity)) ? 1 : 0;
+    return hits;
+  });
+
+  std::vector<Point3> points;
+  for (size_t index = 0; index < ray_count; index++)
+  {
+    points.push_back(Point3(randomDouble(engine, -8, 8), randomDouble(engine, -8, 8), randomDouble(engine, -8, 8)));
+  }
+
+  // The same noise (same tables) through each turbulence kernel, then through a noise volume.
+  // The largest difference to the reference kernel is reported on stderr, and fails the suite
+  // past what the float AVX2 kernel can account for.
+  const std::pair<Perlin::Kernel, const char*> perlin_kernels[] = {
+    {Perlin::Kernel::Reference, "reference"}, {Perlin::Kernel::Scalar, "scalar"}, {Perlin::Kernel::AVX2, "AVX2"}
+  };
+  RandomEngine perlin_engine = engine;
+  Perlin reference(perlin_engine, Perlin::Kernel::Reference);
+  for (const auto& kernel : perlin_kernels)
+  {
+    if (kernel.first == Perlin::Kernel::AVX2 && !cpuSupportsAVX2()) continue;
+    perlin_engine = engine;
+    Perlin perlin(perlin_engine, kernel.first);
+    suite.timeKernel(std::string("Perlin::turbulence depth 7 ") + kernel.second, ray_count, [&]
+    {
+      double sum = 0;
+      for (const Point3& point : points) sum += perlin.turbulence(point, 7);
+      return sum;
+    });
+
+    if (kernel.first == Perlin::Kernel::Reference) continue;
+    double error = 0;
+    for (const Point3& point : points) error = std::fmax(error, std::fabs(perlin.turbulence(point, 7) - reference.turbulence(point, 7)));
+    std::cerr << "Perlin " << kernel.second << " kernel: largest difference to the reference " << error << '\n';
+    suite.check(error < 1e-4, std::string("the Perlin ") + kernel.second + " kernel diverges from the reference");
+  }
+
+  NoiseVolume volume(reference, 7, Point3(-8, -8, -8), Point3(8, 8, 8), 8);
+  suite.timeKernel("NoiseVolume::lookup", ray_count, [&]
+  {
+    double sum = 0, turbulence;
+    for (const Point3& point : points) sum += volume.lookup(point, turbulence) ? turbulence : 0;
+    return sum;
+  });
+
+  std::string texture_file = writeTestImage();
+  if (texture_file.empty())
+  {
+    std::cerr << "Could not write the test texture, skipping ImageTexture::value\n";
+    return;
+  }
+  ImageTexture texture(texture_file.c_str());
+  std::filesystem::remove(texture_file);
+
+  std::vector<std::pair<double, double>> coordinates;
+  for (size_t index = 0; index < ray_count; index++)
+  {
+    coordinates.push_back({engine.nextDouble(), engine.nextDouble()});
+  }
+  suite.timeKernel("ImageTexture::value", ray_count, [&]
+  {
+    double sum = 0;
+    for (const auto& uv : coordinates) sum += texture.value(uv.first, uv.second, Point3(0, 0, 0)).x();
+    return sum;
+  });
+  suite.timeKernel("ImageTexture::filteredValue", ray_count, [&]
+  {
+    // A footprint of about 4 texels, between two mip levels.
+    double sum = 0;
+    for (const auto& uv : coordinates) sum += texture.filteredValue(uv.first, uv.second, Point3(0, 0, 0), 3.0 / 1024).x();
+    return sum;
+  });
+}
+
+void bvhBenchmarks(BenchmarkSuite& suite)
+{
+  // Build times per primitive over a clustered cloud of spheres.
+  RandomEngine engine(7);
+  const size_t sphere_count = 100000;
+  auto material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+
+  HittableList spheres;
+  for (size_t index = 0; index < sphere_count; index++)
+  {
+    Point3 cluster(std::floor(randomDouble(engine, 0, 4)) * 25, 0, std::floor(randomDouble(engine, 0, 4)) * 25);
+    Point3 center = cluster + Vector3(randomDouble(engine, -5, 5), randomDouble(engine, -5, 5), randomDouble(engine, -5, 5));
+    spheres.add(make_shared<Sphere>(center, 0.05, material));
+  }
+
+  suite.timeKernel("BVHNode build median", sphere_count, [&]
+  {
+    return BVHNode(spheres, BVHSplitMethod::Median).boundingBox().x.min;
+  });
+
+  suite.timeKernel("BVHNode build binned SAH", sphere_count, [&]
+  {
+    return BVHNode(spheres, BVHSplitMethod::BinnedSAH).boundingBox().x.min;
+  });
+
+  suite.timeKernel("LinearBVH build binned SAH", sphere_count, [&]
+  {
+    return double(LinearBVH(spheres).nodeCount());
+  });
+
+  suite.timeKernel("LinearBVH build binned SAH parallel", sphere_count, [&]
+  {
+    return double(LinearBVH(spheres, BVHSplitMethod::BinnedSAH, 4, suite.threadCount()).nodeCount());
+  });
+
+  suite.timeKernel("LinearBVH build Morton", sphere_count, [&]
+  {
+    return double(LinearBVH(spheres, BVHSplitMethod::Morton).nodeCount());
+  });
+
+  suite.timeKernel("LinearBVH build Morton parallel", sphere_count, [&]
+  {
+    return double(LinearBVH(spheres, BVHSplitMethod::Morton, 4, suite.threadCount()).nodeCount());
+  });
+
+  LinearBVH linear_bvh(spheres);
+  suite.timeKernel("WideBVH collapse", sphere_count, [&]
+  {
+    return double(WideBVH(linear_bvh).nodeCount());
+  });
+
+  // What the faster Morton build costs in tree quality, for rays from above into the clusters.
+  const size_t ray_count = 4096;
+  std::vector<Ray> rays;
+  for (size_t index = 0; index < ray_count; index++)
+  {
+    Point3 origin(randomDouble(engine, -10, 85), 20, randomDouble(engine, -10, 85));
+    Point3 target(std::floor(randomDouble(engine, 0, 4)) * 25 + randomDouble(engine, -5, 5), randomDouble(engine, -5, 5),
+                  std::floor(randomDouble(engine, 0, 4)) * 25 + randomDouble(engine, -5, 5));
+    rays.push_back(Ray(origin, target - origin, engine.nextDouble()));
+  }
+  LinearBVH morton_bvh(spheres, BVHSplitMethod::Morton);
+  suite.timeKernel("LinearBVH::hit binned SAH", ray_count, [&] { return hitAll(linear_bvh, rays); });
+  suite.timeKernel("LinearBVH::hit Morton", ray_count, [&] { return hitAll(morton_bvh, rays); });
+}
+
+void motionBenchmarks(BenchmarkSuite& suite)
+{
+  // A cloud of small spheres each moving its own way over the shutter interval, against rays
+  // at random times: the bounds over the whole motion, as every other BVH uses, against the
+  // bounds interpolated to the ray time, without and with time splits.
+  RandomEngine engine(11);
+  const size_t sphere_count = 50000;
+  auto material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+
+  HittableList spheres;
+  for (size_t index = 0; index < sphere_count; index++)
+  {
+    Point3 center(randomDouble(engine, -2, 2), randomDouble(engine, -2, 2), randomDouble(engine, -2, 2));
+    Vector3 motion(randomDouble(engine, -0.5, 0.5), randomDouble(engine, -0.5, 0.5), randomDouble(engine, -0.5, 0.5));
+    spheres.add(make_shared<Sphere>(center, center + motion, 0.02, material));
+  }
+
+  suite.timeKernel("MotionBVH build", sphere_count, [&]
+  {
+    return double(MotionBVH(spheres).nodeCount());
+  });
+
+  suite.timeKernel("MotionBVH build time splits", sphere_count, [&]
+  {
+    return double(MotionBVH(spheres, 2).nodeCount());
+  });
+
+  const size_t ray_count = 4096;
+  std::vector<Ray> rays = makeRays(engine, ray_count, 2);
+  WideBVH wide_bvh(spheres);
+  MotionBVH motion_bvh(spheres);
+  MotionBVH split_motion_bvh(spheres, 2);
+  std::cerr << "MotionBVH: " << split_motion_bvh.nodeCount() << " nodes and " << split_motion_bvh.primitiveCount()
+            << " primitive references with time splits, " << motion_bvh.nodeCount() << " nodes without\n";
+
+  suite.timeKernel("WideBVH::hit moving", ray_count, [&] { return hitAll(wide_bvh, rays); });
+  suite.timeKernel("MotionBVH::hit", ray_count, [&] { return hitAll(motion_bvh, rays); });
+  suite.timeKernel("MotionBVH::hit time splits", ray_count, [&] { return hitAll(split_motion_bvh, rays); });
+}
+
+std::string writeTestMesh(int rings, int segments)
+{
+  // A unit sphere tessellated into rings x segments quads, with normals and texture
+  // coordinates, written as an OBJ file for TriangleMesh to read.
+  std::string filename = (std::filesystem::temp_directory_path() / "rtw_benchmark_mesh.obj").string();
+  FILE* file = std::fopen(filename.c_str(), "w");
+  if (!file) return std::string();
+
+  for (int ring = 0; ring <= rings; ring++)
+  {
+    double theta = PI * ring / rings;
+    for (int segment = 0; segment <= segments; segment++)
+    {
+      double phi = 2 * PI * segment / segments;
+      double x = std::sin(theta) * std::cos(phi), y = std::cos(theta), z = -std::sin(theta) * std::sin(phi);
+      std::fprintf(file, "v %f %f %f\nvn %f %f %f\nvt %f %f\n", x, y, z, x, y, z,
+                   double(segment) / segments, 1 - double(ring) / rings);
+    }
+  }
+  for (int ring = 0; ring < rings; ring++)
+  {
+    for (int segment = 0; segment < segments; segment++)
+    {
+      int a = ring * (segments + 1) + segment + 1, b = a + segments + 1;
+      std::fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, b + 1, b + 1, b + 1, a + 1, a + 1, a + 1);
+    }
+  }
+  bool written = std::ferror(file) == 0;
+  std::fclose(file);
+  return written ? filename : std::string();
+}
+
+void meshBenchmarks(BenchmarkSuite& suite)
+{
+  const int rings = 256, segments = 512;
+  const size_t triangle_count = size_t(rings) * segments * 2;
+  std::string mesh_file = writeTestMesh(rings, segments);
+  if (mesh_file.empty())
+  {
+    std::cerr << "Could not write the test mesh, skipping the mesh benchmarks\n";
+    return;
+  }
+
+  TriangleMeshData data;
+  suite.timeKernel("OBJ read", triangle_count, [&]
+  {
+    TriangleMesh::readOBJ(mesh_file, data);
+    return double(data.vertexCount());
+  });
+  TriangleMesh::readOBJ(mesh_file, data);
+  std::filesystem::remove(mesh_file);
+
+  auto material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+  suite.timeKernel("TriangleMesh build", triangle_count, [&]
+  {
+    return double(TriangleMesh(data, material).nodeCount());
+  });
+
+  TriangleMesh mesh(data, material);
+  std::cerr << "TriangleMesh: " << mesh.triangleCount() << " triangles, "
+            << double(mesh.memoryUsage()) / mesh.triangleCount() << " bytes per triangle\n";
+
+  RandomEngine engine(42);
+  const size_t ray_count = 4096;
+  std::vector<Ray> rays = makeRays(engine, ray_count, 1.5);
+  suite.timeKernel("TriangleMesh::hit", ray_count, [&] { return hitAll(mesh, rays); });
+
+  // The same mesh, shared by a grid of small, turned instances under one top level BVH.
+  const int grid_size = 300;
+  std::vector<shared_ptr<Hittable>> objects = { make_shared<TriangleMesh>(data, material) };
+  std::vector<InstanceBVH::Placement> placements;
+  for (int row = 0; row < grid_size; row++)
+  {
+    for (int column = 0; column < grid_size; column++)
+    {
+      Vector3 position(4.0 * column / grid_size - 2, 4.0 * row / grid_size - 2, randomDouble(engine, -1, 1));
+      placements.push_back({ 0, Transform::translate(position) * Transform::rotate(Vector3(0, 1, 0), randomDouble(engine, 0, 360))
+                                * Transform::scale(2.0 / grid_size) });
+    }
+  }
+  suite.timeKernel("InstanceBVH build", placements.size(), [&]
+  {
+    return double(InstanceBVH(objects, placements).nodeCount());
+  });
+
+  InstanceBVH instances(objects, placements);
+  std::cerr << "InstanceBVH: " << instances.instanceCount() << " instances of " << mesh.triangleCount() << " triangles, "
+            << double(instances.memoryUsage()) / instances.instanceCount() << " bytes per instance\n";
+  suite.timeKernel("InstanceBVH::hit", ray_count, [&] { return hitAll(instances, rays); });
+}
+
+void renderBenchmarks(BenchmarkSuite& suite)
+{
+  for (int index = 1; index <= scene_count; index++)
+  {
+    // Scene construction draws from the thread's engine; reseed it so every run builds the
+    // same scene.
+    randomEngine().seed(RandomEngine::mix(index));
+    suite.timeRender(makeScene(index));
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  BenchmarkOptions options;
+  for (int index = 1; index < argc; index++)
+  {
+    std::string argument = argv[index];
+    bool has_value = index + 1 < argc;
+    if (argument == "--json" && has_value) options.json_file = argv[++index];
+    else if (argument == "--filter" && has_value) options.filter = argv[++index];
+    else if (argument == "--threads" && has_value) options.thread_count = std::atoi(argv[++index]);
+    else if (argument == "--samples" && has_value) options.sample_per_pixel = std::max(1, std::atoi(argv[++index]));
+    else
+    {
+      std::cerr << "Usage: " << argv[0] << " [--json file] [--filter text] [--threads n] [--samples n]\n";
+      return 1;
+    }
+  }
+
+  BenchmarkSuite suite(options);
+  kernelBenchmarks(suite);
+  bvhBenchmarks(suite);
+  motionBenchmarks(suite);
+  meshBenchmarks(suite);
+  renderBenchmarks(suite);
+
+  if (!options.json_file.empty() && !suite.writeJSON(options.json_file))
+  {
+    std::cerr << "Could not write " << options.json_file << '\n';
+    return 1;
+  }
+  return suite.passed() ? 0 : 1;
+}
@@ -39,6 +39,7 @@ class AABB
 
     bool hit(const Ray& ray, Interval ray_time) const
     {
+      RTW_COUNT(AABBTests);
       const Point3& ray_origin = ray.origin();
       const Vector3& ray_direction = ray.direction();
 
@@ -69,6 +70,18 @@ class AABB
       return true;
     }
 
+    Point3 centroid() const
+    {
+      return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    double surfaceArea() const
+    {
+      // Returns the area of the box surface, zero for an empty box.
+      if(x.size() < 0 || y.size() < 0 || z.size() < 0) return 0.0;
+      return 2.0 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
     int longestAxis() const
     {
       // Returns the index of the longest axis of the bounding box.
@@ -6,10 +6,159 @@
 
 #include <algorithm>
 
+enum class BVHSplitMethod
+{
+  Median,    // Sort along the longest axis and split at the object median
+  BinnedSAH, // Split at the cheapest bin boundary according to the Surface Area Heuristic
+  Morton     // Sort once along a Morton curve and split where the codes change (LinearBVHTree
+             // only, the other builders split at the median); fast to build, looser trees
+};
+
+class BVHPartition
+{
+  // Split strategies shared by the BVH builders. They reorder the items of a span [start, end)
+  // in place and return the index of the first item of the right half. box_of(item) returns
+  // the bounding box of an item.
+
+  public:
+    static const int sah_bin_count = 16;
+
+    // Depth below which the builders stop using SAH splits and fall back to median splits.
+    // A run of lopsided SAH splits could otherwise make a tree arbitrarily deep.
+    static const int max_sah_depth = 64;
+
+    template <typename Item, typename BoxOf>
+    static size_t median(std::vector<Item>& items, size_t start, size_t end, int axis, BoxOf box_of)
+    {
+      // Sort the span along the axis and split at the item median.
+      std::sort(std::begin(items) + start, std::begin(items) + end,
+        [&](const Item& a, const Item& b)
+        {
+          return box_of(a).axisInterval(axis).min < box_of(b).axisInterval(axis).min;
+        });
+
+      return start + (end - start) / 2;
+    }
+
+    template <typename Item, typename BoxOf>
+    static size_t binnedSAH(std::vector<Item>& items, size_t start, size_t end, BoxOf box_of, double& split_cost)
+    {
+      // Project the item centroids into sah_bin_count equal bins along each axis, evaluate the
+      // SAH cost of the sah_bin_count - 1 planes between the bins, and partition the items
+      // around the cheapest plane. split_cost receives the sum of the surface area times item
+      // count of both halves. Returns start if no plane separates the items (all centroids in
+      // one bin).
+
+      AABB centroid_bounds = AABB::empty;
+      for(size_t item_index = start; item_index < end; item_index++)
+      {
+        Point3 centroid = box_of(items[item_index]).centroid();
+        centroid_bounds = AABB(centroid_bounds, AABB(centroid, centroid));
+      }
+
+      int best_axis = -1;
+      int best_plane = 0;
+      split_cost = infinity;
+
+      for(int axis = 0; axis < 3; axis++)
+      {
+        const Interval& extent = centroid_bounds.axisInterval(axis);
+        if(extent.size() <= 0) continue;
+
+        AABB bin_boxes[sah_bin_count];
+        size_t bin_counts[sah_bin_count] = {};
+        for(size_t item_index = start; item_index < end; item_index++)
+        {
+          AABB box = box_of(items[item_index]);
+          int bin = binIndex(box.centroid()[axis], extent);
+          bin_boxes[bin] = AABB(bin_boxes[bin], box);
+          bin_counts[bin]++;
+        }
+
+        // Sweep from the right to get the area and count on the right of every plane, then
+        // from the left to evaluate each plane.
+        double right_areas[sah_bin_count];
+        size_t right_counts[sah_bin_count];
+        AABB right_box = AABB::empty;
+        size_t right_count = 0;
+        for(int plane = sah_bin_count - 1; plane > 0; plane--)
+        {
+          right_box = AABB(right_box, bin_boxes[plane]);
+          right_count += bin_counts[plane];
+          right_areas[plane] = right_box.surfaceArea();
+          right_counts[plane] = right_count;
+        }
+
+        AABB left_box = AABB::empty;
+        size_t left_count = 0;
+        for(int plane = 1; plane < sah_bin_count; plane++)
+        {
+          left_box = AABB(left_box, bin_boxes[plane - 1]);
+          left_count += bin_counts[plane - 1];
+          if(left_count == 0 || right_counts[plane] == 0) continue;
+
+          double cost = left_box.surfaceArea() * left_count + right_areas[plane] * right_counts[plane];
+          if(cost < split_cost)
+          {
+            split_cost = cost;
+            best_axis = axis;
+            best_plane = plane;
+          }
+        }
+      }
+
+      if(best_axis < 0) return start;
+
+      const Interval& extent = centroid_bounds.axisInterval(best_axis);
+      auto middle = std::partition(std::begin(items) + start, std::begin(items) + end,
+        [&](const Item& item)
+        {
+          return binIndex(box_of(item).centroid()[best_axis], extent) < best_plane;
+        });
+
+      return size_t(middle - std::begin(items));
+    }
+
+    static int nearChildAxis(const Vector3& separation)
+    {
+      // The split axis stored for traversal, from the offset of the second half's centroid
+      // to the first's: the axis along which the second half lies furthest on the positive
+      // side, so a ray going that way visits the first half, the near one, first. The largest
+      // absolute offset could pick an axis along which the halves are the other way round.
+      int axis = 0;
+      if(separation[1] > separation[axis]) axis = 1;
+      if(separation[2] > separation[axis]) axis = 2;
+      return axis;
+    }
+
+    template <typename Item, typename BoxOf>
+    static int splitAxis(const std::vector<Item>& items, size_t start, size_t mid, size_t end, BoxOf box_of)
+    {
+      // nearChildAxis() for the halves [start, mid) and [mid, end) of a partitioned span.
+      Point3 left_centroid, right_centroid;
+      for(size_t item_index = start; item_index < mid; item_index++) left_centroid += box_of(items[item_index]).centroid();
+      for(size_t item_index = mid; item_index < end; item_index++) right_centroid += box_of(items[item_index]).centroid();
+      return nearChildAxis(right_centroid / double(end - mid) - left_centroid / double(mid - start));
+    }
+
+  private:
+    static int binIndex(double centroid, const Interval& extent)
+    {
+      int bin = int(sah_bin_count * (centroid - extent.min) / extent.size());
+      return std::clamp(bin, 0, sah_bin_count - 1);
+    }
+};
+
 class BVHNode : public Hittable
 {
   public:
-    BVHNode(HittableList list) : BVHNode(list.objects, 0, list.objects.size())
+    // Relative costs of testing one node bounding box and intersecting one object, as used by
+    // the Surface Area Heuristic.
+    static constexpr double traversal_cost = 0.125;
+    static constexpr double intersection_cost = 1.0;
+
+    BVHNode(HittableList list, BVHSplitMethod split_method = BVHSplitMethod::Median)
+      : BVHNode(list.objects, 0, list.objects.size(), split_method)
     {
       // There's a C++ subtlety here. This constructor (without span indices) create an
       // inmplicit copy of the hittable list, which we will modify. The lifetime of the copied
@@ -17,7 +166,8 @@ class BVHNode : public Hittable
       // persist the resulting bounding volume hierarchy.
     }
 
-    BVHNode(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end)
+    BVHNode(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end,
+            BVHSplitMethod split_method = BVHSplitMethod::Median, int depth = 0)
     {
       // Build the bounding box of the span of source objects.
       bbox = AABB::empty;
@@ -26,36 +176,49 @@ class BVHNode : public Hittable
         bbox = AABB(bbox, objects[object_index]->boundingBox());
       }
 
-      int axis = bbox.longestAxis();
-
-      auto comparator = (axis == 0) ? box_x_compare
-                      : (axis == 1) ? box_y_compare
-                      : box_z_compare;
-
       size_t object_span = end - start;
 
       if(object_span == 1)
       {
         left = right = objects[start];
+        sah_cost = traversal_cost + 2 * intersection_cost;
       }
       else if(object_span == 2)
       {
         left = objects[start];
         right = objects[start + 1];
+        sah_cost = traversal_cost + 2 * intersection_cost;
       }
       else
       {
-        std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+        size_t mid = 0;
+        if(split_method == BVHSplitMethod::BinnedSAH && depth < BVHPartition::max_sah_depth)
+        {
+          mid = binnedSAHPartition(objects, start, end);
+        }
+        if(mid <= start || mid >= end)
+        {
+          mid = medianPartition(objects, start, end, bbox.longestAxis());
+        }
+
+        auto left_node = make_shared<BVHNode>(objects, start, mid, split_method, depth + 1);
+        auto right_node = make_shared<BVHNode>(objects, mid, end, split_method, depth + 1);
+        left = left_node;
+        right = right_node;
 
-        auto mid = start + object_span / 2;
-        left = make_shared<BVHNode>(objects, start, mid);
-        right = make_shared<BVHNode>(objects, mid, end);
+        // Expected cost of a ray that hits this node, weighting each child by the conditional
+        // probability that the ray also hits the child's bounding box.
+        double area = bbox.surfaceArea();
+        double left_weight = area > 0 ? left_node->bbox.surfaceArea() / area : 1.0;
+        double right_weight = area > 0 ? right_node->bbox.surfaceArea() / area : 1.0;
+        sah_cost = traversal_cost + left_weight * left_node->sah_cost + right_weight * right_node->sah_cost;
       }
 
     }
 
     bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
     {
+      RTW_COUNT(BVHNodesVisited);
       if(!bbox.hit(ray, ray_t))
       {
         return false;
@@ -71,30 +234,34 @@ class BVHNode : public Hittable
       return bbox;
     }
 
+    double sahCost() const
+    {
+      // Returns the Surface Area Heuristic cost of the hierarchy below this node: the expected
+      // work, in units of object intersections, for a ray that hits the node bounding box.
+      return sah_cost;
+    }
+
   private:
+    friend class LinearBVH;
+
     shared_ptr<Hittable> left;
     shared_ptr<Hittable> right;
     AABB bbox;
+    double sah_cost = 0.0;
 
-    static bool boxCompare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axis_index)
-    {
-      auto a_axis_interval = a->boundingBox().axisInterval(axis_index);
-      auto b_axis_interval = b->boundingBox().axisInterval(axis_index);
-      return a_axis_interval.min < b_axis_interval.min;
-    }
-
-    static bool box_x_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
+    static size_t medianPartition(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end, int axis)
     {
-      return boxCompare(a, b, 0);
+      return BVHPartition::median(objects, start, end, axis, boxOf);
     }
 
-    static bool box_y_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
+    static size_t binnedSAHPartition(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end)
     {
-      return boxCompare(a, b, 1);
+      double split_cost;
+      return BVHPartition::binnedSAH(objects, start, end, boxOf, split_cost);
     }
 
-    static bool box_z_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
+    static AABB boxOf(const shared_ptr<Hittable>& object)
     {
-      return boxCompare(a, b, 2);
+      return object->boundingBox();
     }
 };
\ No newline at end of file
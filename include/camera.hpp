@@ -1,9 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
 
+#include "denoiser.hpp"
+#include "framebuffer.hpp"
 #include "hittable.hpp"
+#include "hittable_list.hpp"
 #include "material.hpp"
+#include "process_scheduler.hpp"
+#include "sampler.hpp"
+#include "scheduler.hpp"
 
 class Camera
 {
@@ -22,41 +36,238 @@ class Camera
     double defocus_angle = 0; // Varaiation angle of rays through each pixel
     double focus_distance = 10; // Distance from camera lookfrom point to plane of perfect focus
 
-    void render(std::ofstream &render_image, const Hittable &world)
+    // What rays leaving the scene see: the sky gradient, or a uniform color.
+    bool sky_background = true;
+    Color background_color = Color(0, 0, 0); // Used when sky_background is false
+
+    // Next event estimation: at every diffuse bounce, a shadow ray goes to a point sampled on
+    // the lights given to render(), weighted against the scattered ray by multiple importance
+    // sampling. Without it, light only comes from the paths that happen to hit an emitter.
+    bool light_sampling = true;
+
+    int thread_count = 0; // Number of render threads, 0 uses every hardware thread
+    int tile_size = 32; // Width and height in pixels of the square tiles handed to the threads
+
+    // Worker processes of a distributed render. With more than 0, render() forks them and hands
+    // them the tiles over local sockets, see ProcessScheduler; thread_count is then ignored.
+    int worker_processes = 0;
+
+    uint64_t random_seed = 0; // Seed of every random sequence drawn during the render
+    bool counter_based_random = true; // Key random numbers on (pixel, sample, bounce) rather than on tiles
+
+    // Where the values of each path come from: independent random numbers, or one of the
+    // stratified and low discrepancy samplers of sampler.hpp. Those key their values on the
+    // pixel, the sample and the dimension, whatever counter_based_random says.
+    SamplerType sampler_type = SamplerType::Independent;
+
+    // Bounce from which paths carrying little energy may be terminated by Russian roulette.
+    // Set it to max_depth or more to always trace paths to the depth limit.
+    int russian_roulette_depth = 3;
+
+    // Adaptive sampling: every pixel takes adaptive_min_samples samples, then more in batches
+    // until the standard error of its mean drops below adaptive_error_threshold or it reaches
+    // sample_per_pixel samples. The error is measured on the gamma corrected luminance, so the
+    // threshold is a fraction of the displayed range (0.01 is about 2.5 levels out of 255).
+    bool adaptive_sampling = false;
+    int adaptive_min_samples = 16; // Samples every pixel takes before its error is checked
+    int adaptive_batch_size = 8; // Samples taken between two error checks
+    double adaptive_error_threshold = 0.01; // Target standard error of a pixel
+    std::string sample_heatmap_file = ""; // If set, an adaptive render writes the samples taken per pixel there
+
+    Framebuffer sample_heatmap; // Samples taken per pixel over sample_per_pixel, after an adaptive render
+
+    // Progressive rendering: with a time budget, the camera renders whole-image passes of
+    // growing sample counts into an accumulation buffer until the budget runs out, and ends
+    // with every complete pass it reached. sample_per_pixel and adaptive sampling are then
+    // ignored. A pass that would not end in time is shortened, and one the deadline still
+    // interrupts is dropped, so the image never mixes sample counts.
+    double time_budget = 0; // Seconds of rendering, 0 renders sample_per_pixel samples instead
+    double progress_interval = 0; // Seconds between two intermediate images, 0 for none
+    std::string progress_file = ""; // Image file overwritten with each intermediate image
+
+    // Feature buffers: after the render, a pass of camera rays records the albedo, normal and
+    // depth of what each pixel first sees, averaged over up to max_feature_samples samples of
+    // the pixel. They guide the denoiser, which filters the image once it is rendered.
+    bool denoise = false;
+    Denoiser denoiser; // Settings of the denoising filter
+    int max_feature_samples = 16;
+    // If set, the feature buffers are written to PREFIX_albedo.pfm, PREFIX_normal.pfm and
+    // PREFIX_depth.pfm (the depth in all three channels).
+    std::string feature_file_prefix = "";
+
+    FeatureBuffers features; // Feature buffers of the last render, with denoise or a feature_file_prefix
+
+    struct RenderStatistics
+    {
+      uint64_t paths = 0;                  // Camera samples traced
+      uint64_t rays = 0;                   // Path rays intersected with the scene, camera rays included
+      uint64_t shadow_rays = 0;            // Shadow rays towards sampled lights
+      uint64_t roulette_terminations = 0;  // Paths ended early by Russian roulette
+      double seconds = 0;                  // Wall-clock time of the render
+      int samples_per_pixel = 0;           // Samples each pixel received (the most, with adaptive sampling)
+      int passes = 0;                      // Whole-image passes rendered
+
+      void merge(const RenderStatistics& other)
+      {
+        paths += other.paths;
+        rays += other.rays;
+        shadow_rays += other.shadow_rays;
+        roulette_terminations += other.roulette_terminations;
+      }
+
+      double meanPathLength() const { return paths > 0 ? double(rays) / paths : 0.0; }
+      double raysPerSecond() const { return seconds > 0 ? (rays + shadow_rays) / seconds : 0.0; } // Every ray traced
+    };
+
+    RenderStatistics statistics; // Statistics of the last render
+
+    // Counters of the last render, merged from every thread. They stay at zero unless the build
+    // defines RTW_ENABLE_STATS, see trace_statistics.hpp.
+    TraceStatistics trace_statistics;
+    std::string statistics_file = ""; // If set, the counters of each render are written there as JSON
+
+    // The lights are emissive objects of the world that light sampling aims at; emitters left
+    // out of the list still light the scene, through the paths that hit them.
+    void render(std::ofstream &render_image, const Hittable &world, const HittableList &lights = HittableList())
+    {
+      Framebuffer framebuffer;
+      render(world, framebuffer, lights);
+
+      // Write the binary PPM file and close it
+      framebuffer.writePPM(render_image);
+      render_image.close();
+    }
+
+    void render(const Hittable &world, Framebuffer &framebuffer, const HittableList &lights = HittableList())
     {
       initialize();
+      sampled_lights = light_sampling ? lights : HittableList();
 
-      // Write the PPM header
-      render_image << "P3" << std::endl;
-      render_image << image_width << " " << image_height << std::endl;
-      render_image << "255" << std::endl;
+      framebuffer = Framebuffer(image_width, image_height);
+      sample_heatmap = adaptive_sampling ? Framebuffer(image_width, image_height) : Framebuffer();
 
-      for (int j = 0; j < image_height; j++) 
+      // Split the image into tiles, scanline order, and let the threads share them out.
+      std::vector<Tile> tiles;
+      for (int y = 0; y < image_height; y += tile_size)
       {
-        std::clog 
-            << "\rScanlines remaining: " 
-            << (image_height - j) 
-            << ' ' << std::flush;
-        for (int i = 0; i < image_width; i++) 
+        for (int x = 0; x < image_width; x += tile_size)
         {
-          Color pixel_color(0, 0, 0);
-          for (int sample = 0; sample < sample_per_pixel; sample++)
-          {
-            Ray ray = getRay(i, j);
-            pixel_color += rayColor(ray, max_depth, world);
-          }
-          
-          // Write RGB values to the PPM file
-          write_color(render_image, pixel_sample_scale * pixel_color);
+          tiles.push_back({x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height)});
         }
-        // End the line here
-        render_image << std::endl;
       }
 
-      // Close the PPM file
-      render_image.close();
+      statistics = RenderStatistics();
+      trace_statistics.clear();
+#if RTW_ENABLE_STATS
+      threadTraceStatistics().clear();
+#endif
+      auto start_time = std::chrono::steady_clock::now();
+
+      if (time_budget > 0)
+      {
+        // The passes are sized against the deadline as they go, which the worker processes do
+        // not share, so a time budget always renders in this process.
+        if (worker_processes > 0)
+        {
+          std::clog << "A time budget renders progressively in this process, ignoring the "
+                    << worker_processes << " worker processes\n";
+        }
+        renderProgressive(world, tiles, start_time, framebuffer);
+      }
+      else
+      {
+        SamplePass pass;
+        pass.sample_count = sample_per_pixel;
+        pass.scale = pixel_sample_scale;
+        pass.adaptive = adaptive_sampling;
+        if (worker_processes > 0) renderDistributed(world, tiles, pass, framebuffer);
+        else renderPass(world, tiles, pass, framebuffer);
+        statistics.samples_per_pixel = sample_per_pixel;
+        statistics.passes = 1;
+      }
+
+      statistics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+      features = FeatureBuffers();
+      if (denoise || !feature_file_prefix.empty())
+      {
+        auto feature_start = std::chrono::steady_clock::now();
+        renderFeatures(world, tiles);
+        double feature_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - feature_start).count();
+
+        auto denoise_start = std::chrono::steady_clock::now();
+        if (denoise)
+        {
+          Denoiser filter = denoiser;
+          filter.thread_count = thread_count;
+          framebuffer = filter.denoise(framebuffer, features, statistics.samples_per_pixel);
+        }
+        std::clog << "\rFeature buffers in " << feature_seconds * 1000 << " ms";
+        if (denoise)
+        {
+          std::clog << ", denoised in "
+                    << std::chrono::duration<double>(std::chrono::steady_clock::now() - denoise_start).count() * 1000 << " ms";
+        }
+        std::clog << '\n';
+
+        if (!feature_file_prefix.empty()
+            && !(features.albedo.write(feature_file_prefix + "_albedo.pfm")
+                 && features.normal.write(feature_file_prefix + "_normal.pfm")
+                 && features.depth.write(feature_file_prefix + "_depth.pfm")))
+        {
+          std::clog << "Could not write the feature buffers to " << feature_file_prefix << "_*.pfm\n";
+        }
+      }
 
       std::clog << "\rDone.                 \n";
+      std::clog << "Rays: " << statistics.rays << ", shadow rays: " << statistics.shadow_rays
+                << " (" << statistics.raysPerSecond() / 1e6 << " Mrays/s)"
+                << ", mean path length: " << statistics.meanPathLength()
+                << ", russian roulette terminations: " << statistics.roulette_terminations << '\n';
+
+      if (time_budget > 0)
+      {
+        std::clog << "Reached " << statistics.samples_per_pixel << " samples per pixel in "
+                  << statistics.passes << " passes\n";
+      }
+
+      if (!statistics_file.empty() && !writeStatistics(statistics_file))
+      {
+        std::clog << "Could not write the statistics to " << statistics_file << '\n';
+      }
+
+      if (adaptive_sampling && time_budget <= 0)
+      {
+        std::clog << "Mean samples per pixel: " << double(statistics.paths) / (double(image_width) * image_height)
+                  << " (" << adaptive_min_samples << " to " << sample_per_pixel << ")\n";
+        if (!sample_heatmap_file.empty() && !sample_heatmap.write(sample_heatmap_file))
+        {
+          std::clog << "Could not write the sample heatmap to " << sample_heatmap_file << '\n';
+        }
+      }
+    }
+
+    bool writeStatistics(const std::string& filename) const
+    {
+      // Write the statistics of the last render as a JSON report.
+      std::ofstream out(filename);
+      if (!out) return false;
+
+      out << "{\n";
+      out << "  \"image_width\": " << image_width << ",\n";
+      out << "  \"image_height\": " << image_height << ",\n";
+      out << "  \"seconds\": " << statistics.seconds << ",\n";
+      out << "  \"samples_per_pixel\": " << statistics.samples_per_pixel << ",\n";
+      out << "  \"passes\": " << statistics.passes << ",\n";
+      out << "  \"paths\": " << statistics.paths << ",\n";
+      out << "  \"rays\": " << statistics.rays << ",\n";
+      out << "  \"shadow_rays\": " << statistics.shadow_rays << ",\n";
+      out << "  \"roulette_terminations\": " << statistics.roulette_terminations << ",\n";
+      out << "  \"counters_enabled\": " << (RTW_ENABLE_STATS ? "true" : "false") << ",\n";
+      out << "  \"counters\": ";
+      trace_statistics.writeJSON(out, "  ");
+      out << "\n}\n";
+      return bool(out);
     }
 
   private:
@@ -65,12 +276,388 @@ class Camera
     Point3 pixel00_location;  // Location of pixel 0, 0
     Vector3 pixel_delta_u;    // Offset to pixel to the right
     Vector3 pixel_delta_v;    // Offset to pixel below
+    double pixel_spread;      // Angle subtended by a pixel, the spread of the camera ray cones
     Vector3 u, v, w;          // Camera frame basis vetors
     Vector3 defocus_disk_u;   //Defocus disk horizontal radius
     Vector3 defocus_disk_v;   //Defocus disk vertical radius
+    shared_ptr<Sampler> sampler; // Sampler of sampler_type, null for independent random numbers
+    HittableList sampled_lights; // Lights of the current render, empty without light sampling
+
+    struct Tile
+    {
+      int x0, y0; // Upper left pixel of the tile, inclusive
+      int x1, y1; // Lower right pixel of the tile, exclusive
+    };
+
+    struct SamplePass
+    {
+      int first_sample = 0; // Index of the first sample of every pixel
+      int sample_count = 0; // Samples per pixel
+      double scale = 1.0;   // Factor applied to the sum of the samples
+      bool adaptive = false; // Sample each pixel adaptively instead, up to sample_per_pixel
+      bool has_deadline = false;
+      std::chrono::steady_clock::time_point deadline; // Tiles stop at this time, if has_deadline
+      int buffer_x = 0, buffer_y = 0; // Image coordinates of the top left pixel of the framebuffers
+    };
+
+    bool renderPass(const Hittable &world, const std::vector<Tile> &tiles, const SamplePass &pass,
+                    Framebuffer &framebuffer)
+    {
+      // Render every tile of one pass. Returns false if the deadline interrupted it.
+      std::atomic<size_t> tiles_remaining(tiles.size());
+      std::atomic<bool> interrupted(false);
+      std::mutex log_mutex;
+
+      WorkStealingScheduler::run(tiles.size(), thread_count, [&](size_t tile_index, int)
+      {
+        RenderStatistics tile_statistics;
+        if (interrupted || !renderTile(world, tiles[tile_index], tile_index, pass, framebuffer, sample_heatmap,
+                                       tile_statistics))
+        {
+          interrupted = true;
+        }
+
+        size_t remaining = --tiles_remaining;
+        std::lock_guard<std::mutex> lock(log_mutex);
+        statistics.merge(tile_statistics);
+#if RTW_ENABLE_STATS
+        trace_statistics.merge(threadTraceStatistics());
+        threadTraceStatistics().clear();
+#endif
+        std::clog << "\rTiles remaining: " << remaining << ' ' << std::flush;
+      });
+
+      return !interrupted;
+    }
+
+    void renderDistributed(const Hittable &world, const std::vector<Tile> &tiles, const SamplePass &pass,
+                           Framebuffer &framebuffer)
+    {
+      // Each worker process renders a tile into a buffer of the tile's size and sends it back
+      // with the tile statistics (and sample counts when adaptive); the coordinator copies it
+      // into the image. The image is the same as a render in this process.
+      size_t tiles_remaining = tiles.size();
+
+      auto render_tile = [&](size_t tile_index)
+      {
+        const Tile& tile = tiles[tile_index];
+        Framebuffer tile_buffer(tile.x1 - tile.x0, tile.y1 - tile.y0);
+        Framebuffer tile_heatmap = pass.adaptive ? Framebuffer(tile_buffer.width(), tile_buffer.height()) : Framebuffer();
+        SamplePass tile_pass = pass;
+        tile_pass.buffer_x = tile.x0;
+        tile_pass.buffer_y = tile.y0;
+
+        RenderStatistics tile_statistics;
+        threadTraceStatistics().clear();
+        renderTile(world, tile, tile_index, tile_pass, tile_buffer, tile_heatmap, tile_statistics);
+
+        std::vector<unsigned char> result;
+        uint64_t counts[4] = { tile_statistics.paths, tile_statistics.rays, tile_statistics.shadow_rays,
+                               tile_statistics.roulette_terminations };
+        appendBytes(result, counts, sizeof(counts));
+        appendBytes(result, &threadTraceStatistics(), sizeof(TraceStatistics));
+        size_t value_count = size_t(tile_buffer.width()) * tile_buffer.height() * 3;
+        appendBytes(result, tile_buffer.data(), value_count * sizeof(float));
+        if (pass.adaptive) appendBytes(result, tile_heatmap.data(), value_count * sizeof(float));
+        return result;
+      };
+
+      ProcessScheduler::run(tiles.size(), worker_processes, render_tile,
+      [&](size_t tile_index, const std::vector<unsigned char>& received)
+      {
+        const Tile& tile = tiles[tile_index];
+        int width = tile.x1 - tile.x0;
+        size_t value_count = size_t(width) * (tile.y1 - tile.y0) * 3;
+        size_t expected_size = 4 * sizeof(uint64_t) + sizeof(TraceStatistics) + value_count * sizeof(float) * (pass.adaptive ? 2 : 1);
+
+        // A damaged result is rendered again here; the tile is deterministic, so the image
+        // stays the same.
+        const std::vector<unsigned char>* result = &received;
+        std::vector<unsigned char> local_result;
+        if (received.size() != expected_size)
+        {
+          std::clog << "\nTile " << tile_index << " came back with " << received.size() << " bytes instead of "
+                    << expected_size << ", rendering it here.\n";
+          local_result = render_tile(tile_index);
+          result = &local_result;
+        }
+
+        const unsigned char* read = result->data();
+        uint64_t counts[4];
+        std::memcpy(counts, read, sizeof(counts));
+        read += sizeof(counts);
+        RenderStatistics tile_statistics;
+        tile_statistics.paths = counts[0];
+        tile_statistics.rays = counts[1];
+        tile_statistics.shadow_rays = counts[2];
+        tile_statistics.roulette_terminations = counts[3];
+        statistics.merge(tile_statistics);
+
+        TraceStatistics tile_trace_statistics;
+        std::memcpy(&tile_trace_statistics, read, sizeof(TraceStatistics));
+        read += sizeof(TraceStatistics);
+        trace_statistics.merge(tile_trace_statistics);
+
+        Framebuffer* targets[2] = { &framebuffer, &sample_heatmap };
+        for (int target = 0; target < (pass.adaptive ? 2 : 1); target++)
+        {
+          for (int j = tile.y0; j < tile.y1; j++)
+          {
+            size_t row_bytes = size_t(width) * 3 * sizeof(float);
+            float* row = targets[target]->data() + (size_t(j) * image_width + tile.x0) * 3;
+            std::memcpy(row, read, row_bytes);
+            read += row_bytes;
+          }
+        }
+
+        std::clog << "\rTiles remaining: " << --tiles_remaining << ' ' << std::flush;
+      });
+    }
+
+    static void appendBytes(std::vector<unsigned char> &bytes, const void *data, size_t size)
+    {
+      const unsigned char* first = static_cast<const unsigned char*>(data);
+      bytes.insert(bytes.end(), first, first + size);
+    }
+
+    void renderProgressive(const Hittable &world, const std::vector<Tile> &tiles,
+                           std::chrono::steady_clock::time_point start_time, Framebuffer &framebuffer)
+    {
+      // Each pass takes twice the samples of the previous one, as long as the time per sample
+      // measured so far says it will end before the deadline; otherwise it takes what fits.
+      using Clock = std::chrono::steady_clock;
+      auto seconds = [](Clock::duration duration) { return std::chrono::duration<double>(duration).count(); };
+      Clock::time_point deadline = start_time + std::chrono::duration_cast<Clock::duration>(
+                                                  std::chrono::duration<double>(time_budget));
+
+      Framebuffer accumulation(image_width, image_height);
+      Framebuffer pass_buffer(image_width, image_height);
+      size_t value_count = size_t(image_width) * image_height * 3;
+      int samples_done = 0;
+      int pass_samples = 1;
+      double seconds_per_sample = 0;
+      Clock::time_point next_progress_image = start_time + std::chrono::duration_cast<Clock::duration>(
+                                                             std::chrono::duration<double>(progress_interval));
+
+      while (true)
+      {
+        double remaining = seconds(deadline - Clock::now());
+        if (seconds_per_sample > 0)
+        {
+          pass_samples = int(std::min<double>(pass_samples, remaining / seconds_per_sample));
+        }
+        if (remaining <= 0 || pass_samples < 1) break;
+
+        SamplePass pass;
+        pass.first_sample = samples_done;
+        pass.sample_count = pass_samples;
+        pass.has_deadline = true;
+        pass.deadline = deadline;
+
+        Clock::time_point pass_start = Clock::now();
+        if (!renderPass(world, tiles, pass, pass_buffer)) break;
+        seconds_per_sample = seconds(Clock::now() - pass_start) / pass_samples;
+
+        float* sums = accumulation.data();
+        const float* pass_sums = pass_buffer.data();
+        for (size_t index = 0; index < value_count; index++) sums[index] += pass_sums[index];
+        samples_done += pass_samples;
+        statistics.passes++;
+        std::clog << "\rPass " << statistics.passes << ": " << samples_done << " samples per pixel after "
+                  << seconds(Clock::now() - start_time) << " s\n";
+
+        if (progress_interval > 0 && !progress_file.empty() && Clock::now() >= next_progress_image)
+        {
+          if (!averageOf(accumulation, samples_done).write(progress_file))
+          {
+            std::clog << "Could not write the intermediate image to " << progress_file << '\n';
+          }
+          while (next_progress_image <= Clock::now())
+          {
+            next_progress_image += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(progress_interval));
+          }
+        }
+
+        pass_samples = pass_samples > std::numeric_limits<int>::max() / 2 ? pass_samples : 2 * pass_samples;
+      }
+
+      if (samples_done == 0)
+      {
+        std::clog << "\nThe time budget ended before the first pass, the image is black.\n";
+      }
+      framebuffer = averageOf(accumulation, samples_done);
+      statistics.samples_per_pixel = samples_done;
+    }
+
+    static Framebuffer averageOf(const Framebuffer &sums, int sample_count)
+    {
+      Framebuffer average = sums;
+      if (sample_count > 0)
+      {
+        float scale = 1.0f / sample_count;
+        float* values = average.data();
+        size_t value_count = size_t(average.width()) * average.height() * 3;
+        for (size_t index = 0; index < value_count; index++) values[index] *= scale;
+      }
+      return average;
+    }
+
+    bool renderTile(const Hittable &world, const Tile &tile, size_t tile_index, const SamplePass &pass,
+                    Framebuffer &framebuffer, Framebuffer &heatmap, RenderStatistics &tile_statistics) const
+    {
+      // Render the samples of the pass for every pixel of the tile. Returns false if the
+      // deadline of the pass interrupted the tile.
+      // In the streaming mode every tile restarts the calling thread's random sequence from its
+      // own index, so a pixel gets the same samples whichever thread renders it. The counter
+      // based mode goes further and keys each path on its pixel and sample, so the image does
+      // not depend on the tile size either.
+      PathSamplesScope path_samples_scope;
+      RandomEngine& engine = randomEngine();
+      if (!counter_based_random)
+      {
+        engine.seed(RandomEngine::mix(random_seed ^ tile_index ^ (uint64_t(pass.first_sample) << 32)));
+      }
+
+      for (int j = tile.y0; j < tile.y1; j++)
+      {
+        if (pass.has_deadline && std::chrono::steady_clock::now() >= pass.deadline) return false;
+
+        for (int i = tile.x0; i < tile.x1; i++)
+        {
+          // Tiles never overlap, so each pixel is written by exactly one thread.
+          int x = i - pass.buffer_x;
+          int y = j - pass.buffer_y;
+          Color pixel_color(0, 0, 0);
+          if (pass.adaptive)
+          {
+            int samples = renderPixelAdaptive(world, i, j, pixel_color, tile_statistics);
+            double fraction = double(samples) / sample_per_pixel;
+            framebuffer.setPixel(x, y, pixel_color);
+            heatmap.setPixel(x, y, Color(fraction, fraction, fraction));
+            continue;
+          }
+
+          for (int sample = pass.first_sample; sample < pass.first_sample + pass.sample_count; sample++)
+          {
+            pixel_color += pixelSample(world, i, j, sample, tile_statistics);
+          }
+          framebuffer.setPixel(x, y, pass.scale * pixel_color);
+        }
+      }
+      return true;
+    }
+
+    int renderPixelAdaptive(const Hittable &world, int i, int j, Color &pixel_mean,
+                            RenderStatistics &tile_statistics) const
+    {
+      // Sample the pixel until the standard error of its mean is below the threshold. The
+      // variance is tracked with Welford's running update on the luminance of each sample.
+      // The error is taken on the gamma corrected value the image will show: the output is
+      // sqrt(L), so an error e on L moves it by about e / (2 sqrt(L)). Returns the samples
+      // taken, and their mean in pixel_mean.
+      int max_samples = std::max(sample_per_pixel, 1);
+      int min_samples = std::clamp(adaptive_min_samples, 1, max_samples);
+      int batch_size = std::max(adaptive_batch_size, 1);
+
+      Color pixel_color(0, 0, 0);
+      double mean = 0, squared_deviations = 0;
+      int sample = 0;
+      int next_check = min_samples;
+      while (sample < max_samples)
+      {
+        Color sample_color = pixelSample(world, i, j, sample, tile_statistics);
+        pixel_color += sample_color;
+        sample++;
+
+        double value = luminance(sample_color);
+        double delta = value - mean;
+        mean += delta / sample;
+        squared_deviations += delta * (value - mean);
+
+        if (sample == next_check)
+        {
+          double variance = squared_deviations / std::max(sample - 1, 1);
+          double standard_error = std::sqrt(variance / sample);
+          double display_error = standard_error / (2.0 * std::sqrt(std::fmax(mean, 1e-4)));
+          if (display_error <= adaptive_error_threshold) break;
+          next_check = std::min(sample + batch_size, max_samples);
+        }
+      }
+
+      pixel_mean = pixel_color / sample;
+      return sample;
+    }
+
+    void renderFeatures(const Hittable &world, const std::vector<Tile> &tiles)
+    {
+      // Trace the first samples of every pixel to their first hit, keyed like the render's own
+      // paths, and average the features of the hits.
+      int sample_count = std::clamp(statistics.samples_per_pixel, 1, std::max(max_feature_samples, 1));
+      features.albedo = Framebuffer(image_width, image_height);
+      features.normal = Framebuffer(image_width, image_height);
+      features.depth = Framebuffer(image_width, image_height);
+
+      WorkStealingScheduler::run(tiles.size(), thread_count, [&](size_t tile_index, int)
+      {
+        const Tile& tile = tiles[tile_index];
+        PathSamplesScope path_samples_scope;
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+          for (int i = tile.x0; i < tile.x1; i++)
+          {
+            Color albedo(0, 0, 0), normal(0, 0, 0);
+            double depth = 0;
+            for (int sample = 0; sample < sample_count; sample++)
+            {
+              randomEngine().beginPath(random_seed, uint64_t(j) * image_width + i, sample);
+              pathSamples().beginPath(sampler.get(), i, j, sample);
+              Ray ray = getRay(i, j);
+              HitRecord record;
+              if (!world.hit(ray, Interval(0.001, infinity), record))
+              {
+                albedo += background(ray);
+                continue;
+              }
+              albedo += record.material->surfaceAlbedo(ray, record);
+              normal += record.normal;
+              depth += record.t * ray.direction().length();
+            }
+
+            double scale = 1.0 / sample_count;
+            features.albedo.setPixel(i, j, scale * albedo);
+            features.normal.setPixel(i, j, scale * normal);
+            features.depth.setPixel(i, j, Color(scale * depth, scale * depth, scale * depth));
+          }
+        }
+      });
+    }
+
+    Color pixelSample(const Hittable &world, int i, int j, int sample, RenderStatistics &tile_statistics) const
+    {
+      // Trace one camera path through pixel i, j. Keyed on its sample index, a sample draws the
+      // same random numbers however many samples the pixel ends up taking.
+      if (counter_based_random)
+      {
+        randomEngine().beginPath(random_seed, uint64_t(j) * image_width + i, sample);
+      }
+      pathSamples().beginPath(sampler.get(), i, j, sample);
+      Ray ray = getRay(i, j);
+      return rayColor(ray, world, tile_statistics);
+    }
+
+    static double luminance(const Color &color)
+    {
+      // Rec. 709 luminance of a linear color.
+      return 0.2126 * color.x() + 0.7152 * color.y() + 0.0722 * color.z();
+    }
 
     void initialize()
     {
+      // Settings out of range: tiles of at least one pixel, and a negative thread count means
+      // every hardware thread, as 0 does.
+      tile_size = std::max(tile_size, 1);
+      thread_count = std::max(thread_count, 0);
+
       // Compute the pixel sample scale from the sample per pixel value.
       pixel_sample_scale = 1.0 / sample_per_pixel;
 
@@ -93,6 +680,7 @@ class Camera
       // Calculate the horizontal and vertical delta vectors from pixel to pixel.
       pixel_delta_u = viewport_u / image_width;
       pixel_delta_v = viewport_v / image_height;
+      pixel_spread = pixel_delta_u.length() / focus_distance;
 
       // Calculate the location of the upper left pixel.
       Vector3 viewport_upper_left = camera_center - (focus_distance * w) - viewport_u/2 - viewport_v/2;
@@ -103,6 +691,7 @@ class Camera
       defocus_disk_u = u * defocus_radius;
       defocus_disk_v = v * defocus_radius;
 
+      sampler = Sampler::create(sampler_type, sample_per_pixel, random_seed);
     }
 
     Ray getRay(int i, int j) const
@@ -110,6 +699,8 @@ class Camera
       // Construct a camera ray originating from the defocis disk and directed at randomly sampled
       // Point around the pixel location i, j.
 
+      // With a sampler, the values come from the camera dimensions of the path.
+      const PathSamples& samples = pathSamples();
       Vector3 offset = sampleSquare();
       Vector3 pixel_sample = pixel00_location + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
 
@@ -117,47 +708,169 @@ class Camera
       Vector3 ray_direction = pixel_sample - ray_origin;
 
       // Sample the scene at random time [0;1]
-      double ray_time = randomDouble();
+      double ray_time = samples.active() ? samples.at(PathSamples::time_dimension) : randomDouble();
 
-      return Ray(ray_origin, ray_direction, ray_time);
+      Ray ray(ray_origin, ray_direction, ray_time);
+      ray.setCone(0, pixel_spread);
+      return ray;
     }
 
     Vector3 sampleSquare() const
     {
       // Returns the vector to a random point in the [-0.5, -0.5]-[0.5, 0.5] unit square.
+      const PathSamples& samples = pathSamples();
+      if (samples.active())
+      {
+        double x, y;
+        samples.at2D(PathSamples::pixel_dimension, x, y);
+        return Vector3(x - 0.5, y - 0.5, 0);
+      }
       return Vector3(randomDouble() - 0.5, randomDouble() - 0.5, 0);
     }
 
     Point3 defocusDiskSample() const 
     {
       // returns a random point in the camera defocus disk.
-      Point3 p = randomInUnitDisk();
+      // A sampler's values are mapped to the disk rather than rejected, to keep their strata.
+      const PathSamples& samples = pathSamples();
+      Point3 p;
+      if (samples.active())
+      {
+        double x, y;
+        samples.at2D(PathSamples::lens_dimension, x, y);
+        p = concentricDiskSample(x, y);
+      }
+      else
+      {
+        p = randomInUnitDisk();
+      }
       return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    Color rayColor(const Ray &ray, int depth, const Hittable &world) const
+    Color rayColor(const Ray &camera_ray, const Hittable &world, RenderStatistics &path_statistics) const
     {
-      // If we have exceeded the ray bounce imit, no more is gathered.
-      if (depth <= 0)
-      {
-        return Color(0, 0, 0);
-      }
+      // Follow the path iteratively, carrying the product of the attenuations met so far
+      // (the path throughput) instead of recursing once per bounce.
+      Ray ray = camera_ray;
+      Color throughput(1.0, 1.0, 1.0);
+      Color radiance(0.0, 0.0, 0.0);
+      double scatter_pdf = 0; // Density the last bounce picked the ray with, 0 if singular
+      bool sample_lights = !sampled_lights.objects.empty();
+      path_statistics.paths++;
 
-      HitRecord record;
-      // Render the objects in the scene
-      // Ignore hits that are very close to the calculated intersection point.
-      if(world.hit(ray, Interval(0.001, infinity), record))
+      // Stop gathering light once the ray bounce limit is reached.
+      for (int bounce = 0; bounce < max_depth; bounce++)
       {
+        HitRecord record;
+        path_statistics.rays++;
+        if (bounce == 0) RTW_COUNT(PrimaryRays);
+        else RTW_COUNT(SecondaryRays);
+
+        // Render the objects in the scene
+        // Ignore hits that are very close to the calculated intersection point.
+        if (!world.hit(ray, Interval(0.001, infinity), record))
+        {
+          RTW_COUNT_PATH_LENGTH(bounce + 1);
+          return radiance + throughput * background(ray);
+        }
+
+        if (record.material->emits())
+        {
+          // Light sampling at the previous bounce could have found this emitter too, unless the
+          // ray left the camera or a singular bounce: weigh the two ways against each other.
+          double weight = 1;
+          if (sample_lights && scatter_pdf > 0)
+          {
+            weight = powerHeuristic(scatter_pdf, sampled_lights.directionPdf(ray.origin(), ray.direction(), ray.time()));
+          }
+          radiance += weight * throughput * record.material->emitted(ray, record);
+        }
+
+        // Key the random numbers of this scatter event on the bounce index.
+        randomEngine().beginBounce(bounce + 1);
+        pathSamples().beginBounce(bounce);
+
         Ray scattered;
         Color attenuation;
-        if (record.material->scatter(ray, record, attenuation, scattered))
+        if (!record.material->scatter(ray, record, attenuation, scattered))
+        {
+          RTW_COUNT_PATH_LENGTH(bounce + 1);
+          return radiance;
+        }
+
+        if (sample_lights)
         {
-          return attenuation * rayColor(scattered, depth-1, world);
+          scatter_pdf = record.material->scatteringPdf(ray, record, scattered.direction());
+          if (scatter_pdf > 0) radiance += throughput * sampleLight(world, ray, record, path_statistics);
         }
+        throughput = throughput * attenuation;
+
+        // The cone keeps widening from the footprint it had on the surface.
+        scattered.setCone(ray.coneWidthAt(record.t), ray.coneSpread());
+
+        // Russian roulette: past the start depth, keep the path with a probability that follows
+        // its throughput, and divide the survivors by that probability so the estimate stays
+        // unbiased. Dark paths end early instead of running to the depth limit. The last bounce
+        // traces no further ray, so it has nothing to roll for.
+        if (bounce + 1 >= russian_roulette_depth && bounce + 1 < max_depth)
+        {
+          double survival = std::min(std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())), 0.95);
+          if (pathSamples().roulette() >= survival)
+          {
+            path_statistics.roulette_terminations++;
+            RTW_COUNT_PATH_LENGTH(bounce + 1);
+            return radiance;
+          }
+          throughput = throughput / survival;
+        }
+
+        ray = scattered;
+      }
+      RTW_COUNT_PATH_LENGTH(max_depth);
+      return radiance;
+    }
+
+    Color sampleLight(const Hittable &world, const Ray &ray, const HitRecord &record,
+                      RenderStatistics &path_statistics) const
+    {
+      // Light reaching the hit point straight from a point sampled on the lights, through a
+      // shadow ray, weighted against the chance that the scattered ray finds it.
+      double u, v;
+      pathSamples().light(u, v);
+      Vector3 direction = sampled_lights.sampleDirection(record.hit_impact, ray.time(), u, v);
+      double light_pdf = sampled_lights.directionPdf(record.hit_impact, direction, ray.time());
+      if (light_pdf <= 0) return Color(0, 0, 0);
+
+      Color bsdf = record.material->evaluate(ray, record, direction);
+      if (bsdf.x() <= 0 && bsdf.y() <= 0 && bsdf.z() <= 0) return Color(0, 0, 0);
+
+      // The shadow ray reaches the sampled point at t = 1. Whatever it hits first is what
+      // lights the point, a light or not.
+      Ray shadow_ray(record.hit_impact, direction, ray.time());
+      HitRecord shadow_record;
+      path_statistics.shadow_rays++;
+      RTW_COUNT(ShadowRays);
+      if (!world.hit(shadow_ray, Interval(0.001, infinity), shadow_record) || !shadow_record.material->emits())
+      {
         return Color(0, 0, 0);
       }
 
+      double weight = powerHeuristic(light_pdf, record.material->scatteringPdf(ray, record, direction));
+      return (weight / light_pdf) * bsdf * shadow_record.material->emitted(shadow_ray, shadow_record);
+    }
+
+    static double powerHeuristic(double pdf, double other_pdf)
+    {
+      // Multiple importance sampling weight of a sample drawn with pdf, when other_pdf could
+      // have drawn it too (Veach's power heuristic, exponent 2).
+      double squared = pdf * pdf;
+      return squared / (squared + other_pdf * other_pdf);
+    }
+
+    Color background(const Ray &ray) const
+    {
       // Render the background
+      if (!sky_background) return background_color;
       Vector3 unit_direction = unit_vector(ray.direction());
       double a = 0.5 * (unit_direction.y() + 1.0);
       return (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
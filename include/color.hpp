@@ -1,6 +1,6 @@
 #pragma once
 
-#include <fstream>
+#include <ostream>
 
 #include "interval.hpp"
 #include "vector3.hpp"
@@ -16,50 +16,23 @@ inline double lineraToGamma(double linear_component)
   return 0.0;
 }
 
-/**
- * write_color function to push the image to standard output, 
- * usefull if the output is redirected to a file.
- */
-void write_color(std::ostream& out, const Color& pixel_color)
+inline unsigned char componentToByte(double linear_component)
 {
-  double r = pixel_color.x();
-  double g = pixel_color.y();
-  double b = pixel_color.z();
-
-  // Apply a linear to gamma transform for gamma 2
-  r = lineraToGamma(r);
-  g = lineraToGamma(g);
-  b = lineraToGamma(b);
-
-  // Map the [0, 1] component values to byte range [0, 255]
+  // Apply a linear to gamma transform for gamma 2, then map the [0, 1] value to byte range
+  // [0, 255].
   static const Interval intensity(0.000, 0.999);
-  int rbyte = int(256 * intensity.clamp(r));
-  int gbyte = int(256 * intensity.clamp(g));
-  int bbyte = int(256 * intensity.clamp(b));
-
-  // Write out the pixel color components
-  out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+  return static_cast<unsigned char>(256 * intensity.clamp(lineraToGamma(linear_component)));
 }
 
 /**
- * write_color function to write colors to an already existing image file.
+ * write_color function to push one pixel as ASCII text to any output stream (standard
+ * output, an image file, ...).
  */
-void write_color(std::ofstream& out, const Color& pixel_color)
+inline void write_color(std::ostream& out, const Color& pixel_color)
 {
-  double r = pixel_color.x();
-  double g = pixel_color.y();
-  double b = pixel_color.z();
-
-  // Apply a linear to gamma transform for gamma 2
-  r = lineraToGamma(r);
-  g = lineraToGamma(g);
-  b = lineraToGamma(b);
-
-  // Map the [0, 1] component values to byte range [0, 255]
-  static const Interval intensity(0.000, 0.999);
-  int rbyte = int(256 * intensity.clamp(r));
-  int gbyte = int(256 * intensity.clamp(g));
-  int bbyte = int(256 * intensity.clamp(b));
+  int rbyte = componentToByte(pixel_color.x());
+  int gbyte = componentToByte(pixel_color.y());
+  int bbyte = componentToByte(pixel_color.z());
 
   // Write out the pixel color components
   out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
@@ -0,0 +1,25 @@
+#pragma once
+
+// On x86-64, SSE2 is part of the baseline instruction set and is used directly. AVX2 kernels
+// are compiled per function with a target attribute, so the rest of the program keeps the
+// baseline instruction set and the AVX2 kernels are only called when the CPU supports them.
+// Other compilers and architectures only get the scalar fallbacks.
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+  #define RTW_X86_SIMD 1
+  #define RTW_TARGET_AVX2 __attribute__((target("avx2")))
+  #include <immintrin.h>
+#else
+  #define RTW_X86_SIMD 0
+  #define RTW_TARGET_AVX2
+#endif
+
+inline bool cpuSupportsAVX2()
+{
+#if RTW_X86_SIMD
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "scheduler.hpp"
+
+// Denoising of low sample count renders, guided by what the camera rays first hit. Noise comes
+// from the light bounced around the scene, while the edges of objects and textures show up,
+// noise free, in the features: so the filter averages neighbouring pixels as long as their
+// features agree, and stops at the edges they draw.
+
+struct FeatureBuffers
+{
+  Framebuffer albedo; // Color of the material at the first hit
+  Framebuffer normal; // Normal at the first hit, facing the camera; zero where rays leave the scene
+  Framebuffer depth;  // Distance from the camera to the first hit, in the three channels; zero where rays leave the scene
+};
+
+class Denoiser
+{
+  // Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet
+  // Transform for fast Global Illumination Filtering", 2010). Each pass blurs with a 5 x 5 B3
+  // spline kernel whose taps are 2^pass pixels apart, so a few passes cover a wide footprint
+  // at 25 taps per pixel each. Every tap is weighted by how far its normal, depth and color
+  // are from those of the center pixel. The color tolerance follows the noise: it shrinks with
+  // the square root of the sample count, and halves with every pass.
+  //
+  // The color is filtered divided by the albedo (the light reaching the surface, smooth across
+  // textures), and multiplied back after, so textures keep their detail.
+
+  public:
+    int iterations = 2;          // Passes; the last one reaches 2^iterations pixels each way
+    double color_sigma = 0.8;    // Color difference (on x / (1 + x) compressed values) halving a weight, at 1 sample per pixel
+    double normal_power = 8;     // The normal weight is the cosine between normals to this power
+    double depth_sigma = 0.05;   // Depth difference, relative to depth and per pixel of distance, halving a weight
+    int thread_count = 0;        // Rows are shared between these threads, 0 uses every hardware thread
+
+    Framebuffer denoise(const Framebuffer& color, const FeatureBuffers& features, int sample_count) const
+    {
+      int width = color.width(), height = color.height();
+      size_t pixel_count = size_t(width) * height;
+      const float* albedo = features.albedo.data();
+      const float* normal = features.normal.data();
+      const float* depth = features.depth.data();
+
+      // Demodulate; albedos near zero carry no light to spread, so they are left as they are.
+      std::vector<float> current(pixel_count * 3), next(pixel_count * 3);
+      for(size_t index = 0; index < pixel_count * 3; index++)
+      {
+        current[index] = albedo[index] > albedo_floor ? color.data()[index] / albedo[index] : color.data()[index];
+      }
+
+      for(int pass = 0; pass < iterations; pass++)
+      {
+        int step = 1 << pass;
+        double sigma_squared = color_sigma * color_sigma / std::max(sample_count, 1) * std::ldexp(1.0, -pass);
+        float color_scale = float(std::log(2.0) / sigma_squared);
+        float depth_scale = float(std::log(2.0) / depth_sigma);
+
+        WorkStealingScheduler::run(size_t(height), thread_count, [&](size_t row, int)
+        {
+          int y = int(row);
+          for(int x = 0; x < width; x++)
+          {
+            size_t center = size_t(y) * width + x;
+            const float* center_color = &current[center * 3];
+            const float* center_normal = &normal[center * 3];
+            float center_depth = depth[center * 3];
+            float compressed[3];
+            for(int channel = 0; channel < 3; channel++) compressed[channel] = compress(center_color[channel]);
+
+            float sum[3] = { 0, 0, 0 };
+            float weight_sum = 0;
+            for(int tap_y = -2; tap_y <= 2; tap_y++)
+            {
+              int sample_y = y + tap_y * step;
+              if(sample_y < 0 || sample_y >= height) continue;
+              for(int tap_x = -2; tap_x <= 2; tap_x++)
+              {
+                int sample_x = x + tap_x * step;
+                if(sample_x < 0 || sample_x >= width) continue;
+
+                size_t sample = size_t(sample_y) * width + sample_x;
+                const float* sample_color = &current[sample * 3];
+                const float* sample_normal = &normal[sample * 3];
+                float sample_depth = depth[sample * 3];
+
+                // Rays leaving the scene only mix with each other.
+                if((center_depth > 0) != (sample_depth > 0)) continue;
+
+                float weight = kernel[tap_x + 2] * kernel[tap_y + 2];
+                float exponent = 0;
+                if(center_depth > 0)
+                {
+                  float cosine = center_normal[0] * sample_normal[0] + center_normal[1] * sample_normal[1]
+                               + center_normal[2] * sample_normal[2];
+                  if(cosine <= 0) continue;
+                  weight *= std::pow(cosine, float(normal_power));
+
+                  float distance = float(std::max(std::abs(tap_x), std::abs(tap_y)) * step);
+                  exponent += depth_scale * std::fabs(center_depth - sample_depth) / (center_depth * distance + 1e-6f);
+                }
+
+                float color_distance = 0;
+                for(int channel = 0; channel < 3; channel++)
+                {
+                  float difference = compressed[channel] - compress(sample_color[channel]);
+                  color_distance += difference * difference;
+                }
+                exponent += color_scale * color_distance;
+                weight *= std::exp(-exponent);
+
+                for(int channel = 0; channel < 3; channel++) sum[channel] += weight * sample_color[channel];
+                weight_sum += weight;
+              }
+            }
+
+            // Only a pixel whose samples hit opposite faces (an averaged normal of zero) can
+            // reject even its own tap; it stays as it is.
+            for(int channel = 0; channel < 3; channel++)
+            {
+              next[center * 3 + channel] = weight_sum > 0 ? sum[channel] / weight_sum : center_color[channel];
+            }
+          }
+        });
+        current.swap(next);
+      }
+
+      Framebuffer result(width, height);
+      for(size_t index = 0; index < pixel_count * 3; index++)
+      {
+        result.data()[index] = albedo[index] > albedo_floor ? current[index] * albedo[index] : current[index];
+      }
+      return result;
+    }
+
+  private:
+    static constexpr float albedo_floor = 1e-3f;
+    static constexpr float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+    static float compress(float value)
+    {
+      // Bright outliers (fireflies) stay within reach of their neighbours.
+      return value / (1 + value);
+    }
+};
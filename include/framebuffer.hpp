@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "color.hpp"
+
+class Framebuffer
+{
+  // Linear radiance of a whole image, three floats per pixel, row-major from the top left.
+  // The writers convert and emit the whole buffer in one pass.
+
+  public:
+    Framebuffer() {}
+
+    Framebuffer(int width, int height)
+      : image_width(width), image_height(height), pixels(size_t(width) * height * 3, 0.0f) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    Color pixel(int x, int y) const
+    {
+      const float* rgb = &pixels[index(x, y)];
+      return Color(rgb[0], rgb[1], rgb[2]);
+    }
+
+    void setPixel(int x, int y, const Color& color)
+    {
+      float* rgb = &pixels[index(x, y)];
+      rgb[0] = float(color.x());
+      rgb[1] = float(color.y());
+      rgb[2] = float(color.z());
+    }
+
+    void addPixel(int x, int y, const Color& color)
+    {
+      float* rgb = &pixels[index(x, y)];
+      rgb[0] += float(color.x());
+      rgb[1] += float(color.y());
+      rgb[2] += float(color.z());
+    }
+
+    const float* data() const { return pixels.data(); }
+    float* data() { return pixels.data(); }
+
+    void writePPM(std::ostream& out) const
+    {
+      // Binary (P6) PPM, gamma corrected 8-bit RGB.
+      out << "P6\n" << image_width << ' ' << image_height << "\n255\n";
+      std::vector<unsigned char> bytes = toBytes();
+      out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+    }
+
+    void writePFM(std::ostream& out) const
+    {
+      // Portable Float Map: linear 32-bit float RGB, little endian (negative scale), with the
+      // scanlines stored from the bottom of the image up.
+      out << "PF\n" << image_width << ' ' << image_height << "\n-1.0\n";
+
+      std::vector<float> scanlines(pixels.size());
+      size_t row_floats = size_t(image_width) * 3;
+      for(int y = 0; y < image_height; y++)
+      {
+        std::memcpy(&scanlines[(image_height - 1 - y) * row_floats], &pixels[y * row_floats], row_floats * sizeof(float));
+      }
+
+      if(!isLittleEndian())
+      {
+        for(float& value : scanlines) value = byteSwap(value);
+      }
+      out.write(reinterpret_cast<const char*>(scanlines.data()), std::streamsize(scanlines.size() * sizeof(float)));
+    }
+
+    void writePNG(std::ostream& out) const
+    {
+      // Gamma corrected 8-bit RGB PNG. The image data goes in uncompressed (stored) deflate
+      // blocks: the file is larger than a compressed PNG, but writing it costs a single pass
+      // over the pixels and no compression library is needed.
+
+      size_t row_bytes = size_t(image_width) * 3;
+      std::vector<unsigned char> bytes = toBytes();
+
+      // Raw scanlines, each prefixed with filter type 0 (none).
+      std::vector<unsigned char> raw;
+      raw.reserve((row_bytes + 1) * image_height);
+      for(int y = 0; y < image_height; y++)
+      {
+        raw.push_back(0);
+        raw.insert(raw.end(), bytes.begin() + y * row_bytes, bytes.begin() + (y + 1) * row_bytes);
+      }
+
+      // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32 of the raw data.
+      std::vector<unsigned char> zlib = { 0x78, 0x01 };
+      size_t block_count = raw.empty() ? 1 : (raw.size() + 65534) / 65535;
+      zlib.reserve(raw.size() + block_count * 5 + 6);
+      for(size_t block = 0; block < block_count; block++)
+      {
+        size_t begin = block * 65535;
+        size_t length = std::min<size_t>(65535, raw.size() - begin);
+        bool last = block + 1 == block_count;
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(uint8_t(length));
+        zlib.push_back(uint8_t(length >> 8));
+        zlib.push_back(uint8_t(~length));
+        zlib.push_back(uint8_t(~length >> 8));
+        zlib.insert(zlib.end(), raw.begin() + begin, raw.begin() + begin + length);
+      }
+      pushBigEndian(zlib, adler32(raw));
+
+      std::vector<unsigned char> header;
+      pushBigEndian(header, uint32_t(image_width));
+      pushBigEndian(header, uint32_t(image_height));
+      header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bits per channel, RGB, no interlace
+
+      static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+      out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+      writePNGChunk(out, "IHDR", header);
+      writePNGChunk(out, "IDAT", zlib);
+      writePNGChunk(out, "IEND", {});
+    }
+
+    bool write(const std::string& filename) const
+    {
+      // Write the image in the format given by the file extension: .png, .pfm, or binary PPM
+      // for anything else. Returns false if the file could not be written.
+      std::ofstream out(filename, std::ios::binary);
+      if(!out) return false;
+
+      if(hasExtension(filename, ".png")) writePNG(out);
+      else if(hasExtension(filename, ".pfm")) writePFM(out);
+      else writePPM(out);
+
+      return bool(out);
+    }
+
+  private:
+    int image_width = 0;
+    int image_height = 0;
+    std::vector<float> pixels;
+
+    size_t index(int x, int y) const
+    {
+      return (size_t(y) * image_width + x) * 3;
+    }
+
+    std::vector<unsigned char> toBytes() const
+    {
+      // Same mapping as componentToByte(), NaN to 0 included, written as a branch-free loop
+      // the compiler can vectorize. The comparisons are false for NaN, which std::max and
+      // std::min would pass through.
+      // Raw pointers, as stores through unsigned char could otherwise alias the vectors.
+      std::vector<unsigned char> bytes(pixels.size());
+      const float* source = pixels.data();
+      unsigned char* target = bytes.data();
+      size_t count = pixels.size();
+      for(size_t i = 0; i < count; i++)
+      {
+        double linear = source[i] > 0 ? double(source[i]) : 0.0;
+        double gamma = std::sqrt(linear);
+        target[i] = static_cast<unsigned char>(256 * (gamma < 0.999 ? gamma : 0.999));
+      }
+      return bytes;
+    }
+
+    static bool hasExtension(const std::string& filename, const std::string& extension)
+    {
+      return filename.size() >= extension.size()
+          && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    static bool isLittleEndian()
+    {
+      uint16_t probe = 1;
+      unsigned char first_byte;
+      std::memcpy(&first_byte, &probe, 1);
+      return first_byte == 1;
+    }
+
+    static float byteSwap(float value)
+    {
+      uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      bits = (bits >> 24) | ((bits >> 8) & 0xff00u) | ((bits << 8) & 0xff0000u) | (bits << 24);
+      std::memcpy(&value, &bits, sizeof(bits));
+      return value;
+    }
+
+    static void pushBigEndian(std::vector<unsigned char>& bytes, uint32_t value)
+    {
+      bytes.push_back(uint8_t(value >> 24));
+      bytes.push_back(uint8_t(value >> 16));
+      bytes.push_back(uint8_t(value >> 8));
+      bytes.push_back(uint8_t(value));
+    }
+
+    static uint32_t adler32(const std::vector<unsigned char>& bytes)
+    {
+      uint32_t a = 1, b = 0;
+      size_t i = 0;
+      while(i < bytes.size())
+      {
+        // 5552 is the largest run that cannot overflow b before the modulo.
+        size_t run_end = std::min(bytes.size(), i + 5552);
+        for(; i < run_end; i++)
+        {
+          a += bytes[i];
+          b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+      }
+      return (b << 16) | a;
+    }
+
+    static uint32_t crc32(const char* type, const std::vector<unsigned char>& bytes)
+    {
+      static const std::vector<uint32_t> table = []
+      {
+        std::vector<uint32_t> entries(256);
+        for(uint32_t n = 0; n < 256; n++)
+        {
+          uint32_t c = n;
+          for(int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+          entries[n] = c;
+        }
+        return entries;
+      }();
+
+      uint32_t crc = 0xffffffffu;
+      for(int i = 0; i < 4; i++) crc = table[(crc ^ uint8_t(type[i])) & 0xff] ^ (crc >> 8);
+      for(unsigned char byte : bytes) crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+      return crc ^ 0xffffffffu;
+    }
+
+    static void writePNGChunk(std::ostream& out, const char* type, const std::vector<unsigned char>& data)
+    {
+      std::vector<unsigned char> framing;
+      pushBigEndian(framing, uint32_t(data.size()));
+      out.write(reinterpret_cast<const char*>(framing.data()), 4);
+      out.write(type, 4);
+      out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+      framing.clear();
+      pushBigEndian(framing, crc32(type, data));
+      out.write(reinterpret_cast<const char*>(framing.data()), 4);
+    }
+};
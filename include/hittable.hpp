@@ -6,13 +6,17 @@ class Material; // Define the Material class here to avoid circular reference is
 
 class HitRecord
 {
+  // The material is a plain pointer to a material owned by the scene objects (through their
+  // shared_ptr<Material>), so filling or copying a record never touches a reference count.
+
   public:
     Point3 hit_impact;
     Vector3 normal;
-    shared_ptr<Material> material;
+    const Material* material;
     double t;
     double u;
     double v;
+    double uv_scale;  // Texture (u, v) units per world unit around the hit point
     bool front_face;
 
     void setFaceNormal(const Ray &ray, const Vector3 &outward_normal)
@@ -29,7 +33,29 @@ class Hittable
 {
   public:
     virtual ~Hittable() = default;
+    // Implementations must only write to the record when they report a hit, so callers can
+    // pass the same record to several objects.
     virtual bool hit(const Ray &ray, Interval ray_t, HitRecord &record) const = 0;
 
     virtual AABB boundingBox() const = 0;
+
+    // The bounding box of the object as it is at a time of the shutter interval [0, 1]. Moving
+    // objects override it; boundingBox() covers their whole motion.
+    virtual AABB boundingBoxAt(double time) const
+    {
+      return boundingBox();
+    }
+
+    // Light sampling, for the objects a scene lists as lights: a direction from origin towards
+    // a point of the object, drawn from two values in [0, 1), and the solid angle density with
+    // which a direction is drawn. Objects that cannot be sampled have a zero density.
+    virtual Vector3 sampleDirection(const Point3& origin, double time, double u, double v) const
+    {
+      return Vector3(0, 0, 1);
+    }
+
+    virtual double directionPdf(const Point3& origin, const Vector3& direction, double time) const
+    {
+      return 0;
+    }
 };
\ No newline at end of file
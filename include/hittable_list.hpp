@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 
 #include "aabb.hpp"
@@ -23,17 +24,17 @@ class HittableList : public Hittable
 
     bool hit(const Ray &ray, Interval ray_t, HitRecord &record) const override
     {
-      HitRecord temp_hit_record;
+      // Objects only write the record on a hit, and the interval shrinks to the closest hit so
+      // far, so every hit overwrites the record with a closer one: no temporary copy needed.
       bool hit_anything = false;
       auto closest_so_far = ray_t.max;
 
       for(const auto &object : objects)
       {
-        if(object->hit(ray, Interval(ray_t.min, closest_so_far), temp_hit_record))
+        if(object->hit(ray, Interval(ray_t.min, closest_so_far), record))
         {
           hit_anything = true;
-          closest_so_far = temp_hit_record.t;
-          record = temp_hit_record;
+          closest_so_far = record.t;
         }
       }
       return hit_anything;
@@ -44,6 +45,30 @@ class HittableList : public Hittable
       return bbox;
     }
 
+    AABB boundingBoxAt(double time) const override
+    {
+      AABB box = AABB::empty;
+      for(const auto &object : objects) box = AABB(box, object->boundingBoxAt(time));
+      return box;
+    }
+
+    Vector3 sampleDirection(const Point3& origin, double time, double u, double v) const override
+    {
+      // Pick an object uniformly from u, then reuse what is left of u to sample it.
+      double scaled = u * objects.size();
+      size_t index = std::min(size_t(scaled), objects.size() - 1);
+      return objects[index]->sampleDirection(origin, time, scaled - index, v);
+    }
+
+    double directionPdf(const Point3& origin, const Vector3& direction, double time) const override
+    {
+      // The density of the uniform mixture of the objects.
+      if(objects.empty()) return 0;
+      double pdf = 0;
+      for(const auto &object : objects) pdf += object->directionPdf(origin, direction, time);
+      return pdf / objects.size();
+    }
+
   private:
     AABB bbox;
 };
\ No newline at end of file
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+
+// Object instancing: one object (a mesh, a BVH over a group of primitives...) placed many
+// times in the scene by affine transforms. Rays are moved into the object's space instead of
+// the object into the world, so an instance costs its transform, whatever the object holds.
+
+class Transform
+{
+  // Affine transform: a 3x3 linear part and a translation, as the rows of a 3x4 matrix.
+
+  public:
+    double m[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+
+    static Transform translate(const Vector3& offset)
+    {
+      Transform transform;
+      for(int row = 0; row < 3; row++) transform.m[row][3] = offset[row];
+      return transform;
+    }
+
+    static Transform scale(const Vector3& factors)
+    {
+      Transform transform;
+      for(int row = 0; row < 3; row++) transform.m[row][row] = factors[row];
+      return transform;
+    }
+
+    static Transform scale(double factor)
+    {
+      return scale(Vector3(factor, factor, factor));
+    }
+
+    static Transform rotate(const Vector3& axis, double degrees)
+    {
+      // Counter-clockwise rotation around the axis, looking down the axis towards the origin.
+      Vector3 a = unit_vector(axis);
+      double cos_theta = std::cos(deg2rad(degrees)), sin_theta = std::sin(deg2rad(degrees));
+      double one_minus_cos = 1 - cos_theta;
+
+      Transform transform;
+      for(int row = 0; row < 3; row++)
+      {
+        for(int column = 0; column < 3; column++)
+        {
+          transform.m[row][column] = a[row] * a[column] * one_minus_cos + (row == column ? cos_theta : 0);
+        }
+      }
+      transform.m[0][1] -= a.z() * sin_theta;
+      transform.m[0][2] += a.y() * sin_theta;
+      transform.m[1][0] += a.z() * sin_theta;
+      transform.m[1][2] -= a.x() * sin_theta;
+      transform.m[2][0] -= a.y() * sin_theta;
+      transform.m[2][1] += a.x() * sin_theta;
+      return transform;
+    }
+
+    Transform operator*(const Transform& other) const
+    {
+      // The transform applying other first, then this one.
+      Transform product;
+      for(int row = 0; row < 3; row++)
+      {
+        for(int column = 0; column < 4; column++)
+        {
+          double sum = column == 3 ? m[row][3] : 0;
+          for(int k = 0; k < 3; k++) sum += m[row][k] * other.m[k][column];
+          product.m[row][column] = sum;
+        }
+      }
+      return product;
+    }
+
+    double determinant() const
+    {
+      return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+           - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+           + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    Transform inverse() const
+    {
+      // The linear part is inverted through its cofactors; the transform must not be singular.
+      Transform inverse;
+      double inverse_determinant = 1 / determinant();
+      for(int row = 0; row < 3; row++)
+      {
+        for(int column = 0; column < 3; column++)
+        {
+          // Cofactor of the transposed entry, with the cyclic index trick for the sign.
+          int r1 = (column + 1) % 3, r2 = (column + 2) % 3;
+          int c1 = (row + 1) % 3, c2 = (row + 2) % 3;
+          inverse.m[row][column] = (m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) * inverse_determinant;
+        }
+      }
+      for(int row = 0; row < 3; row++)
+      {
+        inverse.m[row][3] = -(inverse.m[row][0] * m[0][3] + inverse.m[row][1] * m[1][3] + inverse.m[row][2] * m[2][3]);
+      }
+      return inverse;
+    }
+
+    Point3 point(const Point3& p) const
+    {
+      return Point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                    m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                    m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    Vector3 vector(const Vector3& v) const
+    {
+      return Vector3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                     m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                     m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    Vector3 transposedVector(const Vector3& v) const
+    {
+      // The linear part, transposed, applied to v. Normals go back to the world through the
+      // transpose of the world to object transform.
+      return Vector3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                     m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                     m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+    }
+
+    AABB box(const AABB& box) const
+    {
+      // The box enclosing the transformed box (Arvo, "Transforming Axis-Aligned Bounding
+      // Boxes", 1990): along each axis, every term of the product takes the box bound that
+      // minimizes or maximizes it.
+      Interval axes[3];
+      for(int row = 0; row < 3; row++)
+      {
+        double low = m[row][3], high = m[row][3];
+        for(int column = 0; column < 3; column++)
+        {
+          const Interval& interval = box.axisInterval(column);
+          double a = m[row][column] * interval.min, b = m[row][column] * interval.max;
+          low += std::fmin(a, b);
+          high += std::fmax(a, b);
+        }
+        axes[row] = Interval(low, high);
+      }
+      return AABB(axes[0], axes[1], axes[2]);
+    }
+};
+
+class Instance : public Hittable
+{
+  public:
+    Instance(shared_ptr<Hittable> object, const Transform& object_to_world)
+      : object(object), world_to_object(object_to_world.inverse()),
+        bbox(object_to_world.box(object->boundingBox())) {}
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      return hitObject(*object, world_to_object, ray, ray_t, record);
+    }
+
+    AABB boundingBox() const override
+    {
+      return bbox;
+    }
+
+    AABB boundingBoxAt(double time) const override
+    {
+      return world_to_object.inverse().box(object->boundingBoxAt(time));
+    }
+
+    static bool hitObject(const Hittable& object, const Transform& world_to_object, const Ray& ray,
+                          const Interval& ray_t, HitRecord& record)
+    {
+      // Intersect the object with the ray moved into its space. The direction is not
+      // renormalized, so distances along the ray are the same in both spaces. The hit is then
+      // moved back to the world.
+      Ray object_ray(world_to_object.point(ray.origin()), world_to_object.vector(ray.direction()), ray.time());
+      if(!object.hit(object_ray, ray_t, record)) return false;
+
+      record.hit_impact = ray.at(record.t);
+      record.normal = unit_vector(world_to_object.transposedVector(record.normal));
+      // Texture units per world unit, for the average scale of the transform.
+      record.uv_scale *= std::cbrt(std::fabs(world_to_object.determinant()));
+      return true;
+    }
+
+  private:
+    shared_ptr<Hittable> object;
+    Transform world_to_object;
+    AABB bbox;
+};
+
+class InstanceBVH : public Hittable
+{
+  // Top level of a two-level BVH: a flattened BVH over many placements of a few shared
+  // objects, each of which brings its own (bottom level) BVH. An instance is one record, its
+  // transform to object space and the index of its object, plus its share of the top level
+  // nodes.
+
+  public:
+    struct Placement
+    {
+      uint32_t object;          // Index in the objects of the InstanceBVH
+      Transform object_to_world;
+    };
+
+    InstanceBVH(std::vector<shared_ptr<Hittable>> objects, const std::vector<Placement>& placements,
+                int max_leaf_size = 2)
+      : objects(std::move(objects))
+    {
+      std::vector<AABB> boxes;
+      boxes.reserve(placements.size());
+      for(const Placement& placement : placements)
+      {
+        boxes.push_back(placement.object_to_world.box(this->objects[placement.object]->boundingBox()));
+      }
+      tree.build(boxes, BVHSplitMethod::BinnedSAH, std::min(max_leaf_size, 65535));
+
+      // Store the instances in leaf order, so the leaves index them directly.
+      instances.reserve(placements.size());
+      for(uint32_t index : tree.primitive_order)
+      {
+        instances.push_back({ placements[index].object_to_world.inverse(), placements[index].object });
+      }
+      tree.primitive_order = std::vector<uint32_t>();
+      tree.nodes.shrink_to_fit();
+    }
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      return tree.traverse(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& interval)
+      {
+        bool hit_anything = false;
+        for(uint32_t slot = first; slot < first + count; slot++)
+        {
+          const InstanceRecord& instance = instances[slot];
+          if(Instance::hitObject(*objects[instance.object], instance.world_to_object, ray, interval, record))
+          {
+            hit_anything = true;
+            interval.max = record.t;
+          }
+        }
+        return hit_anything;
+      });
+    }
+
+    AABB boundingBox() const override
+    {
+      return tree.boundingBox();
+    }
+
+    size_t instanceCount() const { return instances.size(); }
+    size_t nodeCount() const { return tree.nodes.size(); }
+
+    size_t memoryUsage() const
+    {
+      // Bytes held by the instances and the top level nodes, without the shared objects.
+      return instances.size() * sizeof(InstanceRecord) + tree.nodes.size() * sizeof(LinearBVHNode);
+    }
+
+  private:
+    struct InstanceRecord
+    {
+      Transform world_to_object;
+      uint32_t object;
+    };
+
+    std::vector<shared_ptr<Hittable>> objects;
+    std::vector<InstanceRecord> instances;
+    LinearBVHTree tree;
+};
\ No newline at end of file
@@ -0,0 +1,635 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "scheduler.hpp"
+
+struct LinearBVHNode
+{
+  // One node of a flattened BVH, 32 bytes so two nodes fit in a cache line. Nodes are stored
+  // in depth-first order: the first child of an interior node is the next node in the array,
+  // and 'offset' holds the index of the second child. For a leaf, 'offset' is the index of the
+  // first primitive and 'primitive_count' the number of primitives.
+
+  float bounds_min[3];
+  float bounds_max[3];
+  uint32_t offset;
+  uint16_t primitive_count; // 0 for interior nodes
+  uint8_t axis;             // Split axis of interior nodes, used to visit the near child first
+  uint8_t padding;
+
+  bool isLeaf() const { return primitive_count > 0; }
+
+  AABB boundingBox() const
+  {
+    return AABB(Interval(bounds_min[0], bounds_max[0]),
+                Interval(bounds_min[1], bounds_max[1]),
+                Interval(bounds_min[2], bounds_max[2]));
+  }
+
+  void setBoundingBox(const AABB& box)
+  {
+    // Store the box in single precision, rounding outwards so the stored box still encloses
+    // the double precision one.
+    for(int axis = 0; axis < 3; axis++)
+    {
+      const Interval& interval = box.axisInterval(axis);
+      bounds_min[axis] = roundDown(interval.min);
+      bounds_max[axis] = roundUp(interval.max);
+    }
+  }
+
+  bool hit(const Point3& origin, const Vector3& inverse_direction, const int direction_is_negative[3],
+           const Interval& ray_t) const
+  {
+    // Slab test against the node box, using the precomputed inverse ray direction so there is
+    // no division per node.
+    double t_min = ray_t.min;
+    double t_max = ray_t.max;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      double near_bound = direction_is_negative[axis] ? bounds_max[axis] : bounds_min[axis];
+      double far_bound = direction_is_negative[axis] ? bounds_min[axis] : bounds_max[axis];
+      double t0 = (near_bound - origin[axis]) * inverse_direction[axis];
+      double t1 = (far_bound - origin[axis]) * inverse_direction[axis];
+      if(t0 > t_min) t_min = t0;
+      if(t1 < t_max) t_max = t1;
+      if(t_max < t_min) return false;
+    }
+    return true;
+  }
+
+  static float roundDown(double value)
+  {
+    float rounded = float(value);
+    return double(rounded) > value ? std::nextafter(rounded, -std::numeric_limits<float>::infinity()) : rounded;
+  }
+
+  static float roundUp(double value)
+  {
+    float rounded = float(value);
+    return double(rounded) < value ? std::nextafter(rounded, std::numeric_limits<float>::infinity()) : rounded;
+  }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must stay 32 bytes");
+
+class LinearBVHTree
+{
+  // Pointer-free BVH over primitives known only by their index and bounding box. It holds the
+  // node array and the order in which the leaves reference the primitives; what a primitive
+  // is and how to intersect it is left to the owner, through the leaf callback of traverse().
+
+  public:
+    std::vector<LinearBVHNode> nodes;
+    std::vector<uint32_t> primitive_order; // Leaf primitive slot -> original primitive index
+
+    void build(const std::vector<AABB>& boxes, BVHSplitMethod split_method, int max_leaf_size, int thread_count = 1)
+    {
+      // thread_count threads share the build, 0 uses every hardware thread. The tree does not
+      // depend on the thread count.
+      nodes.clear();
+      primitive_order.clear();
+      if(boxes.empty()) return;
+
+      BuildState state;
+      state.split_method = split_method;
+      state.max_leaf_size = std::max(1, max_leaf_size);
+      state.items.resize(boxes.size());
+      for(size_t index = 0; index < boxes.size(); index++)
+      {
+        state.items[index] = { boxes[index], uint32_t(index) };
+      }
+      if(split_method == BVHSplitMethod::Morton) sortByMortonCode(state);
+
+      thread_count = WorkStealingScheduler::resolveThreadCount(thread_count);
+      size_t subtree_size = std::max(parallel_grain, boxes.size() / (8 * size_t(thread_count)));
+      if(thread_count > 1 && boxes.size() > subtree_size)
+      {
+        buildParallel(state, thread_count, subtree_size);
+        return;
+      }
+
+      nodes.reserve(2 * boxes.size());
+      primitive_order.reserve(boxes.size());
+      buildRecursive(state, 0, boxes.size(), 0);
+    }
+
+    AABB boundingBox() const
+    {
+      return nodes.empty() ? AABB::empty : nodes[0].boundingBox();
+    }
+
+    template <typename IntersectLeaf>
+    bool traverse(const Ray& ray, Interval& ray_t, IntersectLeaf intersect_leaf) const
+    {
+      return traverse(nodes.data(), nodes.size(), ray, ray_t, intersect_leaf);
+    }
+
+    template <typename IntersectLeaf>
+    static bool traverse(const LinearBVHNode* nodes, size_t node_count, const Ray& ray, Interval& ray_t,
+                         IntersectLeaf intersect_leaf)
+    {
+      // Iterative, stack based traversal. intersect_leaf(first, count, ray_t) intersects the
+      // primitive slots [first, first + count) and returns true on a hit, after shrinking
+      // ray_t.max to the hit distance. The near child of an interior node (according to the
+      // ray direction along the split axis) is visited first, so the far child is often
+      // culled by the closer hit. The nodes may live anywhere, a memory-mapped file included.
+
+      if(node_count == 0) return false;
+
+      const Point3& origin = ray.origin();
+      const Vector3& direction = ray.direction();
+      Vector3 inverse_direction(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+      int direction_is_negative[3] = { inverse_direction.x() < 0, inverse_direction.y() < 0, inverse_direction.z() < 0 };
+
+      uint32_t stack[max_depth];
+      int stack_size = 0;
+      uint32_t current = 0;
+      bool hit_anything = false;
+
+      while(true)
+      {
+        const LinearBVHNode& node = nodes[current];
+        RTW_COUNT(BVHNodesVisited);
+        RTW_COUNT(AABBTests);
+        if(node.hit(origin, inverse_direction, direction_is_negative, ray_t))
+        {
+          if(node.isLeaf())
+          {
+            if(intersect_leaf(node.offset, node.primitive_count, ray_t))
+            {
+              hit_anything = true;
+            }
+          }
+          else
+          {
+            if(direction_is_negative[node.axis])
+            {
+              stack[stack_size++] = current + 1;
+              current = node.offset;
+            }
+            else
+            {
+              stack[stack_size++] = node.offset;
+              current = current + 1;
+            }
+            continue;
+          }
+        }
+
+        if(stack_size == 0) break;
+        current = stack[--stack_size];
+      }
+      return hit_anything;
+    }
+
+    uint32_t addLeaf(const AABB& box, uint32_t first_primitive, uint16_t primitive_count)
+    {
+      uint32_t node_index = uint32_t(nodes.size());
+      nodes.emplace_back();
+      nodes[node_index].setBoundingBox(box);
+      nodes[node_index].offset = first_primitive;
+      nodes[node_index].primitive_count = primitive_count;
+      nodes[node_index].axis = 0;
+      nodes[node_index].padding = 0;
+      return node_index;
+    }
+
+    uint32_t addInterior(const AABB& box, int axis)
+    {
+      // The second child index must be patched with setSecondChild() once the first child
+      // subtree has been appended.
+      uint32_t node_index = uint32_t(nodes.size());
+      nodes.emplace_back();
+      nodes[node_index].setBoundingBox(box);
+      nodes[node_index].offset = 0;
+      nodes[node_index].primitive_count = 0;
+      nodes[node_index].axis = uint8_t(axis);
+      nodes[node_index].padding = 0;
+      return node_index;
+    }
+
+    void setSecondChild(uint32_t node_index, uint32_t child_index)
+    {
+      nodes[node_index].offset = child_index;
+    }
+
+    // Traversal stack size. The builders fall back to median splits below depth
+    // BVHPartition::max_sah_depth, which bounds the tree depth well under this. A Morton split
+    // uses up at least one bit of the codes, so Morton trees are at most 63 levels deep, plus
+    // the median splits of equal codes.
+    static const int max_depth = 128;
+
+    // Spans of at most this many primitives are built by a single task of a parallel build.
+    static constexpr size_t parallel_grain = 4096;
+
+    // Morton builds use 30-bit codes up to this many primitives, and 63-bit codes beyond.
+    static constexpr size_t morton_30_bit_limit = size_t(1) << 16;
+
+  private:
+    struct BuildItem
+    {
+      AABB box;
+      uint32_t index;
+    };
+
+    struct BuildState
+    {
+      std::vector<BuildItem> items;
+      std::vector<uint64_t> codes; // Morton codes of the items, in the same order (Morton builds)
+      BVHSplitMethod split_method;
+      int max_leaf_size;
+    };
+
+    static AABB boxOf(const BuildItem& item)
+    {
+      return item.box;
+    }
+
+    static AABB spanBox(const std::vector<BuildItem>& items, size_t start, size_t end)
+    {
+      AABB bbox = AABB::empty;
+      for(size_t item_index = start; item_index < end; item_index++)
+      {
+        bbox = AABB(bbox, items[item_index].box);
+      }
+      return bbox;
+    }
+
+    static bool splitSpan(BuildState& state, size_t start, size_t end, const AABB& bbox, int depth,
+                          size_t& mid, int& axis)
+    {
+      // Decide what becomes of the span [start, end) of the items: false for a leaf, or true
+      // with the first item of the second half in mid and the split axis. Only the span is
+      // reordered, so disjoint spans can be split by different threads.
+      std::vector<BuildItem>& items = state.items;
+      size_t item_count = end - start;
+
+      if(state.split_method == BVHSplitMethod::Morton)
+      {
+        if(item_count <= size_t(state.max_leaf_size)) return false;
+        mid = mortonSplit(state.codes, start, end, axis);
+        return true;
+      }
+
+      mid = start;
+      if(state.split_method == BVHSplitMethod::BinnedSAH && depth < BVHPartition::max_sah_depth && item_count > 1)
+      {
+        // Keep a leaf when intersecting all of its primitives is cheaper than the best split.
+        double split_cost;
+        mid = BVHPartition::binnedSAH(items, start, end, boxOf, split_cost);
+        double area = bbox.surfaceArea();
+        if(area > 0)
+        {
+          split_cost = BVHNode::traversal_cost + BVHNode::intersection_cost * split_cost / area;
+        }
+        double leaf_cost = BVHNode::intersection_cost * item_count;
+        if(item_count <= size_t(state.max_leaf_size) && leaf_cost <= split_cost) return false;
+      }
+      else if(item_count <= size_t(state.max_leaf_size))
+      {
+        return false;
+      }
+
+      if(mid <= start || mid >= end)
+      {
+        mid = BVHPartition::median(items, start, end, bbox.longestAxis(), boxOf);
+      }
+      axis = BVHPartition::splitAxis(items, start, mid, end, boxOf);
+      return true;
+    }
+
+    uint32_t buildRecursive(BuildState& state, size_t start, size_t end, int depth)
+    {
+      AABB bbox = spanBox(state.items, start, end);
+      size_t mid;
+      int axis;
+      if(!splitSpan(state, start, end, bbox, depth, mid, axis))
+      {
+        return addItemLeaf(bbox, state.items, start, end);
+      }
+
+      uint32_t node_index = addInterior(bbox, axis);
+      buildRecursive(state, start, mid, depth + 1);
+      uint32_t second_child = buildRecursive(state, mid, end, depth + 1);
+      setSecondChild(node_index, second_child);
+      return node_index;
+    }
+
+    struct TopNode
+    {
+      size_t start, end; // Span of the items
+      int depth;
+      AABB box;
+      int axis;
+      uint32_t children[2]; // Top nodes of the halves, for a split node
+      int subtree;          // Index of the subtree built from the span, or -1 for a split node
+    };
+
+    void buildParallel(BuildState& state, int thread_count, size_t subtree_size)
+    {
+      // The upper levels are split one level at a time, the spans of a level shared between
+      // the threads, until the spans have at most subtree_size items. Those are built as
+      // independent tasks into trees of their own, which are then spliced, in depth-first
+      // order, under the upper nodes. Every span is split as buildRecursive() would split it,
+      // so the result is the tree of a single threaded build.
+      std::vector<TopNode> top = { { 0, state.items.size(), 0, AABB::empty, 0, { 0, 0 }, -1 } };
+      std::vector<uint32_t> level = { 0 };
+      std::vector<uint32_t> subtree_nodes;
+
+      while(!level.empty())
+      {
+        std::vector<size_t> mids(level.size());
+        std::vector<char> split(level.size());
+        WorkStealingScheduler::run(level.size(), thread_count, [&](size_t index, int)
+        {
+          TopNode& node = top[level[index]];
+          node.box = spanBox(state.items, node.start, node.end);
+          split[index] = splitSpan(state, node.start, node.end, node.box, node.depth, mids[index], node.axis);
+        });
+
+        std::vector<uint32_t> next_level;
+        for(size_t index = 0; index < level.size(); index++)
+        {
+          uint32_t node_index = level[index];
+          if(!split[index])
+          {
+            // A leaf; its subtree task makes the same leaf.
+            top[node_index].subtree = int(subtree_nodes.size());
+            subtree_nodes.push_back(node_index);
+            continue;
+          }
+
+          size_t bounds[3] = { top[node_index].start, mids[index], top[node_index].end };
+          for(int half = 0; half < 2; half++)
+          {
+            uint32_t child_index = uint32_t(top.size());
+            top[node_index].children[half] = child_index;
+            top.push_back({ bounds[half], bounds[half + 1], top[node_index].depth + 1, AABB::empty, 0, { 0, 0 }, -1 });
+            if(bounds[half + 1] - bounds[half] > subtree_size)
+            {
+              next_level.push_back(child_index);
+            }
+            else
+            {
+              top[child_index].subtree = int(subtree_nodes.size());
+              subtree_nodes.push_back(child_index);
+            }
+          }
+        }
+        level.swap(next_level);
+      }
+
+      std::vector<LinearBVHTree> subtrees(subtree_nodes.size());
+      WorkStealingScheduler::run(subtree_nodes.size(), thread_count, [&](size_t index, int)
+      {
+        const TopNode& node = top[subtree_nodes[index]];
+        LinearBVHTree& subtree = subtrees[index];
+        subtree.nodes.reserve(2 * (node.end - node.start));
+        subtree.primitive_order.reserve(node.end - node.start);
+        subtree.buildRecursive(state, node.start, node.end, node.depth);
+      });
+
+      nodes.reserve(2 * state.items.size());
+      primitive_order.reserve(state.items.size());
+      spliceTop(top, subtrees, 0);
+    }
+
+    uint32_t spliceTop(const std::vector<TopNode>& top, std::vector<LinearBVHTree>& subtrees, uint32_t top_index)
+    {
+      const TopNode& node = top[top_index];
+      if(node.subtree < 0)
+      {
+        uint32_t node_index = addInterior(node.box, node.axis);
+        spliceTop(top, subtrees, node.children[0]);
+        setSecondChild(node_index, spliceTop(top, subtrees, node.children[1]));
+        return node_index;
+      }
+
+      // Append the subtree, moving its node and primitive slot indices past those already here.
+      LinearBVHTree& subtree = subtrees[node.subtree];
+      uint32_t first_node = uint32_t(nodes.size());
+      uint32_t first_primitive = uint32_t(primitive_order.size());
+      for(LinearBVHNode subtree_node : subtree.nodes)
+      {
+        subtree_node.offset += subtree_node.isLeaf() ? first_primitive : first_node;
+        nodes.push_back(subtree_node);
+      }
+      primitive_order.insert(primitive_order.end(), subtree.primitive_order.begin(), subtree.primitive_order.end());
+      subtree = LinearBVHTree();
+      return first_node;
+    }
+
+    struct MortonKey
+    {
+      uint64_t code;
+      uint32_t index;
+    };
+
+    static void sortByMortonCode(BuildState& state)
+    {
+      // Linear BVH (Lauterbach et al., "Fast BVH Construction on GPUs", 2009): the centroids
+      // are quantized on a grid over their bounds and the items sorted along the Morton curve
+      // through its cells, by an 8-bit radix sort. Up to morton_30_bit_limit items, the grid
+      // has 2^10 cells per axis and the 30-bit codes sort in four passes; beyond, 2^21 cells
+      // per axis keep large inputs from crowding cells, at eight passes for the 63-bit codes.
+      std::vector<BuildItem>& items = state.items;
+      AABB centroid_bounds = AABB::empty;
+      for(const BuildItem& item : items)
+      {
+        Point3 centroid = item.box.centroid();
+        centroid_bounds = AABB(centroid_bounds, AABB(centroid, centroid));
+      }
+
+      int bits = items.size() <= morton_30_bit_limit ? 10 : 21;
+      double cell_count = double((uint32_t(1) << bits) - 1);
+      std::vector<MortonKey> keys(items.size()), sorted(items.size());
+      for(size_t index = 0; index < items.size(); index++)
+      {
+        Point3 centroid = items[index].box.centroid();
+        uint64_t code = 0;
+        for(int axis = 0; axis < 3; axis++)
+        {
+          const Interval& extent = centroid_bounds.axisInterval(axis);
+          double position = extent.size() > 0 ? (centroid[axis] - extent.min) / extent.size() : 0;
+          code |= spreadBits(uint32_t(position * cell_count)) << (2 - axis);
+        }
+        keys[index] = { code, uint32_t(index) };
+      }
+
+      for(int shift = 0; shift < 3 * bits; shift += 8)
+      {
+        size_t offsets[257] = {};
+        for(const MortonKey& key : keys) offsets[((key.code >> shift) & 255) + 1]++;
+        if(offsets[((keys[0].code >> shift) & 255) + 1] == keys.size()) continue; // Every code has this digit
+        for(int digit = 0; digit < 256; digit++) offsets[digit + 1] += offsets[digit];
+        for(const MortonKey& key : keys) sorted[offsets[(key.code >> shift) & 255]++] = key;
+        keys.swap(sorted);
+      }
+
+      std::vector<BuildItem> sorted_items(items.size());
+      state.codes.resize(items.size());
+      for(size_t index = 0; index < keys.size(); index++)
+      {
+        sorted_items[index] = items[keys[index].index];
+        state.codes[index] = keys[index].code;
+      }
+      items.swap(sorted_items);
+    }
+
+    static uint64_t spreadBits(uint32_t value)
+    {
+      // The 21 low bits of value, moved to every third bit.
+      uint64_t bits = value & 0x1fffff;
+      bits = (bits | bits << 32) & 0x1f00000000ffff;
+      bits = (bits | bits << 16) & 0x1f0000ff0000ff;
+      bits = (bits | bits << 8) & 0x100f00f00f00f00f;
+      bits = (bits | bits << 4) & 0x10c30c30c30c30c3;
+      bits = (bits | bits << 2) & 0x1249249249249249;
+      return bits;
+    }
+
+    static size_t mortonSplit(const std::vector<uint64_t>& codes, size_t start, size_t end, int& axis)
+    {
+      // The codes of the span are sorted and share their bits above the highest one in which
+      // the first and the last differ: split where that bit turns from 0 to 1, a plane through
+      // the grid along the axis of the bit. Items with equal codes (in one cell) are split in
+      // the middle.
+      uint64_t difference = codes[start] ^ codes[end - 1];
+      axis = 0;
+      if(difference == 0) return start + (end - start) / 2;
+
+      int bit = 0;
+      for(int shift = 32; shift > 0; shift /= 2)
+      {
+        if(difference >> shift)
+        {
+          difference >>= shift;
+          bit += shift;
+        }
+      }
+      axis = 2 - bit % 3;
+
+      // codes[low] has the bit clear and codes[high] has it set.
+      size_t low = start, high = end - 1;
+      while(high - low > 1)
+      {
+        size_t middle = low + (high - low) / 2;
+        if((codes[middle] >> bit) & 1) high = middle;
+        else low = middle;
+      }
+      return high;
+    }
+
+    uint32_t addItemLeaf(const AABB& box, const std::vector<BuildItem>& items, size_t start, size_t end)
+    {
+      uint32_t first_primitive = uint32_t(primitive_order.size());
+      for(size_t item_index = start; item_index < end; item_index++)
+      {
+        primitive_order.push_back(items[item_index].index);
+      }
+      return addLeaf(box, first_primitive, uint16_t(end - start));
+    }
+};
+
+class LinearBVH : public Hittable
+{
+  // Flattened BVH over a list of hittables. Leaves hold up to max_leaf_size primitives, and
+  // the primitives are stored in leaf order so a leaf is one contiguous run of the array.
+
+  public:
+    LinearBVH(const HittableList& list, BVHSplitMethod split_method = BVHSplitMethod::BinnedSAH,
+              int max_leaf_size = 4, int thread_count = 1)
+    {
+      std::vector<AABB> boxes;
+      boxes.reserve(list.objects.size());
+      for(const auto& object : list.objects)
+      {
+        boxes.push_back(object->boundingBox());
+      }
+
+      tree.build(boxes, split_method, std::min(max_leaf_size, 65535), thread_count);
+
+      primitives.reserve(list.objects.size());
+      for(uint32_t index : tree.primitive_order)
+      {
+        primitives.push_back(list.objects[index]);
+      }
+    }
+
+    LinearBVH(const BVHNode& root)
+    {
+      // Flatten an existing pointer-based hierarchy, keeping its topology. The two primitive
+      // children of a BVHNode leaf become one leaf of up to two primitives, and a single
+      // object span (left == right) is stored, and tested, only once.
+      flatten(root);
+    }
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      return tree.traverse(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& interval)
+      {
+        bool hit_anything = false;
+        for(uint32_t slot = first; slot < first + count; slot++)
+        {
+          if(primitives[slot]->hit(ray, interval, record))
+          {
+            hit_anything = true;
+            interval.max = record.t;
+          }
+        }
+        return hit_anything;
+      });
+    }
+
+    AABB boundingBox() const override
+    {
+      return tree.boundingBox();
+    }
+
+    size_t nodeCount() const { return tree.nodes.size(); }
+    size_t primitiveCount() const { return primitives.size(); }
+
+  private:
+    friend class WideBVH;
+
+    LinearBVHTree tree;
+    std::vector<shared_ptr<Hittable>> primitives;
+
+    uint32_t flatten(const BVHNode& node)
+    {
+      auto left_node = dynamic_cast<const BVHNode*>(node.left.get());
+      auto right_node = dynamic_cast<const BVHNode*>(node.right.get());
+
+      if(!left_node && !right_node)
+      {
+        uint32_t first = uint32_t(primitives.size());
+        primitives.push_back(node.left);
+        if(node.right != node.left) primitives.push_back(node.right);
+        return tree.addLeaf(node.bbox, first, uint16_t(primitives.size() - first));
+      }
+
+      int axis = BVHPartition::nearChildAxis(node.right->boundingBox().centroid() - node.left->boundingBox().centroid());
+
+      uint32_t node_index = tree.addInterior(node.bbox, axis);
+      flattenChild(node.left, left_node);
+      tree.setSecondChild(node_index, flattenChild(node.right, right_node));
+      return node_index;
+    }
+
+    uint32_t flattenChild(const shared_ptr<Hittable>& child, const BVHNode* child_node)
+    {
+      if(child_node) return flatten(*child_node);
+
+      uint32_t first = uint32_t(primitives.size());
+      primitives.push_back(child);
+      return tree.addLeaf(child->boundingBox(), first, 1);
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define RTW_HAS_MMAP 1
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#else
+  #define RTW_HAS_MMAP 0
+#endif
+
+class MappedFile
+{
+  // Read-only view of a whole file. On POSIX systems the file is memory-mapped, so opening it
+  // costs nothing and the pages are read on first access; elsewhere it is read into memory.
+  // The data starts on a page (or allocation) boundary, so aligned records can be used in place.
+
+  public:
+    MappedFile() {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+      close();
+    }
+
+    bool open(const std::string& filename)
+    {
+      close();
+#if RTW_HAS_MMAP
+      int descriptor = ::open(filename.c_str(), O_RDONLY);
+      if(descriptor < 0) return false;
+
+      struct stat status;
+      if(fstat(descriptor, &status) != 0)
+      {
+        ::close(descriptor);
+        return false;
+      }
+
+      file_size = size_t(status.st_size);
+      if(file_size > 0)
+      {
+        void* address = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if(address == MAP_FAILED)
+        {
+          ::close(descriptor);
+          file_size = 0;
+          return false;
+        }
+        mapping = static_cast<const unsigned char*>(address);
+      }
+      ::close(descriptor); // The mapping stays valid once the descriptor is closed
+      is_open = true;
+      return true;
+#else
+      std::ifstream in(filename, std::ios::binary | std::ios::ate);
+      if(!in) return false;
+      buffer.resize(size_t(in.tellg()));
+      in.seekg(0);
+      in.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(buffer.size()));
+      if(!in) return false;
+      file_size = buffer.size();
+      is_open = true;
+      return true;
+#endif
+    }
+
+    void close()
+    {
+#if RTW_HAS_MMAP
+      if(mapping) munmap(const_cast<unsigned char*>(mapping), file_size);
+      mapping = nullptr;
+#else
+      buffer.clear();
+#endif
+      file_size = 0;
+      is_open = false;
+    }
+
+    bool isOpen() const { return is_open; }
+    size_t size() const { return file_size; }
+
+    const unsigned char* data() const
+    {
+#if RTW_HAS_MMAP
+      return mapping;
+#else
+      return buffer.data();
+#endif
+    }
+
+  private:
+    bool is_open = false;
+    size_t file_size = 0;
+#if RTW_HAS_MMAP
+    const unsigned char* mapping = nullptr;
+#else
+    std::vector<unsigned char> buffer;
+#endif
+};
@@ -3,6 +3,7 @@
 #include "hittable.hpp"
 #include "texture.hpp"
 #include "rtweekend.hpp"
+#include "sampler.hpp"
 
 class Material
 {
@@ -13,6 +14,36 @@ class Material
     {
       return false;
     }
+
+    // Light leaving the surface towards the incoming ray, whatever lights it. Only materials
+    // for which emits() is true emit anything.
+    virtual bool emits() const { return false; }
+
+    virtual Color emitted(const Ray& ray_in, const HitRecord& record) const
+    {
+      return Color(0, 0, 0);
+    }
+
+    // For light sampling: the BSDF times the cosine term for light arriving from the given
+    // direction, and the solid angle density with which scatter() picks that direction.
+    // Materials whose scatter() follows a singular direction (mirrors, glass) have a zero
+    // density: light sampling skips them, the direction they pick is the only one that counts.
+    virtual Color evaluate(const Ray& ray_in, const HitRecord& record, const Vector3& direction) const
+    {
+      return Color(0, 0, 0);
+    }
+
+    virtual double scatteringPdf(const Ray& ray_in, const HitRecord& record, const Vector3& direction) const
+    {
+      return 0;
+    }
+
+    // The color of the surface, for the feature buffers of the denoiser: the fraction of light
+    // it keeps, without the randomness of scatter(). Neutral unless a material knows better.
+    virtual Color surfaceAlbedo(const Ray& ray_in, const HitRecord& record) const
+    {
+      return Color(1, 1, 1);
+    }
 };
 
 class Lambertian : public Material
@@ -26,7 +57,8 @@ public:
 
   bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override
   {
-    Vector3 scatter_direction = record.normal + randomUnitVector();
+    RTW_COUNT(LambertianScatters);
+    Vector3 scatter_direction = record.normal + sampleUnitVector();
 
     // Catch degenerate scatter direction
     if (scatter_direction.nearZero())
@@ -35,9 +67,32 @@ public:
     }
 
     scattered = Ray(record.hit_impact, scatter_direction, ray_in.time());
-    attenuation = texture->value(record.u, record.v, record.hit_impact);
+    double footprint = ray_in.coneWidthAt(record.t) * record.uv_scale;
+    attenuation = texture->filteredValue(record.u, record.v, record.hit_impact, footprint);
     return true;
   }
+
+  Color evaluate(const Ray& ray_in, const HitRecord& record, const Vector3& direction) const override
+  {
+    // albedo / pi times the cosine: the albedo times the density of the cosine distribution.
+    double density = scatteringPdf(ray_in, record, direction);
+    if (density <= 0) return Color(0, 0, 0);
+    double footprint = ray_in.coneWidthAt(record.t) * record.uv_scale;
+    return density * texture->filteredValue(record.u, record.v, record.hit_impact, footprint);
+  }
+
+  double scatteringPdf(const Ray& ray_in, const HitRecord& record, const Vector3& direction) const override
+  {
+    // normal + a uniform unit vector is cosine distributed about the normal.
+    double cosine = dot(record.normal, direction) / direction.length();
+    return cosine > 0 ? cosine / PI : 0;
+  }
+
+  Color surfaceAlbedo(const Ray& ray_in, const HitRecord& record) const override
+  {
+    double footprint = ray_in.coneWidthAt(record.t) * record.uv_scale;
+    return texture->filteredValue(record.u, record.v, record.hit_impact, footprint);
+  }
 };
 
 class Metal : public Material
@@ -50,12 +105,15 @@ class Metal : public Material
     
     bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override
     {
+      RTW_COUNT(MetalScatters);
       Vector3 reflected = reflect(ray_in.direction(), record.normal);
-      reflected = unit_vector(reflected) + (fuzz * randomUnitVector());
+      reflected = unit_vector(reflected) + (fuzz * sampleUnitVector());
       scattered = Ray(record.hit_impact, reflected, ray_in.time());
       attenuation = albedo;
       return (dot(scattered.direction(), record.normal) > 0);
     }
+
+    Color surfaceAlbedo(const Ray& ray_in, const HitRecord& record) const override { return albedo; }
 };
 
 class Dielectric : public Material
@@ -65,6 +123,7 @@ class Dielectric : public Material
 
     bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override 
     {
+      RTW_COUNT(DielectricScatters);
       attenuation = Color(1.0, 1.0, 1.0);
       double ri = record.front_face ? (1.0 / refraction_index) : refraction_index;
 
@@ -76,7 +135,7 @@ class Dielectric : public Material
       
       Vector3 direction;
 
-      if(cannot_refract || reflectance(cos_theta, ri) > randomDouble())
+      if(cannot_refract || reflectance(cos_theta, ri) > sampleDouble())
       {
         direction = reflect(unit_direction, record.normal);
       }
@@ -102,3 +161,24 @@ class Dielectric : public Material
       return r0 + (1 - r0) * std::pow((1 - cosine), 5);
     }
 };
+
+class DiffuseLight : public Material
+{
+  // Emits the same light in every direction from its front face (the side its normal points
+  // to), and absorbs everything arriving on it.
+
+  public:
+    DiffuseLight(shared_ptr<Texture> texture) : texture(texture) {}
+    DiffuseLight(const Color& emission) : texture(make_shared<SolidColor>(emission)) {}
+
+    bool emits() const override { return true; }
+
+    Color emitted(const Ray& ray_in, const HitRecord& record) const override
+    {
+      if (!record.front_face) return Color(0, 0, 0);
+      return texture->value(record.u, record.v, record.hit_impact);
+    }
+
+  private:
+    shared_ptr<Texture> texture;
+};
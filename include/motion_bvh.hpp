@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+
+struct MotionBVHNode
+{
+  // One node of a flattened BVH over moving primitives, 64 bytes (a cache line). The node
+  // stores its bounds at the start and the end of its time span, and a ray tests the bounds
+  // interpolated to its own time. Primitives move linearly over the shutter interval, so the
+  // interpolated box of a node encloses the boxes of its primitives at any time of its span.
+  // Nodes are in depth-first order, the first child next to its parent, 'offset' holding the
+  // index of the second child, or the first primitive slot of a leaf. A time split node has
+  // the same primitives under both children, the first for the first half of its span and the
+  // second for the other half.
+
+  float bounds_min[2][3]; // At time_start, then at time_end
+  float bounds_max[2][3];
+  float time_start, time_end;
+  uint32_t offset;
+  uint16_t primitive_count; // 0 for interior nodes
+  uint8_t axis;             // Split axis of interior nodes, used to visit the near child first
+  uint8_t time_split;       // 1 for a time split node
+
+  bool isLeaf() const { return primitive_count > 0; }
+
+  void setBounds(const AABB& start_box, const AABB& end_box)
+  {
+    for(int axis = 0; axis < 3; axis++)
+    {
+      bounds_min[0][axis] = LinearBVHNode::roundDown(start_box.axisInterval(axis).min);
+      bounds_max[0][axis] = LinearBVHNode::roundUp(start_box.axisInterval(axis).max);
+      bounds_min[1][axis] = LinearBVHNode::roundDown(end_box.axisInterval(axis).min);
+      bounds_max[1][axis] = LinearBVHNode::roundUp(end_box.axisInterval(axis).max);
+    }
+  }
+
+  bool hit(const Point3& origin, const Vector3& inverse_direction, const int direction_is_negative[3],
+           double time, const Interval& ray_t) const
+  {
+    // Slab test against the box interpolated to the ray time.
+    double s = (time - time_start) / (time_end - time_start);
+    double t_min = ray_t.min;
+    double t_max = ray_t.max;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      double low = bounds_min[0][axis] + s * (bounds_min[1][axis] - bounds_min[0][axis]);
+      double high = bounds_max[0][axis] + s * (bounds_max[1][axis] - bounds_max[0][axis]);
+      double near_bound = direction_is_negative[axis] ? high : low;
+      double far_bound = direction_is_negative[axis] ? low : high;
+      double t0 = (near_bound - origin[axis]) * inverse_direction[axis];
+      double t1 = (far_bound - origin[axis]) * inverse_direction[axis];
+      if(t0 > t_min) t_min = t0;
+      if(t1 < t_max) t_max = t1;
+      if(t_max < t_min) return false;
+    }
+    return true;
+  }
+};
+
+static_assert(sizeof(MotionBVHNode) == 64, "MotionBVHNode must stay 64 bytes");
+
+class MotionBVH : public Hittable
+{
+  // BVH for scenes with motion blur. A moving primitive's usual box covers its whole path, so
+  // the boxes of a BVH over moving spheres grow and overlap, and a ray at any one time visits
+  // nodes whose primitives were elsewhere at that time. Here every node keeps its bounds at
+  // both ends of its time span and is tested with the bounds at the ray's time.
+  //
+  // Where primitives move a lot compared to their size, even the interpolated bounds of a
+  // node are loose: the primitives under it drift apart, or cross. Such a node can be split in
+  // time instead of in space, into two subtrees over the same primitives, each built for half
+  // of the time span (up to max_time_splits times down any path). Both halves reference the
+  // primitives, so time splits trade memory for tighter bounds.
+
+  public:
+    MotionBVH(const HittableList& list, int max_time_splits = 0, int max_leaf_size = 4)
+      : max_time_splits(max_time_splits), max_leaf_size(std::clamp(max_leaf_size, 1, 65535))
+    {
+      objects = list.objects;
+      std::vector<BuildItem> items(objects.size());
+      for(size_t index = 0; index < objects.size(); index++) items[index].index = uint32_t(index);
+
+      if(!items.empty())
+      {
+        nodes.reserve(2 * items.size());
+        primitives.reserve(items.size());
+        setTimeSpan(items, 0, items.size(), 0.0, 1.0);
+        build(items, 0, items.size(), 0.0, 1.0, max_time_splits, 0);
+      }
+      bbox = list.boundingBox();
+      objects = std::vector<shared_ptr<Hittable>>();
+      nodes.shrink_to_fit();
+    }
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      // Iterative traversal, as LinearBVHTree::traverse(), with the node boxes at the ray time
+      // and, at time split nodes, only the child whose span holds the ray time.
+      if(nodes.empty()) return false;
+
+      const Point3& origin = ray.origin();
+      const Vector3& direction = ray.direction();
+      double time = ray.time();
+      Vector3 inverse_direction(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+      int direction_is_negative[3] = { inverse_direction.x() < 0, inverse_direction.y() < 0, inverse_direction.z() < 0 };
+
+      uint32_t stack[LinearBVHTree::max_depth];
+      int stack_size = 0;
+      uint32_t current = 0;
+      bool hit_anything = false;
+
+      while(true)
+      {
+        const MotionBVHNode& node = nodes[current];
+        RTW_COUNT(BVHNodesVisited);
+        RTW_COUNT(AABBTests);
+        if(node.hit(origin, inverse_direction, direction_is_negative, time, ray_t))
+        {
+          if(node.isLeaf())
+          {
+            for(uint32_t slot = node.offset; slot < node.offset + node.primitive_count; slot++)
+            {
+              if(primitives[slot]->hit(ray, ray_t, record))
+              {
+                hit_anything = true;
+                ray_t.max = record.t;
+              }
+            }
+          }
+          else if(node.time_split)
+          {
+            current = time < nodes[current + 1].time_end ? current + 1 : node.offset;
+            continue;
+          }
+          else
+          {
+            if(direction_is_negative[node.axis])
+            {
+              stack[stack_size++] = current + 1;
+              current = node.offset;
+            }
+            else
+            {
+              stack[stack_size++] = node.offset;
+              current = current + 1;
+            }
+            continue;
+          }
+        }
+
+        if(stack_size == 0) break;
+        current = stack[--stack_size];
+      }
+      return hit_anything;
+    }
+
+    AABB boundingBox() const override
+    {
+      return bbox;
+    }
+
+    size_t nodeCount() const { return nodes.size(); }
+    size_t primitiveCount() const { return primitives.size(); } // Primitive references, counting those time splits repeat
+
+    // A node is split in time when its interpolated box at mid span has more than this many
+    // times the surface area of the box around its primitives at that time.
+    static constexpr double time_split_threshold = 1.5;
+
+  private:
+    struct BuildItem
+    {
+      AABB start_box, end_box; // At both ends of the time span of the node being built
+      AABB box;                // At mid span, what the SAH partitions
+      uint32_t index;
+    };
+
+    std::vector<MotionBVHNode> nodes;
+    std::vector<shared_ptr<Hittable>> primitives; // In leaf order
+    std::vector<shared_ptr<Hittable>> objects;    // The list, while building
+    AABB bbox;
+    int max_time_splits;
+    int max_leaf_size;
+
+    static AABB boxOf(const BuildItem& item)
+    {
+      return item.box;
+    }
+
+    static AABB lerp(const AABB& a, const AABB& b, double s)
+    {
+      Interval axes[3];
+      for(int axis = 0; axis < 3; axis++)
+      {
+        const Interval& from = a.axisInterval(axis);
+        const Interval& to = b.axisInterval(axis);
+        axes[axis] = Interval(from.min + s * (to.min - from.min), from.max + s * (to.max - from.max));
+      }
+      return AABB(axes[0], axes[1], axes[2]);
+    }
+
+    void setTimeSpan(std::vector<BuildItem>& items, size_t start, size_t end, double time_start, double time_end) const
+    {
+      for(size_t item_index = start; item_index < end; item_index++)
+      {
+        BuildItem& item = items[item_index];
+        item.start_box = objects[item.index]->boundingBoxAt(time_start);
+        item.end_box = objects[item.index]->boundingBoxAt(time_end);
+        item.box = lerp(item.start_box, item.end_box, 0.5);
+      }
+    }
+
+    uint32_t build(std::vector<BuildItem>& items, size_t start, size_t end, double time_start, double time_end,
+                   int time_splits_left, int depth)
+    {
+      // The boxes of the items must be those of the time span.
+      AABB start_bounds = AABB::empty, end_bounds = AABB::empty, bounds = AABB::empty;
+      for(size_t item_index = start; item_index < end; item_index++)
+      {
+        const BuildItem& item = items[item_index];
+        start_bounds = AABB(start_bounds, item.start_box);
+        end_bounds = AABB(end_bounds, item.end_box);
+        bounds = AABB(bounds, item.box);
+      }
+
+      size_t item_count = end - start;
+      uint32_t node_index = uint32_t(nodes.size());
+      nodes.emplace_back();
+      nodes[node_index].setBounds(start_bounds, end_bounds);
+      nodes[node_index].time_start = float(time_start);
+      nodes[node_index].time_end = float(time_end);
+      nodes[node_index].primitive_count = 0;
+      nodes[node_index].axis = 0;
+      nodes[node_index].time_split = 0;
+
+      if(item_count > 1 && time_splits_left > 0 && depth < LinearBVHTree::max_depth - 8
+         && lerp(start_bounds, end_bounds, 0.5).surfaceArea() > time_split_threshold * bounds.surfaceArea())
+      {
+        double time_middle = 0.5 * (time_start + time_end);
+        nodes[node_index].time_split = 1;
+        setTimeSpan(items, start, end, time_start, time_middle);
+        build(items, start, end, time_start, time_middle, time_splits_left - 1, depth + 1);
+        setTimeSpan(items, start, end, time_middle, time_end);
+        nodes[node_index].offset = build(items, start, end, time_middle, time_end, time_splits_left - 1, depth + 1);
+        return node_index;
+      }
+
+      size_t mid = start;
+      bool make_leaf = item_count <= size_t(max_leaf_size);
+      if(item_count > 1 && depth < BVHPartition::max_sah_depth)
+      {
+        // Keep a leaf when intersecting all of its primitives is cheaper than the best split.
+        double split_cost;
+        mid = BVHPartition::binnedSAH(items, start, end, boxOf, split_cost);
+        double area = bounds.surfaceArea();
+        if(area > 0) split_cost = BVHNode::traversal_cost + BVHNode::intersection_cost * split_cost / area;
+        make_leaf = make_leaf && BVHNode::intersection_cost * item_count <= split_cost;
+      }
+      if(make_leaf)
+      {
+        nodes[node_index].offset = uint32_t(primitives.size());
+        nodes[node_index].primitive_count = uint16_t(item_count);
+        for(size_t item_index = start; item_index < end; item_index++) primitives.push_back(objects[items[item_index].index]);
+        return node_index;
+      }
+
+      if(mid <= start || mid >= end) mid = BVHPartition::median(items, start, end, bounds.longestAxis(), boxOf);
+
+      nodes[node_index].axis = uint8_t(BVHPartition::splitAxis(items, start, mid, end, boxOf));
+
+      build(items, start, mid, time_start, time_end, time_splits_left, depth + 1);
+      nodes[node_index].offset = build(items, mid, end, time_start, time_end, time_splits_left, depth + 1);
+      return node_index;
+    }
+};
\ No newline at end of file
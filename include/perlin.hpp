@@ -1,18 +1,51 @@
 #pragma once
 
+#include <algorithm>
+#include <vector>
+
+#include "cpu_features.hpp"
+
 class Perlin
 {
+  // turbulence() sums depth octaves of the noise, octave n at the point moved by octaveOffset(n)
+  // lattice cells along every axis, each with half the weight of the previous one. Moving by
+  // whole lattice cells leaves the position inside the cell unchanged, so all the octaves share
+  // it and differ only by the gradients at the cell corners: they are folded into one weighted
+  // gradient per corner, then interpolated once. The scalar kernel does so in double; the
+  // AVX2 kernel gathers the gradients of 8 octaves per instruction, in float. The reference
+  // kernel evaluates the octaves one by one. The benchmark checks that the kernels agree.
+
   public:
-    Perlin()
+    enum class Kernel
+    {
+      Reference, // One noise() per octave
+      Scalar,    // Octaves folded per corner, double
+      AVX2       // Octaves folded per corner, 8 per instruction, float
+    };
+
+    static Kernel bestKernel()
+    {
+      return cpuSupportsAVX2() ? Kernel::AVX2 : Kernel::Scalar;
+    }
+
+    Perlin(Kernel kernel = bestKernel()) : Perlin(randomEngine(), kernel) {}
+
+    Perlin(RandomEngine& engine, Kernel kernel = bestKernel()) : kernel(kernel)
     {
+      // Build the gradient and permutation tables from the given engine, so a seeded engine
+      // always gives the same noise.
       for (int i = 0; i < point_count; i++)
       {
-        random_vector[i] = unit_vector(Vector3::random(-1, 1));
+        Vector3 candidate(randomDouble(engine, -1, 1), randomDouble(engine, -1, 1), randomDouble(engine, -1, 1));
+        random_vector[i] = unit_vector(candidate);
+        for (int axis = 0; axis < 3; axis++) float_vector[axis][i] = float(random_vector[i][axis]);
       }
 
-      perlinGeneratePerm(perm_x);
-      perlinGeneratePerm(perm_y);
-      perlinGeneratePerm(perm_z);
+      perlinGeneratePerm(perm_x, engine);
+      perlinGeneratePerm(perm_y, engine);
+      perlinGeneratePerm(perm_z, engine);
+
+      if (kernel == Kernel::AVX2 && !cpuSupportsAVX2()) this->kernel = Kernel::Scalar;
     }
 
     double noise(const Point3& point) const
@@ -40,42 +73,160 @@ class Perlin
     }
 
     double turbulence(const Point3& point, int depth) const
+    {
+      switch (kernel)
+      {
+        case Kernel::Reference: return turbulenceReference(point, depth);
+#if RTW_X86_SIMD
+        case Kernel::AVX2: return turbulenceAVX2(point, depth);
+#endif
+        default: return turbulenceScalar(point, depth);
+      }
+    }
+
+    // Lattice cells octave n is moved by along every axis. The original turbulence() doubled the
+    // point with `temp_point *= 2.0` each octave, but Vector3::operator*= adds, so the octaves
+    // were shifted by 2 cells instead of scaled: the noise looks the way it does because of that.
+    // The folded kernels rely on whole-cell shifts, so every kernel takes the octaves from here
+    // rather than from Vector3 arithmetic.
+    static int octaveOffset(int octave)
+    {
+      return 2 * octave;
+    }
+
+    double turbulenceReference(const Point3& point, int depth) const
     {
       double accum = 0.0;
-      Point3 temp_point = point;
       double weight = 1.0;
 
-      for (int i = 0; i < depth; i++)
+      for (int octave = 0; octave < depth; octave++)
       {
-        accum += weight * noise(temp_point);
+        double offset = octaveOffset(octave);
+        accum += weight * noise(point + Vector3(offset, offset, offset));
         weight *= 0.5;
-        temp_point *= 2.0;
       }
       return std::fabs(accum);      
     }
 
+    double turbulenceScalar(const Point3& point, int depth) const
+    {
+      double floor_x = std::floor(point.x());
+      double floor_y = std::floor(point.y());
+      double floor_z = std::floor(point.z());
+      double u = point.x() - floor_x;
+      double v = point.y() - floor_y;
+      double w = point.z() - floor_z;
+      int i = int(floor_x);
+      int j = int(floor_y);
+      int k = int(floor_z);
+
+      Vector3 c[2][2][2];
+      double weight = 1.0;
+      for (int octave = 0; octave < depth; octave++, weight *= 0.5)
+      {
+        int offset = octaveOffset(octave);
+        int px[2] = { perm_x[(i+offset) & 255], perm_x[(i+1+offset) & 255] };
+        int py[2] = { perm_y[(j+offset) & 255], perm_y[(j+1+offset) & 255] };
+        int pz[2] = { perm_z[(k+offset) & 255], perm_z[(k+1+offset) & 255] };
+        for(int di=0; di < 2; di++)
+          for(int dj=0; dj < 2; dj++)
+            for(int dk=0; dk < 2; dk++)
+              c[di][dj][dk] += weight * random_vector[px[di] ^ py[dj] ^ pz[dk]];
+      }
+
+      return std::fabs(perlinInterpolation(c, u, v, w));
+    }
+
+#if RTW_X86_SIMD
+    RTW_TARGET_AVX2
+    double turbulenceAVX2(const Point3& point, int depth) const
+    {
+      // Lane n holds octave n of the current group of 8. Each corner adds its interpolation
+      // weight times the dot products of its 8 gradients with the corner offset, weighted per
+      // octave; the lanes are summed at the end.
+      double u = point.x() - std::floor(point.x());
+      double v = point.y() - std::floor(point.y());
+      double w = point.z() - std::floor(point.z());
+
+      int i = int(std::floor(point.x()));
+      int j = int(std::floor(point.y()));
+      int k = int(std::floor(point.z()));
+
+      float uu = float(u*u*(3-2*u));
+      float vv = float(v*v*(3-2*v));
+      float ww = float(w*w*(3-2*w));
+
+      const __m256i index_mask = _mm256_set1_epi32(point_count - 1);
+      __m256 accum = _mm256_setzero_ps();
+      float weight = 1.0f;
+      for (int first = 0; first < depth; first += 8)
+      {
+        alignas(32) float weights[8];
+        alignas(32) int lane_offsets[8];
+        for (int lane = 0; lane < 8; lane++, weight *= 0.5f)
+        {
+          weights[lane] = first + lane < depth ? weight : 0.0f;
+          lane_offsets[lane] = octaveOffset(first + lane);
+        }
+        __m256 octave_weight = _mm256_load_ps(weights);
+        __m256i offsets = _mm256_load_si256(reinterpret_cast<const __m256i*>(lane_offsets));
+
+        __m256i px[2], py[2], pz[2];
+        for (int d = 0; d < 2; d++)
+        {
+          px[d] = _mm256_i32gather_epi32(perm_x, _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(i + d), offsets), index_mask), 4);
+          py[d] = _mm256_i32gather_epi32(perm_y, _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(j + d), offsets), index_mask), 4);
+          pz[d] = _mm256_i32gather_epi32(perm_z, _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(k + d), offsets), index_mask), 4);
+        }
+
+        for (int di = 0; di < 2; di++)
+          for (int dj = 0; dj < 2; dj++)
+            for (int dk = 0; dk < 2; dk++)
+            {
+              __m256i hash = _mm256_xor_si256(_mm256_xor_si256(px[di], py[dj]), pz[dk]);
+              __m256 gx = _mm256_i32gather_ps(float_vector[0], hash, 4);
+              __m256 gy = _mm256_i32gather_ps(float_vector[1], hash, 4);
+              __m256 gz = _mm256_i32gather_ps(float_vector[2], hash, 4);
+              __m256 dot = _mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(gx, _mm256_set1_ps(float(u - di))),
+                _mm256_mul_ps(gy, _mm256_set1_ps(float(v - dj)))),
+                _mm256_mul_ps(gz, _mm256_set1_ps(float(w - dk))));
+              float corner_weight = (di ? uu : 1 - uu) * (dj ? vv : 1 - vv) * (dk ? ww : 1 - ww);
+              accum = _mm256_add_ps(accum, _mm256_mul_ps(_mm256_mul_ps(dot, octave_weight), _mm256_set1_ps(corner_weight)));
+            }
+      }
+
+      __m128 sum = _mm_add_ps(_mm256_castps256_ps128(accum), _mm256_extractf128_ps(accum, 1));
+      sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+      sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+      return std::fabs(double(_mm_cvtss_f32(sum)));
+    }
+#endif
+
   private:
     static const int point_count = 256;
+    Kernel kernel;
     Vector3 random_vector[point_count];
+    float float_vector[3][point_count]; // random_vector as floats, one array per axis
     int perm_x[point_count];
     int perm_y[point_count];
     int perm_z[point_count];
 
-    static void perlinGeneratePerm(int* p)
+    static void perlinGeneratePerm(int* p, RandomEngine& engine)
     {
       for (int i = 0; i < point_count; i++)
       {
         p[i] = i;
       }
 
-      permute(p, point_count);
+      permute(p, point_count, engine);
     }
 
-    static void permute(int* p, int n)
+    static void permute(int* p, int n, RandomEngine& engine)
     {
       for (int i = n-1; i > 0; i--)
       {
-        int target = randomInt(0, i);
+        int target = randomInt(engine, 0, i);
         int tmp = p[i];
         p[i] = p[target];
         p[target] = tmp;
@@ -104,6 +255,64 @@ class Perlin
     }
 };
 
+class NoiseVolume
+{
+  // Turbulence sampled once on a regular grid over a box, then read back with trilinear
+  // interpolation: eight loads instead of evaluating the octaves. The noise changes over about
+  // one lattice cell, so a few samples per unit are enough. Points outside the box are left to
+  // the exact evaluation.
+
+  public:
+    NoiseVolume(const Perlin& noise, int depth, const Point3& low, const Point3& high, double samples_per_unit = 16)
+      : low(low), samples_per_unit(samples_per_unit)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        counts[axis] = std::max(2, int(std::ceil((high[axis] - low[axis]) * samples_per_unit)) + 1);
+      }
+
+      samples.resize(size_t(counts[0]) * counts[1] * counts[2]);
+      size_t index = 0;
+      for (int z = 0; z < counts[2]; z++)
+        for (int y = 0; y < counts[1]; y++)
+          for (int x = 0; x < counts[0]; x++)
+          {
+            Point3 point = low + Vector3(x, y, z) / samples_per_unit;
+            samples[index++] = float(noise.turbulence(point, depth));
+          }
+    }
+
+    bool lookup(const Point3& point, double& turbulence) const
+    {
+      double grid[3];
+      int cell[3];
+      for (int axis = 0; axis < 3; axis++)
+      {
+        grid[axis] = (point[axis] - low[axis]) * samples_per_unit;
+        if (!(grid[axis] >= 0 && grid[axis] <= counts[axis] - 1)) return false;
+        cell[axis] = std::min(int(grid[axis]), counts[axis] - 2);
+        grid[axis] -= cell[axis];
+      }
+
+      const float* corner = samples.data() + (size_t(cell[2]) * counts[1] + cell[1]) * counts[0] + cell[0];
+      size_t row = size_t(counts[0]), slice = size_t(counts[0]) * counts[1];
+      double x0 = corner[0] + grid[0] * (corner[1] - corner[0]);
+      double x1 = corner[row] + grid[0] * (corner[row + 1] - corner[row]);
+      double x2 = corner[slice] + grid[0] * (corner[slice + 1] - corner[slice]);
+      double x3 = corner[slice + row] + grid[0] * (corner[slice + row + 1] - corner[slice + row]);
+      double y0 = x0 + grid[1] * (x1 - x0);
+      double y1 = x2 + grid[1] * (x3 - x2);
+      turbulence = y0 + grid[2] * (y1 - y0);
+      return true;
+    }
+
+  private:
+    Point3 low;
+    double samples_per_unit;
+    int counts[3];
+    std::vector<float> samples;
+};
+
 /*
 * TODO : fix the perlin noise to get the same result as in the book.
 */
\ No newline at end of file
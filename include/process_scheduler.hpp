@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define RTW_HAS_FORK 1
+  #include <cerrno>
+  #include <poll.h>
+  #include <signal.h>
+  #include <sys/socket.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#else
+  #define RTW_HAS_FORK 0
+#endif
+
+class ProcessScheduler
+{
+  // Runs tasks in worker processes forked from the calling (coordinator) process. A worker
+  // inherits the whole address space at the fork, scene included, so only task indices and
+  // results cross the local sockets that connect it to the coordinator. The coordinator hands
+  // each worker one task at a time; if a worker dies, its task goes back to the queue for the
+  // others, and the coordinator runs whatever is left itself if no worker survives.
+
+  public:
+    // Runs in a worker process: computes the result of a task, as raw bytes.
+    using Work = std::function<std::vector<unsigned char>(size_t task_index)>;
+    // Runs in the coordinator: consumes the result of a task. Called once per task.
+    using Receive = std::function<void(size_t task_index, const std::vector<unsigned char>& result)>;
+
+    static void run(size_t task_count, int process_count, const Work& work, const Receive& receive)
+    {
+      std::deque<size_t> pending;
+      for(size_t task_index = 0; task_index < task_count; task_index++) pending.push_back(task_index);
+
+#if RTW_HAS_FORK
+      std::vector<Worker> workers;
+      for(int worker_index = 0; worker_index < process_count && size_t(worker_index) < task_count; worker_index++)
+      {
+        Worker worker;
+        if(spawn(work, workers, worker)) workers.push_back(worker);
+      }
+
+      size_t in_flight = 0;
+      while(!pending.empty() || in_flight > 0)
+      {
+        // Hand a task to every idle worker.
+        for(Worker& worker : workers)
+        {
+          if(!worker.alive || worker.busy || pending.empty()) continue;
+          uint64_t task_index = pending.front();
+          if(!sendAll(worker.socket, &task_index, sizeof(task_index)))
+          {
+            retire(worker, "could not be reached");
+            continue;
+          }
+          pending.pop_front();
+          worker.task = size_t(task_index);
+          worker.busy = true;
+          in_flight++;
+        }
+
+        std::vector<pollfd> descriptors;
+        std::vector<Worker*> polled;
+        for(Worker& worker : workers)
+        {
+          if(!worker.alive || !worker.busy) continue;
+          descriptors.push_back({ worker.socket, POLLIN, 0 });
+          polled.push_back(&worker);
+        }
+        if(descriptors.empty()) break; // Every worker is gone
+
+        if(poll(descriptors.data(), descriptors.size(), -1) < 0)
+        {
+          if(errno == EINTR) continue;
+          break;
+        }
+
+        for(size_t index = 0; index < descriptors.size(); index++)
+        {
+          if(descriptors[index].revents == 0) continue;
+          Worker& worker = *polled[index];
+
+          // A result is the task index, its size in bytes, then the bytes.
+          uint64_t header[2];
+          std::vector<unsigned char> result;
+          bool received = receiveAll(worker.socket, header, sizeof(header)) && header[0] == worker.task;
+          if(received)
+          {
+            result.resize(size_t(header[1]));
+            received = receiveAll(worker.socket, result.data(), result.size());
+          }
+
+          worker.busy = false;
+          in_flight--;
+          if(!received)
+          {
+            // The task goes first, it has been waiting the longest.
+            pending.push_front(worker.task);
+            retire(worker, "died");
+            continue;
+          }
+          receive(worker.task, result);
+        }
+      }
+
+      for(Worker& worker : workers)
+      {
+        if(!worker.alive) continue;
+        uint64_t stop = stop_task;
+        sendAll(worker.socket, &stop, sizeof(stop));
+        close(worker.socket);
+        waitpid(worker.pid, nullptr, 0);
+      }
+#endif
+
+      // Without worker processes (or once all of them died), run the rest here.
+      for(size_t task_index : pending) receive(task_index, work(task_index));
+    }
+
+  private:
+#if RTW_HAS_FORK
+    static const uint64_t stop_task = ~uint64_t(0);
+
+    struct Worker
+    {
+      pid_t pid = -1;
+      int socket = -1;
+      bool alive = false;
+      bool busy = false;
+      size_t task = 0;
+    };
+
+    static bool spawn(const Work& work, const std::vector<Worker>& siblings, Worker& worker)
+    {
+      int sockets[2];
+      if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) return false;
+
+      std::cout.flush();
+      std::clog.flush();
+      pid_t pid = fork();
+      if(pid < 0)
+      {
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+      }
+
+      if(pid == 0)
+      {
+        close(sockets[0]);
+        for(const Worker& sibling : siblings) close(sibling.socket);
+        serve(work, sockets[1]);
+      }
+
+      close(sockets[1]);
+      worker.pid = pid;
+      worker.socket = sockets[0];
+      worker.alive = true;
+      return true;
+    }
+
+    [[noreturn]] static void serve(const Work& work, int socket)
+    {
+      // Worker loop: answer tasks until told to stop or the coordinator goes away. _exit()
+      // leaves without running the destructors and exit handlers the fork copied from the
+      // coordinator.
+      uint64_t task_index;
+      while(receiveAll(socket, &task_index, sizeof(task_index)) && task_index != stop_task)
+      {
+        std::vector<unsigned char> result = work(size_t(task_index));
+        uint64_t header[2] = { task_index, result.size() };
+        if(!sendAll(socket, header, sizeof(header)) || !sendAll(socket, result.data(), result.size())) break;
+      }
+      std::cout.flush();
+      std::clog.flush();
+      _exit(0);
+    }
+
+    static void retire(Worker& worker, const char* reason)
+    {
+      std::clog << "\nWorker process " << worker.pid << ' ' << reason << ", its tasks go to the others.\n";
+      close(worker.socket);
+      kill(worker.pid, SIGKILL);
+      waitpid(worker.pid, nullptr, 0);
+      worker.alive = false;
+    }
+
+    static bool sendAll(int socket, const void* data, size_t size)
+    {
+      // MSG_NOSIGNAL turns writes to a dead peer into an error instead of a SIGPIPE.
+#ifdef MSG_NOSIGNAL
+      const int flags = MSG_NOSIGNAL;
+#else
+      const int flags = 0;
+#endif
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      while(size > 0)
+      {
+        ssize_t sent = send(socket, bytes, size, flags);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        bytes += sent;
+        size -= size_t(sent);
+      }
+      return true;
+    }
+
+    static bool receiveAll(int socket, void* data, size_t size)
+    {
+      unsigned char* bytes = static_cast<unsigned char*>(data);
+      while(size > 0)
+      {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if(received < 0 && errno == EINTR) continue;
+        if(received <= 0) return false;
+        bytes += received;
+        size -= size_t(received);
+      }
+      return true;
+    }
+#endif
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.hpp"
+#include "hittable_list.hpp"
 
 class Quad : public Hittable
 {
@@ -11,6 +12,8 @@ class Quad : public Hittable
       normal = unit_vector(n);
       D = dot(normal, Q);
       w = n / dot(n, n);
+      uv_scale = 1.0 / std::fmin(u.length(), v.length());
+      area = n.length();
 
       setBoundingBox();
     }
@@ -26,8 +29,49 @@ class Quad : public Hittable
 
     AABB boundingBox() const override { return bbox; }
 
+    Vector3 sampleDirection(const Point3& origin, double time, double u, double v) const override
+    {
+      // Towards a point drawn uniformly over the area of the quad.
+      return Q + u * this->u + v * this->v - origin;
+    }
+
+    double directionPdf(const Point3& origin, const Vector3& direction, double time) const override
+    {
+      // The area density converted to solid angle: distance^2 / (cosine * area).
+      HitRecord record;
+      if (!hit(Ray(origin, direction, time), Interval(0.001, infinity), record)) return 0;
+
+      double distance_squared = record.t * record.t * direction.length_squared();
+      double cosine = std::fabs(dot(direction, normal)) / direction.length();
+      return distance_squared / (cosine * area);
+    }
+
     bool hit(const Ray &ray, Interval ray_t, HitRecord &record) const override
     {
+      RTW_COUNT(QuadTests);
+      double t, alpha, beta;
+      if(!intersectPlane(Q, u, v, w, normal, D, ray, ray_t, t, alpha, beta))
+        return false;
+
+      if(!isInterior(alpha, beta, record))
+        return false;
+
+      record.t = t;
+      record.hit_impact = ray.at(t);
+      record.uv_scale = uv_scale;
+      record.material = material.get();
+      record.setFaceNormal(ray, normal);
+
+      return true;
+    }
+
+    static bool intersectPlane(const Point3& Q, const Vector3& u, const Vector3& v, const Vector3& w,
+                               const Vector3& normal, double D, const Ray& ray, const Interval& ray_t,
+                               double& t, double& alpha, double& beta)
+    {
+      // Intersect the ray with the plane of the quad, returning the hit distance t and the
+      // plane coordinates alpha, beta of the hit point. Shared with the packed primitives of
+      // cached scenes.
       double denominator = dot(normal, ray.direction());
 
       // No hit if the ray is parallel to the plane.
@@ -35,24 +79,14 @@ class Quad : public Hittable
         return false;
       
       // Return false if the hit point parameter t is outside the ray interval.
-      auto t = (D - dot(normal, ray.origin())) / denominator;
+      t = (D - dot(normal, ray.origin())) / denominator;
       if(!ray_t.constains(t))
         return false;
       
       // Determine if the hit point lies within the planar shape using its plane coordiantes
-      auto intersection = ray.at(t);
-      Vector3 planar_hitpt_vector = intersection - Q;
-      double alpha = dot(w, cross(planar_hitpt_vector, v));
-      double beta = dot(w, cross(u, planar_hitpt_vector));
-
-      if(!isInterior(alpha, beta, record))
-        return false;
-
-      record.t = t;
-      record.hit_impact = intersection;
-      record.material = material;
-      record.setFaceNormal(ray, normal);
-
+      Vector3 planar_hitpt_vector = ray.at(t) - Q;
+      alpha = dot(w, cross(planar_hitpt_vector, v));
+      beta = dot(w, cross(u, planar_hitpt_vector));
       return true;
     }
 
@@ -74,8 +108,29 @@ class Quad : public Hittable
     Point3 Q;
     Vector3 u, v;
     Vector3 w;
+    double uv_scale; // Along the shorter edge
+    double area;
     shared_ptr<Material> material;
     AABB bbox;
     Vector3 normal;
     double D;
-};
\ No newline at end of file
+};
+
+inline HittableList box(const Point3& a, const Point3& b, shared_ptr<Material> material)
+{
+  // The six quads of the axis aligned box with opposite corners a and b, facing outwards.
+  HittableList sides;
+  Point3 min(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
+  Point3 max(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()));
+  Vector3 dx(max.x() - min.x(), 0, 0);
+  Vector3 dy(0, max.y() - min.y(), 0);
+  Vector3 dz(0, 0, max.z() - min.z());
+
+  sides.add(make_shared<Quad>(Point3(min.x(), min.y(), max.z()), dx, dy, material));  // Front
+  sides.add(make_shared<Quad>(Point3(max.x(), min.y(), max.z()), -dz, dy, material)); // Right
+  sides.add(make_shared<Quad>(Point3(max.x(), min.y(), min.z()), -dx, dy, material)); // Back
+  sides.add(make_shared<Quad>(Point3(min.x(), min.y(), min.z()), dz, dy, material));  // Left
+  sides.add(make_shared<Quad>(Point3(min.x(), max.y(), max.z()), dx, -dz, material)); // Top
+  sides.add(make_shared<Quad>(Point3(min.x(), min.y(), min.z()), dx, dz, material));  // Bottom
+  return sides;
+}
\ No newline at end of file
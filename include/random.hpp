@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+class RandomEngine
+{
+  // PCG32 (XSH-RR variant) random number generator: 64 bits of state, 32 bits per draw.
+  // See https://www.pcg-random.org. An engine is meant to be owned by one thread.
+  //
+  // Besides the plain streaming mode, the engine has a counter based mode: beginPath() keys
+  // the engine on (seed, pixel, sample) and beginBounce() restarts the sequence from that key
+  // and the bounce index. Every random number of a path then only depends on where it is
+  // drawn, not on what was drawn before on the same thread, so renders are reproducible across
+  // thread counts, tile sizes and runs.
+
+  public:
+    RandomEngine() { seed(0x853c49e6748fea9bULL); }
+
+    explicit RandomEngine(uint64_t initial_state, uint64_t stream = default_stream)
+    {
+      seed(initial_state, stream);
+    }
+
+    void seed(uint64_t initial_state, uint64_t stream = default_stream)
+    {
+      // Restart the sequence in streaming mode.
+      keyed = false;
+      reseed(initial_state, stream);
+    }
+
+    void beginPath(uint64_t seed_value, uint64_t pixel_index, uint64_t sample_index)
+    {
+      // Switch to the counter based mode for the path of the given pixel sample, starting
+      // at the camera ray (bounce 0).
+      keyed = true;
+      path_key = mix(seed_value ^ mix(pixel_index ^ mix(sample_index)));
+      reseed(path_key, default_stream);
+    }
+
+    void beginBounce(int bounce)
+    {
+      // Restart the sequence for the given bounce of the current path. Does nothing in the
+      // streaming mode.
+      if(keyed)
+      {
+        reseed(mix(path_key ^ mix(uint64_t(bounce) + 1)), default_stream);
+      }
+    }
+
+    uint32_t nextUInt()
+    {
+      uint64_t old_state = state;
+      state = old_state * multiplier + increment;
+      uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+      uint32_t rotation = uint32_t(old_state >> 59u);
+      return (xorshifted >> rotation) | (xorshifted << ((~rotation + 1u) & 31u));
+    }
+
+    double nextDouble()
+    {
+      // Return a random real in [0, 1).
+      return nextUInt() * (1.0 / 4294967296.0);
+    }
+
+    static uint64_t mix(uint64_t value)
+    {
+      // SplitMix64 finalizer, used to turn counters into well distributed seeds.
+      value += 0x9e3779b97f4a7c15ULL;
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+      return value ^ (value >> 31);
+    }
+
+  private:
+    static constexpr uint64_t multiplier = 6364136223846793005ULL;
+    static constexpr uint64_t default_stream = 0xda3e39cb94b95bdbULL;
+
+    uint64_t state = 0;
+    uint64_t increment = 1; // Must be odd, selects one of the 2^63 streams
+    uint64_t path_key = 0;
+    bool keyed = false;
+
+    void reseed(uint64_t initial_state, uint64_t stream)
+    {
+      state = 0;
+      increment = (stream << 1u) | 1u;
+      nextUInt();
+      state += initial_state;
+      nextUInt();
+    }
+};
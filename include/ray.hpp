@@ -22,8 +22,26 @@ public:
     return ray_origin + t * ray_direction;
   }
 
+  // The ray stands for a cone of rays: its width at the origin, and how fast it widens per unit
+  // of distance. Textures use the width where the cone meets a surface to pick a mip level.
+  void setCone(double width, double spread)
+  {
+    cone_width = width;
+    cone_spread = spread;
+  }
+
+  double coneWidth() const { return cone_width; }
+  double coneSpread() const { return cone_spread; }
+
+  double coneWidthAt(double t) const
+  {
+    return cone_width + cone_spread * t * ray_direction.length();
+  }
+
 private:
   Point3 ray_origin;
   Vector3 ray_direction;
   double ray_time;
+  double cone_width = 0;
+  double cone_spread = 0;
 };
\ No newline at end of file
@@ -9,8 +9,13 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include <array>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class RTWImage
 {
@@ -26,54 +31,77 @@ class RTWImage
       // parent, on so on, for six levels up. Ifthe image was not loaded successfully,
       // width() anf height() will return 0.
 
-      auto filename = std::string(image_filename);
-      auto image_directory = getenv("RTW_IMAGES");
-
-      // Hunt for the image file in some likely locations.
-      if (image_directory && load(std::string(image_directory) + "/" + image_filename)) return;
-      if (load(filename)) return;
-      if (load("images/" + filename)) return;
-      if (load("../images/" + filename)) return;
-      if (load("../../images/" + filename)) return;
-      if (load("../../../images/" + filename)) return;
-      if (load("../../../../images/" + filename)) return;
-      if (load("../../../../../images/" + filename)) return;
-      if (load("../../../../../../images/" + filename)) return;
+      std::string filename = locate(image_filename);
+      if (!filename.empty() && load(filename)) return;
 
       std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
+    static std::string locate(const std::string& filename)
+    {
+      // Return the path of the first of the likely locations where the file exists, or an
+      // empty string if there is none.
+      std::vector<std::string> candidates;
+      auto image_directory = getenv("RTW_IMAGES");
+      if (image_directory) candidates.push_back(std::string(image_directory) + "/" + filename);
+      candidates.push_back(filename);
+      std::string prefix = "images/";
+      for (int level = 0; level < 7; level++, prefix = "../" + prefix) candidates.push_back(prefix + filename);
+
+      for (const std::string& candidate : candidates)
+      {
+        if (std::ifstream(candidate)) return candidate;
+      }
+      return std::string();
+    }
+
     ~RTWImage()
     {
-      delete[] bdata;
-      STBI_FREE(fdata);
+      STBI_FREE(bdata);
     }
 
     bool load(const std::string& filename)
     {
       // Load the linear (gamma=1) image data from given file name. Returns true if the
-      // load succeeded. The resulting data buffer contains the three [0.0, 1.00]
-      // floating-point values for the first pixel (red, then green, then blue). Pixels are
-      //contiguous, going left to right for the width of the image, followed by the next row
-      // bellow, for the full height of the image.
+      // load succeeded. The resulting data buffer contains the three [0, 255] byte values
+      // for the first pixel (red, then green, then blue). Pixels are contiguous, going left
+      // to right for the width of the image, followed by the next row bellow, for the full
+      // height of the image.
+
+      STBI_FREE(bdata);
+      bdata = nullptr;
 
       auto n = bytes_per_pixel; // Dummy out parameter: original component per pixel
-      fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-      if(fdata == nullptr) return false;
+      if(stbi_is_hdr(filename.c_str()))
+      {
+        float* fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+        if(fdata == nullptr) return false;
+        convertToBytes(fdata);
+        STBI_FREE(fdata);
+      }
+      else
+      {
+        // 8-bit images are decoded as bytes and linearized in place, through a table giving
+        // the bytes the float decoding (stbi_loadf) would have converted to.
+        bdata = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+        if(bdata == nullptr) return false;
+        const unsigned char* linear = linearBytes();
+        size_t total_bytes = size_t(image_width) * image_height * bytes_per_pixel;
+        for(size_t i = 0; i < total_bytes; i++) bdata[i] = linear[bdata[i]];
+      }
 
       bytes_per_scanline = image_width * bytes_per_pixel;
-      convertToBytes();
       return true;
     }
 
     int width() const 
     {
-      return (fdata == nullptr) ? 0 : image_width;
+      return (bdata == nullptr) ? 0 : image_width;
     }
 
     int height() const
     {
-      return (fdata == nullptr) ? 0 : image_height;
+      return (bdata == nullptr) ? 0 : image_height;
     }
 
     const unsigned char* pixelData(int x, int y) const
@@ -91,7 +119,6 @@ class RTWImage
 
   private:
     const int bytes_per_pixel = 3;
-    float *fdata = nullptr; // Linear floating point pixel data
     unsigned char *bdata = nullptr; // Linear 8-bit pixel data
     int image_width = 0; // Loaded image width
     int image_height = 0; // Loaded image height
@@ -114,24 +141,39 @@ class RTWImage
       return static_cast<unsigned char>(256.0 * value);
     }
 
-    void convertToBytes()
+    void convertToBytes(const float* fdata)
     {
       // Convert the linear floating point pixel data to bytes, storing the resulting byte
       // data in the 'bdata' member.
 
-      int total_bytes = image_width * image_height * bytes_per_pixel;
-      bdata = new unsigned char[total_bytes];
+      size_t total_bytes = size_t(image_width) * image_height * bytes_per_pixel;
+      bdata = static_cast<unsigned char*>(STBI_MALLOC(total_bytes));
 
       // Iterate through all pixel components, converting from [0.0, 1.0] float values to
       // unsigned [0, 255] byte values.
 
       auto *bptr = bdata;
       auto *fptr = fdata;
-      for(auto i = 0; i < total_bytes; i++, fptr++, bptr++)
+      for(size_t i = 0; i < total_bytes; i++, fptr++, bptr++)
       {
         *bptr = floatToByte(*fptr);
       }
     }
+
+    static const unsigned char* linearBytes()
+    {
+      // Linear byte of each gamma encoded byte, as stbi_loadf computes it (gamma 2.2).
+      static const auto table = []
+      {
+        std::array<unsigned char, 256> bytes;
+        for(int value = 0; value < 256; value++)
+        {
+          bytes[value] = floatToByte(float(std::pow(value / 255.0f, 2.2f) * 1.0f));
+        }
+        return bytes;
+      }();
+      return table.data();
+    }
 };
 
 // Restore MSVC compiler warnings
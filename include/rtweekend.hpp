@@ -13,6 +13,14 @@
 using std::shared_ptr;
 using std::make_shared;
 
+// Random Number Generation
+
+#include "random.hpp"
+
+// Statistics Counters
+
+#include "trace_statistics.hpp"
+
 // Constants
 
 constexpr double infinity = std::numeric_limits<double>::infinity();
@@ -25,22 +33,41 @@ inline double deg2rad(double degrees)
   return degrees * PI / 180.0;
 }
 
+inline RandomEngine& randomEngine()
+{
+  // Each thread owns its own engine, so render threads never share (or race on) a state.
+  thread_local RandomEngine engine;
+  return engine;
+}
+
+inline double randomDouble(RandomEngine& engine, double min, double max)
+{
+  // Return a random real in [min, max), drawn from the given engine.
+  return min + (max - min) * engine.nextDouble();
+}
+
+inline int randomInt(RandomEngine& engine, int min, int max)
+{
+  // Returns a random integer in [min, max], drawn from the given engine.
+  return int(randomDouble(engine, min, max + 1));
+}
+
 inline double randomDouble()
 {
   // Return a random real in [0, 1).
-  return std::rand() / (RAND_MAX + 1.0);
+  return randomEngine().nextDouble();
 }
 
 inline double randomDouble(double min, double max)
 {
   // Return a random real in [min, max).
-  return min + (max - min) * randomDouble();
+  return randomDouble(randomEngine(), min, max);
 }
 
 inline int randomInt(int min, int max)
 {
   // Returns a random integer in [min, max].
-  return int(randomDouble(min, max + 1));
+  return randomInt(randomEngine(), min, max);
 }
 
 // Common Headers
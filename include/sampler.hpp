@@ -0,0 +1,583 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rtweekend.hpp"
+#include "vector3.hpp"
+
+// Samplers give the values a path uses in place of independent random numbers: for the camera
+// ray (position in the pixel, point on the lens, time), then for every bounce (scattering
+// direction, choice between reflection and refraction, Russian roulette). Each value is a pure
+// function of the pixel, the sample index and the dimension it fills, like the counter based
+// random engine, so renders stay reproducible across threads, tiles and processes.
+//
+// Spreading the samples of a pixel evenly over each dimension (stratified) or over all of them
+// together (low discrepancy) makes the error fall faster with the sample count than independent
+// random numbers do.
+
+enum class SamplerType
+{
+  Independent, // The random engine, as without a sampler
+  Stratified,  // Jittered strata, shuffled between dimensions
+  Halton,      // Halton sequence, one prime base per dimension, Owen scrambled per pixel
+  Sobol,       // Sobol (0, 2) pairs with hash based Owen scrambling, shuffled between pairs
+  BlueNoise    // Sobol pairs shared by all pixels, rotated per pixel by a blue noise mask
+};
+
+inline bool parseSamplerType(const std::string& name, SamplerType& type)
+{
+  if(name == "independent") type = SamplerType::Independent;
+  else if(name == "stratified") type = SamplerType::Stratified;
+  else if(name == "halton") type = SamplerType::Halton;
+  else if(name == "sobol") type = SamplerType::Sobol;
+  else if(name == "bluenoise") type = SamplerType::BlueNoise;
+  else return false;
+  return true;
+}
+
+class Sampler
+{
+  public:
+    virtual ~Sampler() = default;
+
+    // Value in [0, 1) of a dimension of sample `index` of pixel x, y.
+    virtual double get1D(int x, int y, uint32_t index, uint32_t dimension) const = 0;
+
+    // Values of two consecutive dimensions, distributed together where the sampler can.
+    virtual void get2D(int x, int y, uint32_t index, uint32_t dimension, double& u, double& v) const
+    {
+      u = get1D(x, y, index, dimension);
+      v = get1D(x, y, index, dimension + 1);
+    }
+
+    // Dimensions from this one on are drawn from the random engine.
+    virtual uint32_t dimensionCount() const { return ~0u; }
+
+    static shared_ptr<Sampler> create(SamplerType type, int samples_per_pixel, uint64_t seed);
+
+  protected:
+    static uint32_t pixelHash(uint64_t seed, int x, int y)
+    {
+      return uint32_t(RandomEngine::mix(seed ^ ((uint64_t(uint32_t(y)) << 32) | uint32_t(x))));
+    }
+
+    static uint32_t hash(uint32_t a, uint32_t b)
+    {
+      // Hash of two values, cheaper than the 64 bit mix of the random engine since samplers
+      // take several per value (Wellons' lowbias32 finalizer).
+      uint32_t value = a ^ ((b + 0x9e3779b9u) * 0x85ebca6bu);
+      value ^= value >> 16;
+      value *= 0x7feb352du;
+      value ^= value >> 15;
+      value *= 0x846ca68bu;
+      value ^= value >> 16;
+      return value;
+    }
+
+    static double toUnit(uint32_t value)
+    {
+      // Map 32 bits to [0, 1).
+      return value * (1.0 / 4294967296.0);
+    }
+
+    static uint32_t reverseBits(uint32_t value)
+    {
+      value = (value << 16) | (value >> 16);
+      value = ((value & 0x00ff00ffu) << 8) | ((value & 0xff00ff00u) >> 8);
+      value = ((value & 0x0f0f0f0fu) << 4) | ((value & 0xf0f0f0f0u) >> 4);
+      value = ((value & 0x33333333u) << 2) | ((value & 0xccccccccu) >> 2);
+      value = ((value & 0x55555555u) << 1) | ((value & 0xaaaaaaaau) >> 1);
+      return value;
+    }
+
+    static uint32_t owenScramble(uint32_t value, uint32_t seed)
+    {
+      // Nested uniform scrambling of the bits of value, from the most significant one down,
+      // through the Laine-Karras hash on the reversed bits (Burley, "Practical Hash-based Owen
+      // Scrambling", 2020). It permutes the points of a (0, m, 2) net into another such net.
+      value = reverseBits(value);
+      value += seed;
+      value ^= value * 0x6c50b47cu;
+      value ^= value * 0xb82f1e52u;
+      value ^= value * 0xc7afe638u;
+      value ^= value * 0x8d22f6e6u;
+      return reverseBits(value);
+    }
+
+    static void sobolPair(uint32_t index, uint32_t& first, uint32_t& second)
+    {
+      // The first two dimensions of the Sobol sequence, as 32 bit fractions. The second one is
+      // the XOR of the direction numbers of the set bits of the index, looked up a byte at a
+      // time in tables of all the XORs of 8 consecutive direction numbers.
+      static const std::vector<uint32_t> tables = []
+      {
+        std::vector<uint32_t> table(4 * 256, 0);
+        uint32_t direction = 1u << 31;
+        for(int bit = 0; bit < 32; bit++, direction ^= direction >> 1)
+        {
+          uint32_t* byte_table = &table[size_t(bit / 8) * 256];
+          for(int byte = 0; byte < 256; byte++)
+          {
+            if(byte & (1 << (bit % 8))) byte_table[byte] ^= direction;
+          }
+        }
+        return table;
+      }();
+
+      first = reverseBits(index);
+      second = tables[index & 0xff] ^ tables[256 + ((index >> 8) & 0xff)]
+             ^ tables[512 + ((index >> 16) & 0xff)] ^ tables[768 + (index >> 24)];
+    }
+};
+
+class StratifiedSampler : public Sampler
+{
+  // The samples of a pixel are split in a square grid of strata for every pair of dimensions
+  // (and in as many strata as samples for single ones), with a random point in each. Each
+  // dimension visits the strata in its own random order, so dimensions are not correlated.
+  // Samples past the last full grid start new grids.
+
+  public:
+    StratifiedSampler(int samples_per_pixel, uint64_t seed) : seed(seed)
+    {
+      grid_size = std::max(1, int(std::sqrt(double(std::max(samples_per_pixel, 1)))));
+      strata_1d = uint32_t(std::max(samples_per_pixel, 1));
+    }
+
+    double get1D(int x, int y, uint32_t index, uint32_t dimension) const override
+    {
+      uint32_t round = index / strata_1d;
+      uint32_t key = hash(pixelHash(seed, x, y), hash(dimension, round));
+      uint32_t stratum = permute(index % strata_1d, strata_1d, key);
+      return (stratum + toUnit(hash(key, index))) / strata_1d;
+    }
+
+    void get2D(int x, int y, uint32_t index, uint32_t dimension, double& u, double& v) const override
+    {
+      uint32_t strata = uint32_t(grid_size * grid_size);
+      uint32_t round = index / strata;
+      uint32_t key = hash(pixelHash(seed, x, y), hash(dimension | 0x80000000u, round));
+      uint32_t stratum = permute(index % strata, strata, key);
+      uint32_t jitter = hash(key, index);
+      u = (stratum % grid_size + toUnit(jitter)) / grid_size;
+      v = (stratum / grid_size + toUnit(hash(jitter, 1))) / grid_size;
+    }
+
+  private:
+    uint64_t seed;
+    int grid_size;
+    uint32_t strata_1d;
+
+    static uint32_t permute(uint32_t index, uint32_t count, uint32_t key)
+    {
+      // Element `index` of a random permutation of [0, count), without storing it: a keyed
+      // bijection on the next power of two, cycle-walked until it lands in range (Kensler,
+      // "Correlated Multi-Jittered Sampling", 2013).
+      uint32_t mask = count - 1;
+      mask |= mask >> 1;
+      mask |= mask >> 2;
+      mask |= mask >> 4;
+      mask |= mask >> 8;
+      mask |= mask >> 16;
+      do
+      {
+        index ^= key;
+        index *= 0xe170893du;
+        index ^= key >> 16;
+        index ^= (index & mask) >> 4;
+        index ^= key >> 8;
+        index *= 0x0929eb3fu;
+        index ^= key >> 23;
+        index ^= (index & mask) >> 1;
+        index *= 1 | key >> 27;
+        index *= 0x6935fa69u;
+        index ^= (index & mask) >> 11;
+        index *= 0x74dcb303u;
+        index ^= (index & mask) >> 2;
+        index *= 0x9e501cc3u;
+        index ^= (index & mask) >> 2;
+        index *= 0xc860a3dfu;
+        index &= mask;
+        index ^= index >> 5;
+      } while(index >= count);
+      return index;
+    }
+};
+
+class HaltonSampler : public Sampler
+{
+  // Dimension d is the radical inverse of the sample index in the d-th prime base, Owen
+  // scrambled per pixel and dimension: each digit goes through a permutation chosen by the
+  // digits before it. Unscrambled, or only shifted, consecutive high bases give nearly
+  // diagonal point sets over the first samples; the scrambling breaks that correlation and
+  // keeps neighbouring pixels from repeating the same pattern. Only the first dimensions come
+  // from the sequence.
+
+  public:
+    HaltonSampler(int samples_per_pixel, uint64_t seed) : seed(seed)
+    {
+      for(size_t dimension = 0; dimension < primes.size(); dimension++)
+      {
+        digit_counts[dimension] = 0;
+        for(uint64_t count = 1; count < uint64_t(std::max(samples_per_pixel, 1)); count *= primes[dimension])
+        {
+          digit_counts[dimension]++;
+        }
+      }
+    }
+
+    double get1D(int x, int y, uint32_t index, uint32_t dimension) const override
+    {
+      uint32_t key = hash(pixelHash(seed, x, y), dimension);
+      if(dimension == 0) return toUnit(owenScramble(reverseBits(index), key)); // Base 2, in bits
+      return scrambledRadicalInverse(index, primes[dimension], digit_counts[dimension], key);
+    }
+
+    uint32_t dimensionCount() const override { return uint32_t(primes.size()); }
+
+  private:
+    static constexpr std::array<uint32_t, 64> primes = {
+      2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+      59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+      137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+      227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+    };
+
+    uint64_t seed;
+    std::array<int, primes.size()> digit_counts; // Digits of the largest sample index, per base
+
+    static double scrambledRadicalInverse(uint32_t index, uint32_t base, int digit_count, uint32_t key)
+    {
+      // The permutation of a digit is d -> (a d + c) mod base, a bijection since the base is
+      // prime, with a and c drawn from a hash of the digits above it. Past the digits the
+      // sample indices of a pixel use, each point is alone in its interval and its scrambled
+      // digits are uniformly distributed, so they are drawn at once as an offset within it.
+      double inverse_base = 1.0 / base, scale = inverse_base, value = 0;
+      uint32_t node = key;
+      for(int position = 0; ; position++)
+      {
+        if(index == 0 && position >= digit_count)
+        {
+          value += toUnit(hash(node, 0)) * scale * base;
+          break;
+        }
+
+        uint32_t digit = index % base;
+        index /= base;
+        uint32_t permutation = hash(node, 0);
+        uint32_t a = 1 + (permutation & 0xffff) % (base - 1);
+        uint32_t c = (permutation >> 16) % base;
+        value += ((a * digit + c) % base) * scale;
+        node = hash(node, digit + 1);
+        scale *= inverse_base;
+      }
+      return std::min(value, 0x1.fffffffffffffp-1);
+    }
+};
+
+class SobolSampler : public Sampler
+{
+  // Every pair of dimensions is a (0, 2) sequence: the first two Sobol dimensions, Owen
+  // scrambled per pixel and pair. The sample index is Owen scrambled per pixel and pair as well
+  // before the lookup, which shuffles the order of the samples differently for every pair, so
+  // pairs are not correlated and the sequence extends to any number of dimensions.
+
+  public:
+    SobolSampler(uint64_t seed) : seed(seed) {}
+
+    double get1D(int x, int y, uint32_t index, uint32_t dimension) const override
+    {
+      double u, v;
+      get2D(x, y, index, dimension & ~1u, u, v);
+      return (dimension & 1) ? v : u;
+    }
+
+    void get2D(int x, int y, uint32_t index, uint32_t dimension, double& u, double& v) const override
+    {
+      uint32_t key = hash(pixelHash(seed, x, y), dimension);
+      uint32_t first, second;
+      sobolPair(owenScramble(index, key), first, second);
+      u = toUnit(owenScramble(first, hash(key, 1)));
+      v = toUnit(owenScramble(second, hash(key, 2)));
+    }
+
+  private:
+    uint64_t seed;
+};
+
+class BlueNoiseSampler : public Sampler
+{
+  // Dithered sampling (Georgiev and Fajardo, "Blue-noise Dithered Sampling", 2016): all the
+  // pixels use the same Sobol pairs, shuffled per pair only, each pixel rotating them by the
+  // values of a blue noise mask at its position. Neighbouring pixels then get well spread
+  // offsets, which pushes the remaining error towards high spatial frequencies, where it reads
+  // as fine grain rather than blotches. The mask is a 64 x 64 tile built once by void filling.
+
+  public:
+    BlueNoiseSampler(uint64_t seed) : seed_hash(uint32_t(RandomEngine::mix(seed))) {}
+
+    double get1D(int x, int y, uint32_t index, uint32_t dimension) const override
+    {
+      double u, v;
+      get2D(x, y, index, dimension & ~1u, u, v);
+      return (dimension & 1) ? v : u;
+    }
+
+    void get2D(int x, int y, uint32_t index, uint32_t dimension, double& u, double& v) const override
+    {
+      uint32_t key = hash(seed_hash, dimension);
+      uint32_t first, second;
+      sobolPair(owenScramble(index, key), first, second);
+
+      // Each dimension reads the mask at its own toroidal shift.
+      u = rotate(toUnit(owenScramble(first, hash(key, 1))), maskValue(x, y, hash(key, 3)));
+      v = rotate(toUnit(owenScramble(second, hash(key, 2))), maskValue(x, y, hash(key, 4)));
+    }
+
+  private:
+    static constexpr int mask_size = 64;
+
+    uint32_t seed_hash;
+
+    static double rotate(double value, double offset)
+    {
+      value += offset;
+      return value < 1.0 ? value : value - 1.0;
+    }
+
+    static double maskValue(int x, int y, uint32_t shift)
+    {
+      static const std::vector<float> mask = buildMask();
+      int mask_x = int((uint32_t(x) + (shift & 0xffff)) % mask_size);
+      int mask_y = int((uint32_t(y) + (shift >> 16)) % mask_size);
+      return mask[size_t(mask_y) * mask_size + mask_x];
+    }
+
+    static std::vector<float> buildMask()
+    {
+      // Rank every texel of the tile by repeatedly filling the largest void: the texel with
+      // the least energy, where each filled texel spreads a Gaussian of energy around it on
+      // the torus. The rank, scaled to [0, 1), is the mask value.
+      const int texel_count = mask_size * mask_size;
+      const double sigma = 1.9;
+      std::vector<double> kernel(texel_count);
+      for(int dy = 0; dy < mask_size; dy++)
+      {
+        for(int dx = 0; dx < mask_size; dx++)
+        {
+          int wrapped_x = std::min(dx, mask_size - dx), wrapped_y = std::min(dy, mask_size - dy);
+          kernel[size_t(dy) * mask_size + dx] = std::exp(-(wrapped_x * wrapped_x + wrapped_y * wrapped_y) / (2 * sigma * sigma));
+        }
+      }
+
+      // A tiny deterministic jitter breaks the ties of the first, empty rounds.
+      RandomEngine engine(0x626c75656e6f6973ULL);
+      std::vector<double> energy(texel_count);
+      for(double& value : energy) value = engine.nextDouble() * 1e-9;
+
+      std::vector<float> mask(texel_count);
+      std::vector<bool> filled(texel_count, false);
+      for(int rank = 0; rank < texel_count; rank++)
+      {
+        int best = -1;
+        for(int texel = 0; texel < texel_count; texel++)
+        {
+          if(!filled[texel] && (best < 0 || energy[texel] < energy[best])) best = texel;
+        }
+
+        filled[best] = true;
+        mask[best] = (rank + 0.5f) / texel_count;
+        int best_x = best % mask_size, best_y = best / mask_size;
+        for(int y = 0; y < mask_size; y++)
+        {
+          const double* row = &kernel[size_t((y - best_y + mask_size) % mask_size) * mask_size];
+          for(int x = 0; x < mask_size; x++)
+          {
+            energy[size_t(y) * mask_size + x] += row[(x - best_x + mask_size) % mask_size];
+          }
+        }
+      }
+      return mask;
+    }
+};
+
+inline shared_ptr<Sampler> Sampler::create(SamplerType type, int samples_per_pixel, uint64_t seed)
+{
+  // The independent sampler is no sampler at all: the path then draws from the random engine.
+  switch(type)
+  {
+    case SamplerType::Stratified: return make_shared<StratifiedSampler>(samples_per_pixel, seed);
+    case SamplerType::Halton: return make_shared<HaltonSampler>(samples_per_pixel, seed);
+    case SamplerType::Sobol: return make_shared<SobolSampler>(seed);
+    case SamplerType::BlueNoise: return make_shared<BlueNoiseSampler>(seed);
+    default: return nullptr;
+  }
+}
+
+class PathSamples
+{
+  // The sample values of the path being traced on this thread. Dimensions are laid out per
+  // use: the camera ray takes the first ones, then each bounce a block of its own, so a value
+  // always fills the same dimension whatever the earlier bounces drew. Within a bounce, the
+  // material draws from the start of the block, light sampling takes the next two dimensions
+  // and Russian roulette the last one.
+  // Draws past the dimensions of the block or of the sampler, and every draw without a sampler,
+  // go to the random engine.
+
+  public:
+    static constexpr uint32_t pixel_dimension = 0;     // 2D: position in the pixel
+    static constexpr uint32_t lens_dimension = 2;      // 2D: point on the defocus disk
+    static constexpr uint32_t time_dimension = 4;      // 1D: shutter time
+    static constexpr uint32_t camera_dimensions = 5;
+    static constexpr uint32_t material_dimensions = 3; // Per bounce: direction (2D), then a choice (1D)
+    static constexpr uint32_t light_dimensions = 2;    // Light and point on it
+    static constexpr uint32_t bounce_dimensions = material_dimensions + light_dimensions + 1; // And Russian roulette
+
+    void beginPath(const Sampler* path_sampler, int pixel_x, int pixel_y, int sample_index)
+    {
+      sampler = path_sampler;
+      x = pixel_x;
+      y = pixel_y;
+      index = uint32_t(sample_index);
+      block = next = block_end = camera_dimensions;
+    }
+
+    void beginBounce(int bounce)
+    {
+      // Start the block of the given bounce (0 for the first surface hit).
+      block = camera_dimensions + uint32_t(bounce) * bounce_dimensions;
+      next = block;
+      block_end = block + material_dimensions;
+    }
+
+    void reset()
+    {
+      // Back to drawing everything from the random engine, without a sampler.
+      *this = PathSamples();
+    }
+
+    bool active() const { return sampler != nullptr; }
+
+    double get1D()
+    {
+      if(!sampler || next >= block_end) return randomDouble();
+      return at(next++);
+    }
+
+    void get2D(double& u, double& v)
+    {
+      if(!sampler || next + 2 > block_end)
+      {
+        u = randomDouble();
+        v = randomDouble();
+        return;
+      }
+      at2D(next, u, v);
+      next += 2;
+    }
+
+    double at(uint32_t dimension) const
+    {
+      if(dimension >= sampler->dimensionCount()) return randomDouble();
+      return sampler->get1D(x, y, index, dimension);
+    }
+
+    void at2D(uint32_t dimension, double& u, double& v) const
+    {
+      if(dimension + 1 >= sampler->dimensionCount())
+      {
+        u = randomDouble();
+        v = randomDouble();
+        return;
+      }
+      sampler->get2D(x, y, index, dimension, u, v);
+    }
+
+    void light(double& u, double& v) const
+    {
+      // The light sampling values of the current bounce.
+      if(!sampler)
+      {
+        u = randomDouble();
+        v = randomDouble();
+        return;
+      }
+      at2D(block + material_dimensions, u, v);
+    }
+
+    double roulette() const
+    {
+      // The Russian roulette value of the current bounce.
+      if(!sampler) return randomDouble();
+      return at(block + material_dimensions + light_dimensions);
+    }
+
+  private:
+    const Sampler* sampler = nullptr;
+    int x = 0, y = 0;
+    uint32_t index = 0;
+    uint32_t block = 0, next = 0, block_end = 0;
+};
+
+inline PathSamples& pathSamples()
+{
+  thread_local PathSamples samples;
+  return samples;
+}
+
+class PathSamplesScope
+{
+  // Resets the thread's path samples when it goes out of scope, so they never point to a
+  // sampler that the renderer holding it has since destroyed.
+
+  public:
+    PathSamplesScope() = default;
+    PathSamplesScope(const PathSamplesScope&) = delete;
+    PathSamplesScope& operator=(const PathSamplesScope&) = delete;
+    ~PathSamplesScope() { pathSamples().reset(); }
+};
+
+inline Vector3 sampleUnitVector()
+{
+  // A uniformly distributed unit vector from the next two dimensions of the path, or from the
+  // random engine without a sampler.
+  PathSamples& samples = pathSamples();
+  if(!samples.active()) return randomUnitVector();
+
+  double u, v;
+  samples.get2D(u, v);
+  double z = 1 - 2 * u;
+  double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+  double phi = 2 * PI * v;
+  return Vector3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+inline double sampleDouble()
+{
+  // A real in [0, 1) from the next dimension of the path, or from the random engine.
+  return pathSamples().get1D();
+}
+
+inline Vector3 concentricDiskSample(double u, double v)
+{
+  // Map the unit square to the unit disk keeping strata compact (Shirley and Chiu, 1997).
+  double a = 2 * u - 1, b = 2 * v - 1;
+  if(a == 0 && b == 0) return Vector3(0, 0, 0);
+  double r, phi;
+  if(std::fabs(a) > std::fabs(b))
+  {
+    r = a;
+    phi = (PI / 4) * (b / a);
+  }
+  else
+  {
+    r = b;
+    phi = (PI / 2) - (PI / 4) * (a / b);
+  }
+  return Vector3(r * std::cos(phi), r * std::sin(phi), 0);
+}
@@ -0,0 +1,959 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.hpp"
+
+#include "linear_bvh.hpp"
+#include "mapped_file.hpp"
+#include "scenes.hpp"
+#include "triangle_mesh.hpp"
+
+// Scene files.
+//
+// The text format (.rtw) has one statement per line; '#' starts a comment. Materials and
+// textures are named, and must be declared before they are used:
+//
+//   camera width 800 height 400 samples 100 depth 50 fov 20 from 13 2 3 at 0 0 0 up 0 1 0
+//          defocus_angle 0.6 focus_distance 10 seed 0        (every setting is optional)
+//          sampler independent | stratified | halton | sobol | bluenoise
+//          background sky | background R G B  light_sampling 1
+//          denoise 1  features PREFIX  (PREFIX_albedo.pfm, PREFIX_normal.pfm, PREFIX_depth.pfm)
+//   output ../render/scene.ppm
+//   accelerator list | bvh | linear | wide | morton | motion (wide by default; morton is a
+//          wide BVH over a Morton ordered tree, quicker to build)
+//   sphere_batch SIZE   (groups the spheres SIZE per SphereBatch before the accelerator is
+//          built, see sphere_batch.hpp; 0, the default, keeps them apart)
+//   texture NAME solid R G B
+//   texture NAME checker SCALE EVEN_TEXTURE ODD_TEXTURE
+//   texture NAME image FILE                                  (or its converted .rtwt file)
+//   texture NAME noise SCALE
+//   material NAME lambertian TEXTURE  |  material NAME lambertian R G B
+//   material NAME diffuse_light TEXTURE  |  material NAME diffuse_light R G B
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric REFRACTION_INDEX
+//   sphere X Y Z RADIUS MATERIAL
+//   moving_sphere X1 Y1 Z1 X2 Y2 Z2 RADIUS MATERIAL
+//   quad QX QY QZ UX UY UZ VX VY VZ MATERIAL
+//   mesh FILE MATERIAL                                       (a Wavefront OBJ file)
+//   instance FILE MATERIAL [translate X Y Z] [rotate AX AY AZ DEGREES] [scale S | scale X Y Z]
+//
+// Primitives with a diffuse_light material are the lights the camera samples; meshes are
+// not sampled. An instance places a mesh with the transforms it lists, applied in order; the
+// mesh is loaded once for all its instances, which share one InstanceBVH.
+//
+// The binary cache (.rtwb) holds the same scene once built: the settings statements above as
+// text, then the flattened BVH nodes, the primitives in leaf order, as fixed size records
+// aligned so they can be used in place, and the slots of the lights among them. Loading one
+// maps the file and parses the few settings lines, whatever the number of primitives. Meshes
+// stay in their OBJ files, which the mesh statements among the settings load again.
+
+struct PackedPrimitive
+{
+  // A sphere or a quad as a plain record, with everything its intersection needs precomputed.
+  //   sphere: center (0-2), motion from the center at time 0 to time 1 (3-5), radius (6)
+  //   quad: Q (0-2), u (3-5), v (6-8), w (9-11), unit normal (12-14), plane offset D (15)
+
+  enum Type : uint32_t { SphereType = 0, QuadType = 1 };
+
+  uint32_t type;
+  uint32_t material;
+  double data[16];
+
+  static PackedPrimitive sphere(const Point3& center1, const Point3& center2, double radius, uint32_t material)
+  {
+    PackedPrimitive primitive = {};
+    primitive.type = SphereType;
+    primitive.material = material;
+    Vector3 motion = center2 - center1;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      primitive.data[axis] = center1[axis];
+      primitive.data[3 + axis] = motion[axis];
+    }
+    primitive.data[6] = std::fmax(0, radius);
+    return primitive;
+  }
+
+  static PackedPrimitive quad(const Point3& Q, const Vector3& u, const Vector3& v, uint32_t material)
+  {
+    // Same derived values as the Quad constructor.
+    Vector3 n = cross(u, v);
+    Vector3 normal = unit_vector(n);
+    Vector3 w = n / dot(n, n);
+
+    PackedPrimitive primitive = {};
+    primitive.type = QuadType;
+    primitive.material = material;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      primitive.data[axis] = Q[axis];
+      primitive.data[3 + axis] = u[axis];
+      primitive.data[6 + axis] = v[axis];
+      primitive.data[9 + axis] = w[axis];
+      primitive.data[12 + axis] = normal[axis];
+    }
+    primitive.data[15] = dot(normal, Q);
+    return primitive;
+  }
+
+  Vector3 vector(int first) const
+  {
+    return Vector3(data[first], data[first + 1], data[first + 2]);
+  }
+
+  AABB boundingBox() const
+  {
+    if(type == SphereType)
+    {
+      Vector3 rvec(data[6], data[6], data[6]);
+      Point3 center1 = vector(0);
+      Point3 center2 = center1 + vector(3);
+      return AABB(AABB(center1 - rvec, center1 + rvec), AABB(center2 - rvec, center2 + rvec));
+    }
+    Point3 Q = vector(0);
+    Vector3 u = vector(3), v = vector(6);
+    return AABB(AABB(Q, Q + u + v), AABB(Q + u, Q + v));
+  }
+
+  bool hit(const Ray& ray, const Interval& ray_t, HitRecord& record) const
+  {
+    // Fills the record but its material, which the owner resolves from the material index.
+    if(type == SphereType)
+    {
+      RTW_COUNT(SphereTests);
+      return Sphere::intersect(vector(0) + ray.time() * vector(3), data[6], ray, ray_t, record);
+    }
+
+    RTW_COUNT(QuadTests);
+    double t, alpha, beta;
+    if(!Quad::intersectPlane(vector(0), vector(3), vector(6), vector(9), vector(12), data[15], ray, ray_t, t, alpha, beta))
+      return false;
+
+    Interval unit_interval = Interval(0, 1);
+    if(!unit_interval.constains(alpha) || !unit_interval.constains(beta))
+      return false;
+
+    record.t = t;
+    record.hit_impact = ray.at(t);
+    record.u = alpha;
+    record.v = beta;
+    record.uv_scale = 1.0 / std::fmin(vector(3).length(), vector(6).length());
+    record.setFaceNormal(ray, vector(12));
+    return true;
+  }
+};
+
+static_assert(sizeof(PackedPrimitive) == 136, "PackedPrimitive is stored as is in scene caches");
+
+struct SceneCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // byte_order_mark as written, to reject files from the other endianness
+  uint64_t settings_offset, settings_size;
+  uint64_t node_offset, node_count;
+  uint64_t primitive_offset, primitive_count;
+  uint64_t material_count;
+  uint64_t light_offset, light_count; // uint32_t slots of the light primitives
+
+  static constexpr const char* magic_value = "RTWSCENE";
+  static const uint32_t current_version = 2;
+  static const uint32_t byte_order_mark = 0x01020304;
+};
+
+class PackedScene : public Hittable
+{
+  // Flattened BVH over packed primitives, both read in place from a scene cache.
+
+  public:
+    PackedScene(shared_ptr<MappedFile> file, const LinearBVHNode* nodes, size_t node_count,
+                const PackedPrimitive* primitives, size_t primitive_count,
+                std::vector<shared_ptr<Material>> materials)
+      : file(file), nodes(nodes), node_count(node_count), primitives(primitives),
+        primitive_count(primitive_count), materials(std::move(materials)) {}
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      return LinearBVHTree::traverse(nodes, node_count, ray, ray_t, [&](uint32_t first, uint32_t count, Interval& interval)
+      {
+        bool hit_anything = false;
+        for(uint32_t slot = first; slot < first + count; slot++)
+        {
+          const PackedPrimitive& primitive = primitives[slot];
+          if(primitive.hit(ray, interval, record))
+          {
+            record.material = materials[primitive.material].get();
+            hit_anything = true;
+            interval.max = record.t;
+          }
+        }
+        return hit_anything;
+      });
+    }
+
+    AABB boundingBox() const override
+    {
+      return node_count == 0 ? AABB::empty : nodes[0].boundingBox();
+    }
+
+    size_t nodeCount() const { return node_count; }
+    size_t primitiveCount() const { return primitive_count; }
+
+  private:
+    shared_ptr<MappedFile> file; // Keeps the mapping the nodes and primitives point into alive
+    const LinearBVHNode* nodes;
+    size_t node_count;
+    const PackedPrimitive* primitives;
+    size_t primitive_count;
+    std::vector<shared_ptr<Material>> materials;
+};
+
+class SceneDescription
+{
+  // A scene as read from a scene file: its camera and settings, its materials, and its
+  // primitives as packed records, from which it builds either the usual hittables or a cache.
+
+  public:
+    Camera camera;
+    std::string output_file = "render.ppm";
+    std::string accelerator = "wide";
+    int sphere_batch_size = 0; // Spheres per SphereBatch, 0 to keep the spheres apart
+    std::vector<shared_ptr<Material>> materials;
+    std::vector<PackedPrimitive> primitives;
+    std::vector<shared_ptr<TriangleMesh>> meshes;
+    shared_ptr<InstanceBVH> instances; // Every instance statement, or null if there is none
+    std::string settings; // Every statement but the primitives, as read
+
+    bool parseFile(const std::string& filename)
+    {
+      std::ifstream in(filename);
+      if(!in)
+      {
+        std::cerr << "ERROR: Could not open scene file '" << filename << "'.\n";
+        return false;
+      }
+      return parse(in, filename);
+    }
+
+    bool parse(std::istream& in, const std::string& source_name)
+    {
+      // Parse every statement, reporting the errors as source:line. Returns false if any
+      // statement could not be parsed.
+      std::string line;
+      int line_number = 0;
+      bool success = true;
+      while(std::getline(in, line))
+      {
+        line_number++;
+        std::string statement = line.substr(0, line.find('#'));
+        std::istringstream tokens(statement);
+        std::string keyword;
+        if(!(tokens >> keyword)) continue;
+
+        std::string error;
+        if(!parseStatement(keyword, tokens, error))
+        {
+          std::cerr << "ERROR: " << source_name << ':' << line_number << ": " << error << '\n';
+          success = false;
+        }
+        else if(keyword != "sphere" && keyword != "moving_sphere" && keyword != "quad")
+        {
+          settings += statement + '\n';
+        }
+      }
+
+      loadImages();
+      return loadMeshes() && success;
+    }
+
+    HittableList objects() const
+    {
+      HittableList list;
+      for(const PackedPrimitive& primitive : primitives) list.add(object(primitive, materials));
+      return list;
+    }
+
+    static shared_ptr<Hittable> object(const PackedPrimitive& primitive, const std::vector<shared_ptr<Material>>& materials)
+    {
+      const shared_ptr<Material>& material = materials[primitive.material];
+      if(primitive.type == PackedPrimitive::SphereType)
+      {
+        Point3 center = primitive.vector(0);
+        return make_shared<Sphere>(center, center + primitive.vector(3), primitive.data[6], material);
+      }
+      return make_shared<Quad>(primitive.vector(0), primitive.vector(3), primitive.vector(6), material);
+    }
+
+    Scene scene() const
+    {
+      // The scene built from ordinary hittables, under the requested acceleration structure.
+      Scene scene;
+      scene.camera = camera;
+      scene.output_file = output_file;
+      scene.world = objects();
+      for(size_t index = 0; index < primitives.size(); index++)
+      {
+        if(materials[primitives[index].material]->emits()) scene.lights.add(scene.world.objects[index]);
+      }
+      for(const auto& mesh : meshes) scene.world.add(mesh);
+      if(instances) scene.world.add(instances);
+      if(sphere_batch_size > 0) scene.world = SphereBatch::groupSpheres(scene.world, size_t(sphere_batch_size));
+      if(accelerator == "list" || scene.world.objects.empty()) return scene;
+
+      if(accelerator == "motion")
+      {
+        scene.world = HittableList(make_shared<MotionBVH>(scene.world, 1));
+        return scene;
+      }
+      if(accelerator == "bvh")
+      {
+        scene.world = HittableList(make_shared<BVHNode>(scene.world, BVHSplitMethod::BinnedSAH));
+        return scene;
+      }
+      BVHSplitMethod split_method = accelerator == "morton" ? BVHSplitMethod::Morton : BVHSplitMethod::BinnedSAH;
+      auto linear_bvh = make_shared<LinearBVH>(scene.world, split_method, 4, camera.thread_count);
+      if(accelerator == "linear") scene.world = HittableList(linear_bvh);
+      else scene.world = HittableList(make_shared<WideBVH>(*linear_bvh));
+      return scene;
+    }
+
+    bool writeCache(const std::string& filename) const
+    {
+      // Build the BVH over the primitives and write the binary cache. Returns false if the
+      // file could not be written.
+      std::vector<AABB> boxes;
+      boxes.reserve(primitives.size());
+      for(const PackedPrimitive& primitive : primitives) boxes.push_back(primitive.boundingBox());
+
+      LinearBVHTree tree;
+      tree.build(boxes, BVHSplitMethod::BinnedSAH, 4, camera.thread_count);
+
+      SceneCacheHeader header = {};
+      std::memcpy(header.magic, SceneCacheHeader::magic_value, sizeof(header.magic));
+      header.version = SceneCacheHeader::current_version;
+      header.byte_order = SceneCacheHeader::byte_order_mark;
+      header.settings_offset = sizeof(SceneCacheHeader);
+      header.settings_size = settings.size();
+      header.node_offset = align(header.settings_offset + header.settings_size);
+      header.node_count = tree.nodes.size();
+      header.primitive_offset = align(header.node_offset + header.node_count * sizeof(LinearBVHNode));
+      header.primitive_count = tree.primitive_order.size();
+      header.material_count = materials.size();
+
+      std::vector<uint32_t> light_slots;
+      for(uint32_t slot = 0; slot < tree.primitive_order.size(); slot++)
+      {
+        if(materials[primitives[tree.primitive_order[slot]].material]->emits()) light_slots.push_back(slot);
+      }
+      header.light_offset = align(header.primitive_offset + header.primitive_count * sizeof(PackedPrimitive));
+      header.light_count = light_slots.size();
+
+      std::ofstream out(filename, std::ios::binary);
+      if(!out) return false;
+
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(settings.data(), std::streamsize(settings.size()));
+      pad(out, header.node_offset);
+      out.write(reinterpret_cast<const char*>(tree.nodes.data()), std::streamsize(header.node_count * sizeof(LinearBVHNode)));
+      pad(out, header.primitive_offset);
+      for(uint32_t index : tree.primitive_order)
+      {
+        out.write(reinterpret_cast<const char*>(&primitives[index]), sizeof(PackedPrimitive));
+      }
+      pad(out, header.light_offset);
+      out.write(reinterpret_cast<const char*>(light_slots.data()), std::streamsize(light_slots.size() * sizeof(uint32_t)));
+      return bool(out);
+    }
+
+  private:
+    std::map<std::string, shared_ptr<Texture>> textures;
+    std::map<std::string, uint32_t> material_indices;
+
+    // Image textures are created empty while parsing, then loaded together once every
+    // statement is parsed, so their decoding runs in parallel.
+    std::vector<std::pair<shared_ptr<ImageTexture>, std::string>> pending_images;
+
+    // Meshes too are loaded once every statement is parsed, in parallel, with the material
+    // their statement names as it is then. Each file and material pair is loaded once, for
+    // the mesh statements and the instances that use it.
+    std::vector<std::pair<std::string, uint32_t>> pending_meshes;
+    std::vector<uint32_t> mesh_statements;                   // Pending mesh of each mesh statement
+    std::vector<InstanceBVH::Placement> pending_placements; // Pending mesh of each instance, and its transform
+
+    static const uint64_t cache_alignment = 64;
+
+    static uint64_t align(uint64_t offset)
+    {
+      return (offset + cache_alignment - 1) / cache_alignment * cache_alignment;
+    }
+
+    static void pad(std::ostream& out, uint64_t offset)
+    {
+      while(uint64_t(out.tellp()) < offset) out.put(0);
+    }
+
+    static bool read(std::istream& tokens, double& value) { return bool(tokens >> value); }
+
+    static bool read(std::istream& tokens, Vector3& value)
+    {
+      double x, y, z;
+      if(!(tokens >> x >> y >> z)) return false;
+      value = Vector3(x, y, z);
+      return true;
+    }
+
+    static bool atEnd(std::istream& tokens)
+    {
+      std::string extra;
+      return !(tokens >> extra);
+    }
+
+    void loadImages()
+    {
+      std::vector<std::string> filenames;
+      for(const auto& pending : pending_images) filenames.push_back(pending.second);
+      std::vector<shared_ptr<TileSource>> sources = TextureLoader::openAll(filenames, camera.thread_count);
+      for(size_t index = 0; index < pending_images.size(); index++) pending_images[index].first->setSource(sources[index]);
+      pending_images.clear();
+    }
+
+    bool loadMeshes()
+    {
+      std::vector<shared_ptr<Hittable>> loaded(pending_meshes.size());
+      bool success = true;
+      WorkStealingScheduler::run(pending_meshes.size(), camera.thread_count, [&](size_t index, int)
+      {
+        loaded[index] = TriangleMesh::loadOBJ(pending_meshes[index].first, materials[pending_meshes[index].second]);
+      });
+      for(const auto& mesh : loaded) success = success && mesh;
+
+      if(success)
+      {
+        for(uint32_t index : mesh_statements) meshes.push_back(std::static_pointer_cast<TriangleMesh>(loaded[index]));
+        if(!pending_placements.empty()) instances = make_shared<InstanceBVH>(loaded, pending_placements);
+      }
+      pending_meshes.clear();
+      mesh_statements.clear();
+      pending_placements.clear();
+      return success;
+    }
+
+    uint32_t pendingMesh(const std::string& filename, uint32_t material)
+    {
+      for(uint32_t index = 0; index < pending_meshes.size(); index++)
+      {
+        if(pending_meshes[index].first == filename && pending_meshes[index].second == material) return index;
+      }
+      pending_meshes.push_back({ filename, material });
+      return uint32_t(pending_meshes.size() - 1);
+    }
+
+    bool parseTransforms(std::istringstream& tokens, Transform& transform, std::string& error) const
+    {
+      // Transforms, each applied after the ones before it.
+      std::string operation;
+      while(tokens >> operation)
+      {
+        Vector3 value;
+        double degrees, factor;
+        if(operation == "translate" && read(tokens, value)) transform = Transform::translate(value) * transform;
+        else if(operation == "rotate" && read(tokens, value) && read(tokens, degrees) && value.length_squared() > 0)
+          transform = Transform::rotate(value, degrees) * transform;
+        else if(operation == "scale" && read(tokens, factor))
+        {
+          // One factor, or one per axis.
+          std::streampos position = tokens.tellg();
+          double y, z;
+          if(tokens >> y >> z) value = Vector3(factor, y, z);
+          else
+          {
+            tokens.clear();
+            tokens.seekg(position);
+            value = Vector3(factor, factor, factor);
+          }
+          if(value.x() == 0 || value.y() == 0 || value.z() == 0)
+          {
+            error = "scale factors must not be zero";
+            return false;
+          }
+          transform = Transform::scale(value) * transform;
+        }
+        else
+        {
+          error = "expected translate X Y Z, rotate AX AY AZ DEGREES or scale S | X Y Z, not '" + operation + "'";
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool findTexture(const std::string& name, shared_ptr<Texture>& texture, std::string& error) const
+    {
+      auto found = textures.find(name);
+      if(found == textures.end())
+      {
+        error = "unknown texture '" + name + "'";
+        return false;
+      }
+      texture = found->second;
+      return true;
+    }
+
+    bool findMaterial(std::istream& tokens, uint32_t& material, std::string& error) const
+    {
+      std::string name;
+      if(!(tokens >> name))
+      {
+        error = "missing material name";
+        return false;
+      }
+      auto found = material_indices.find(name);
+      if(found == material_indices.end())
+      {
+        error = "unknown material '" + name + "'";
+        return false;
+      }
+      material = found->second;
+      return true;
+    }
+
+    bool parseStatement(const std::string& keyword, std::istringstream& tokens, std::string& error)
+    {
+      if(keyword == "camera") return parseCamera(tokens, error);
+
+      if(keyword == "output")
+      {
+        if(!(tokens >> output_file)) error = "missing output file name";
+        return error.empty();
+      }
+
+      if(keyword == "accelerator")
+      {
+        tokens >> accelerator;
+        if(accelerator == "list" || accelerator == "bvh" || accelerator == "linear" || accelerator == "wide"
+           || accelerator == "morton" || accelerator == "motion") return true;
+        error = "unknown accelerator '" + accelerator + "'";
+        return false;
+      }
+
+      if(keyword == "sphere_batch")
+      {
+        if(!(tokens >> sphere_batch_size) || sphere_batch_size < 0) error = "expected sphere_batch SIZE, 0 or more";
+        return error.empty();
+      }
+
+      if(keyword == "texture") return parseTexture(tokens, error);
+      if(keyword == "material") return parseMaterial(tokens, error);
+
+      if(keyword == "sphere" || keyword == "moving_sphere")
+      {
+        Vector3 center1, center2;
+        double radius;
+        uint32_t material;
+        bool moving = keyword == "moving_sphere";
+        if(!read(tokens, center1) || (moving && !read(tokens, center2)) || !read(tokens, radius))
+        {
+          error = "expected " + keyword + (moving ? " X1 Y1 Z1 X2 Y2 Z2" : " X Y Z") + " RADIUS MATERIAL";
+          return false;
+        }
+        if(!findMaterial(tokens, material, error)) return false;
+        primitives.push_back(PackedPrimitive::sphere(center1, moving ? center2 : center1, radius, material));
+        return true;
+      }
+
+      if(keyword == "quad")
+      {
+        Vector3 Q, u, v;
+        uint32_t material;
+        if(!read(tokens, Q) || !read(tokens, u) || !read(tokens, v))
+        {
+          error = "expected quad QX QY QZ UX UY UZ VX VY VZ MATERIAL";
+          return false;
+        }
+        if(!findMaterial(tokens, material, error)) return false;
+        primitives.push_back(PackedPrimitive::quad(Q, u, v, material));
+        return true;
+      }
+
+      if(keyword == "mesh")
+      {
+        std::string filename;
+        uint32_t material;
+        if(!(tokens >> filename))
+        {
+          error = "expected mesh FILE MATERIAL";
+          return false;
+        }
+        if(!findMaterial(tokens, material, error)) return false;
+        mesh_statements.push_back(pendingMesh(filename, material));
+        return true;
+      }
+
+      if(keyword == "instance")
+      {
+        std::string filename;
+        uint32_t material;
+        Transform transform;
+        if(!(tokens >> filename))
+        {
+          error = "expected instance FILE MATERIAL TRANSFORMS...";
+          return false;
+        }
+        if(!findMaterial(tokens, material, error) || !parseTransforms(tokens, transform, error)) return false;
+        pending_placements.push_back({ pendingMesh(filename, material), transform });
+        return true;
+      }
+
+      error = "unknown statement '" + keyword + "'";
+      return false;
+    }
+
+    bool parseCamera(std::istringstream& tokens, std::string& error)
+    {
+      std::string setting;
+      while(tokens >> setting)
+      {
+        double value = 0;
+        bool valid;
+        if(setting == "from") valid = read(tokens, camera.look_from);
+        else if(setting == "at") valid = read(tokens, camera.look_at);
+        else if(setting == "up") valid = read(tokens, camera.view_up);
+        else if(setting == "sampler")
+        {
+          std::string name;
+          valid = (tokens >> name) && parseSamplerType(name, camera.sampler_type);
+        }
+        else if(setting == "features") valid = bool(tokens >> camera.feature_file_prefix);
+        else if(setting == "background")
+        {
+          // Either "sky" or a color.
+          std::streampos position = tokens.tellg();
+          std::string word;
+          camera.sky_background = (tokens >> word) && word == "sky";
+          valid = camera.sky_background;
+          if(!valid)
+          {
+            tokens.clear();
+            tokens.seekg(position);
+            valid = read(tokens, camera.background_color);
+          }
+        }
+        else
+        {
+          valid = read(tokens, value);
+          if(setting == "width") camera.image_width = int(value);
+          else if(setting == "height") camera.image_height = int(value);
+          else if(setting == "samples") camera.sample_per_pixel = int(value);
+          else if(setting == "depth") camera.max_depth = int(value);
+          else if(setting == "fov") camera.vertical_field_of_view = value;
+          else if(setting == "defocus_angle") camera.defocus_angle = value;
+          else if(setting == "focus_distance") camera.focus_distance = value;
+          else if(setting == "seed") camera.random_seed = uint64_t(value);
+          else if(setting == "light_sampling") camera.light_sampling = value != 0;
+          else if(setting == "denoise") camera.denoise = value != 0;
+          else
+          {
+            error = "unknown camera setting '" + setting + "'";
+            return false;
+          }
+        }
+        if(!valid)
+        {
+          error = "missing or invalid value for camera setting '" + setting + "'";
+          return false;
+        }
+      }
+      if(camera.image_width <= 0 || camera.image_height <= 0)
+      {
+        error = "the image width and height must be positive";
+        return false;
+      }
+      if(camera.sample_per_pixel <= 0 || camera.max_depth <= 0)
+      {
+        error = "the sample count and the depth must be positive";
+        return false;
+      }
+      return true;
+    }
+
+    bool parseTexture(std::istringstream& tokens, std::string& error)
+    {
+      std::string name, type;
+      if(!(tokens >> name >> type))
+      {
+        error = "expected texture NAME TYPE ...";
+        return false;
+      }
+
+      shared_ptr<Texture> texture;
+      if(type == "solid")
+      {
+        Vector3 albedo;
+        if(read(tokens, albedo)) texture = make_shared<SolidColor>(albedo);
+      }
+      else if(type == "checker")
+      {
+        double scale;
+        std::string even, odd;
+        shared_ptr<Texture> even_texture, odd_texture;
+        if(read(tokens, scale) && tokens >> even >> odd)
+        {
+          if(!findTexture(even, even_texture, error) || !findTexture(odd, odd_texture, error)) return false;
+          texture = make_shared<CheckerTexture>(scale, even_texture, odd_texture);
+        }
+      }
+      else if(type == "image")
+      {
+        std::string filename;
+        if(tokens >> filename)
+        {
+          auto image = make_shared<ImageTexture>(shared_ptr<TileSource>());
+          pending_images.push_back({ image, filename });
+          texture = image;
+        }
+      }
+      else if(type == "noise")
+      {
+        double scale;
+        if(read(tokens, scale)) texture = make_shared<NoiseTexture>(scale);
+      }
+      else
+      {
+        error = "unknown texture type '" + type + "'";
+        return false;
+      }
+
+      if(!texture || !atEnd(tokens))
+      {
+        error = "invalid parameters for " + type + " texture '" + name + "'";
+        return false;
+      }
+      textures[name] = texture;
+      return true;
+    }
+
+    bool parseMaterial(std::istringstream& tokens, std::string& error)
+    {
+      std::string name, type;
+      if(!(tokens >> name >> type))
+      {
+        error = "expected material NAME TYPE ...";
+        return false;
+      }
+
+      shared_ptr<Material> material;
+      if(type == "lambertian" || type == "diffuse_light")
+      {
+        // Either a texture name or a color: the albedo, or the emitted light.
+        std::vector<std::string> parameters;
+        std::string parameter;
+        while(tokens >> parameter) parameters.push_back(parameter);
+        shared_ptr<Texture> texture;
+        if(parameters.size() == 1)
+        {
+          if(!findTexture(parameters[0], texture, error)) return false;
+        }
+        else if(parameters.size() == 3)
+        {
+          std::istringstream color(parameters[0] + ' ' + parameters[1] + ' ' + parameters[2]);
+          Vector3 value;
+          if(read(color, value) && atEnd(color)) texture = make_shared<SolidColor>(value);
+        }
+        if(texture && type == "lambertian") material = make_shared<Lambertian>(texture);
+        else if(texture) material = make_shared<DiffuseLight>(texture);
+      }
+      else if(type == "metal")
+      {
+        Vector3 albedo;
+        double fuzz;
+        if(read(tokens, albedo) && read(tokens, fuzz)) material = make_shared<Metal>(albedo, fuzz);
+      }
+      else if(type == "dielectric")
+      {
+        double refraction_index;
+        if(read(tokens, refraction_index)) material = make_shared<Dielectric>(refraction_index);
+      }
+      else
+      {
+        error = "unknown material type '" + type + "'";
+        return false;
+      }
+
+      if(!material || !atEnd(tokens))
+      {
+        error = "invalid parameters for " + type + " material '" + name + "'";
+        return false;
+      }
+
+      auto found = material_indices.find(name);
+      if(found != material_indices.end())
+      {
+        materials[found->second] = material;
+      }
+      else
+      {
+        material_indices[name] = uint32_t(materials.size());
+        materials.push_back(material);
+      }
+      return true;
+    }
+};
+
+inline bool fitsInFile(uint64_t offset, uint64_t count, uint64_t record_size, uint64_t file_size)
+{
+  // Whether count records of record_size bytes from offset end within the file, without the
+  // overflow of offset + count * record_size on a damaged header.
+  return offset <= file_size && count <= (file_size - offset) / record_size;
+}
+
+inline bool validPackedTree(const LinearBVHNode* nodes, uint64_t node_count, uint64_t primitive_count)
+{
+  // Checks that the nodes form one tree in depth-first order, as LinearBVHTree lays it out:
+  // the subtree of a node fills the slots from it to the next sibling, leaves reference
+  // primitive slots that exist, and the tree fits the traversal stack.
+  if(node_count == 0) return true;
+  if(node_count > std::numeric_limits<uint32_t>::max()) return false;
+
+  struct Pending
+  {
+    uint64_t node;
+    uint64_t end; // Where the subtree must end: the second child of the parent, or node_count
+    int depth;
+  };
+  std::vector<Pending> pending = { { 0, node_count, 0 } };
+  uint64_t next_node = 0; // Slot the depth-first order puts next
+  while(!pending.empty())
+  {
+    Pending current = pending.back();
+    pending.pop_back();
+    if(current.node != next_node || current.node >= current.end || current.depth >= LinearBVHTree::max_depth) return false;
+
+    const LinearBVHNode& node = nodes[current.node];
+    if(node.isLeaf())
+    {
+      if(uint64_t(node.offset) + node.primitive_count > primitive_count) return false;
+      // A leaf closes its subtree, so the next slot must be where it was to end.
+      if(current.node + 1 != current.end) return false;
+      next_node = current.node + 1;
+      continue;
+    }
+
+    uint64_t second_child = node.offset;
+    if(second_child <= current.node + 1 || second_child >= current.end || node.axis > 2) return false;
+    pending.push_back({ second_child, current.end, current.depth + 1 });
+    pending.push_back({ current.node + 1, second_child, current.depth + 1 });
+    next_node = current.node + 1;
+  }
+  return next_node == node_count;
+}
+
+inline bool loadSceneCache(const std::string& filename, Scene& scene)
+{
+  auto file = make_shared<MappedFile>();
+  if(!file->open(filename))
+  {
+    std::cerr << "ERROR: Could not open scene cache '" << filename << "'.\n";
+    return false;
+  }
+
+  SceneCacheHeader header;
+  bool valid = file->size() >= sizeof(header);
+  if(valid)
+  {
+    std::memcpy(&header, file->data(), sizeof(header));
+    valid = std::memcmp(header.magic, SceneCacheHeader::magic_value, sizeof(header.magic)) == 0
+         && header.version == SceneCacheHeader::current_version
+         && header.byte_order == SceneCacheHeader::byte_order_mark
+         && fitsInFile(header.settings_offset, header.settings_size, 1, file->size())
+         && header.node_offset % alignof(LinearBVHNode) == 0
+         && fitsInFile(header.node_offset, header.node_count, sizeof(LinearBVHNode), file->size())
+         && header.primitive_offset % alignof(PackedPrimitive) == 0
+         && fitsInFile(header.primitive_offset, header.primitive_count, sizeof(PackedPrimitive), file->size())
+         && header.primitive_count <= std::numeric_limits<uint32_t>::max()
+         && header.light_offset % alignof(uint32_t) == 0
+         && fitsInFile(header.light_offset, header.light_count, sizeof(uint32_t), file->size());
+  }
+  const LinearBVHNode* nodes = valid ? reinterpret_cast<const LinearBVHNode*>(file->data() + header.node_offset) : nullptr;
+  const PackedPrimitive* primitives =
+    valid ? reinterpret_cast<const PackedPrimitive*>(file->data() + header.primitive_offset) : nullptr;
+  if(valid)
+  {
+    // Everything the traversal and the hits index with is checked once here, so they can
+    // trust the file.
+    for(uint64_t slot = 0; valid && slot < header.primitive_count; slot++)
+    {
+      const PackedPrimitive& primitive = primitives[slot];
+      valid = (primitive.type == PackedPrimitive::SphereType || primitive.type == PackedPrimitive::QuadType)
+           && primitive.material < header.material_count;
+    }
+    valid = valid && validPackedTree(nodes, header.node_count, header.primitive_count);
+  }
+  if(!valid)
+  {
+    std::cerr << "ERROR: '" << filename << "' is not a valid scene cache.\n";
+    return false;
+  }
+
+  SceneDescription description;
+  std::istringstream settings(std::string(reinterpret_cast<const char*>(file->data() + header.settings_offset),
+                                          header.settings_size));
+  if(!description.parse(settings, filename)) return false;
+  if(description.materials.size() != header.material_count)
+  {
+    std::cerr << "ERROR: '" << filename << "' declares " << description.materials.size()
+              << " materials, its primitives use " << header.material_count << ".\n";
+    return false;
+  }
+
+  const uint32_t* light_slots = reinterpret_cast<const uint32_t*>(file->data() + header.light_offset);
+  for(uint64_t light = 0; light < header.light_count; light++)
+  {
+    if(light_slots[light] >= header.primitive_count)
+    {
+      std::cerr << "ERROR: '" << filename << "' lists a light that is not one of its primitives.\n";
+      return false;
+    }
+    scene.lights.add(SceneDescription::object(primitives[light_slots[light]], description.materials));
+  }
+
+  scene.camera = description.camera;
+  scene.output_file = description.output_file;
+  scene.world = HittableList(make_shared<PackedScene>(
+    file,
+    nodes, header.node_count,
+    primitives, header.primitive_count,
+    description.materials));
+  for(const auto& mesh : description.meshes) scene.world.add(mesh);
+  if(description.instances) scene.world.add(description.instances);
+  return true;
+}
+
+inline bool loadSceneFile(const std::string& filename, Scene& scene)
+{
+  // Load a text scene file, or a scene cache if the name ends in .rtwb.
+  size_t slash = filename.find_last_of("/\\");
+  std::string stem = filename.substr(slash == std::string::npos ? 0 : slash + 1);
+  stem = stem.substr(0, stem.find('.'));
+
+  bool loaded;
+  if(filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".rtwb") == 0)
+  {
+    loaded = loadSceneCache(filename, scene);
+  }
+  else
+  {
+    SceneDescription description;
+    loaded = description.parseFile(filename);
+    if(loaded) scene = description.scene();
+  }
+  scene.name = stem;
+  return loaded;
+}
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <string>
+
+#include "rtweekend.hpp"
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "instance.hpp"
+#include "linear_bvh.hpp"
+#include "material.hpp"
+#include "motion_bvh.hpp"
+#include "quadrilaterals.hpp"
+#include "sphere.hpp"
+#include "sphere_batch.hpp"
+#include "texture.hpp"
+#include "wide_bvh.hpp"
+
+// The demo scenes, each with the camera that frames it. The renderer and the benchmarks build
+// them from here so they always measure the same scenes.
+
+struct Scene
+{
+  std::string name;        // Short identifier, used by the benchmarks
+  std::string output_file; // Image file the renderer writes
+  HittableList world;
+  HittableList lights;     // Emissive objects of the world the camera samples directly
+  Camera camera;
+};
+
+inline Scene bouncingSpheres()
+{
+  // World
+
+  HittableList world;
+
+  auto material_ground = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+  auto checker_texture = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+  auto material_checker = make_shared<Lambertian>(checker_texture);
+
+  for(int a = -11; a < 11; a++)
+  {
+    for(int b = -11; b < 11; b++)
+    {
+      auto choose_mat = randomDouble();
+      Point3 center(a + 0.9 * randomDouble(), 0.2, b + 0.9 * randomDouble());
+
+      if ((center - Point3(4, 0.2, 0)).length() > 0.9)
+      {
+        shared_ptr<Material> sphere_material;
+
+        if(choose_mat < 0.8)
+        {
+          // diffuse
+          auto albedo = Color::random() * Color::random();
+          sphere_material = make_shared<Lambertian>(albedo);
+          Vector3 center2 = center + Vector3(0, randomDouble(0.0, 0.5), 0);
+          world.add(make_shared<Sphere>(center, center2, 0.2, sphere_material));
+        }
+        else if(choose_mat < 0.95)
+        {
+          // metal
+          auto albedo = Color::random(0.5, 1);
+          auto fuzz = randomDouble(0, 0.5);
+          sphere_material = make_shared<Metal>(albedo, fuzz);
+          world.add(make_shared<Sphere>(center, 0.2, sphere_material));
+        }
+        else
+        {
+          // glass
+          sphere_material = make_shared<Dielectric>(1.5);
+          world.add(make_shared<Sphere>(center, 0.2, sphere_material));
+        }
+      }
+    }
+  }
+
+  auto material1 = make_shared<Dielectric>(1.5);
+  world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+
+  auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
+  world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+
+  auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+  world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+
+  // The spheres are intersected 4 at a time, one AVX2 step per batch; the ground, which would
+  // stretch the box of any batch it joined over the whole scene, stays a leaf of its own.
+  world = SphereBatch::groupSpheres(world, 4);
+  world.add(make_shared<Sphere>(Point3(0.0, -1000, 0.0), 1000, material_checker));
+
+  auto bvh = make_shared<BVHNode>(world, BVHSplitMethod::BinnedSAH);
+  std::clog << "BVH SAH cost: " << bvh->sahCost() << '\n';
+  world = HittableList(make_shared<WideBVH>(LinearBVH(*bvh)));
+
+  Scene scene;
+  scene.name = "bouncing_spheres";
+  scene.output_file = "../render/checker_texture.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_width = 1600;
+  camera.image_height = 800;
+  camera.sample_per_pixel = 100;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 20;
+  camera.look_from = Point3(13, 2, 3);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0.6;
+  camera.focus_distance = 10.0;
+
+  scene.world = world;
+  return scene;
+}
+
+inline Scene checkeredSpheres()
+{
+  HittableList world;
+
+  auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+
+  world.add(make_shared<Sphere>(Point3(0, -10, 0), 10, make_shared<Lambertian>(checker)));
+  world.add(make_shared<Sphere>(Point3(0, 10, 0), 10, make_shared<Lambertian>(checker)));
+
+  Scene scene;
+  scene.name = "checkered_spheres";
+  scene.output_file = "../render/checker_texture.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_height = 400;
+  camera.image_width = 800;
+  camera.sample_per_pixel = 100;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 20;
+  camera.look_from = Point3(13, 2, 3);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  scene.world = world;
+  return scene;
+}
+
+inline Scene earth()
+{
+  auto earth_texture = make_shared<ImageTexture>("earthmap.jpg");
+  auto earth_surface = make_shared<Lambertian>(earth_texture);
+  auto globe = make_shared<Sphere>(Point3(0, 0, 0), 2, earth_surface);
+
+  Scene scene;
+  scene.name = "earth";
+  scene.output_file = "../render/earth_render.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_height = 400;
+  camera.image_width = 800;
+  camera.sample_per_pixel = 10;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 20;
+  camera.look_from = Point3(0, 0, 12);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  scene.world = HittableList(globe);
+  return scene;
+}
+
+inline Scene perlinSphere()
+{
+  HittableList world;
+  auto perlin_texture = make_shared<NoiseTexture>(4);
+  world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(perlin_texture)));
+  world.add(make_shared<Sphere>(Point3(0, 2, 0), 2, make_shared<Lambertian>(perlin_texture)));
+
+  Scene scene;
+  scene.name = "perlin_sphere";
+  scene.output_file = "../render/perlin_noise.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_height = 200;
+  camera.image_width = 400;
+  camera.sample_per_pixel = 100;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 20;
+  camera.look_from = Point3(13, 2, 3);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  scene.world = world;
+  return scene;
+}
+
+inline Scene quads()
+{
+  HittableList world;
+  auto left_red = make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
+  auto back_green = make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
+  auto right_blue = make_shared<Lambertian>(Color(0.2, 0.2, 1.0));
+  auto upper_orange = make_shared<Lambertian>(Color(1.0, 0.5, 0.0));
+  auto lower_teal = make_shared<Lambertian>(Color(0.2, 0.8, 0.8));
+
+  world.add(make_shared<Quad>(Point3(-3, -2, 5), Vector3(0, 0, -4), Vector3(0, 4, 0), left_red));
+  world.add(make_shared<Quad>(Point3(-2, -2, 0), Vector3(4, 0, 0), Vector3(0, 4, 0), back_green));
+  world.add(make_shared<Quad>(Point3(3, -2, 1), Vector3(0, 0, 4), Vector3(0, 4, 0), right_blue));
+  world.add(make_shared<Quad>(Point3(-2, 3, 1), Vector3(4, 0, 0), Vector3(0, 0, 4), upper_orange));
+  world.add(make_shared<Quad>(Point3(-2, -3, 5), Vector3(4, 0, 0), Vector3(0, 0, -4), lower_teal));
+
+  Scene scene;
+  scene.name = "quads";
+  scene.output_file = "../render/quads.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_height = 400;
+  camera.image_width = 800;
+  camera.sample_per_pixel = 100;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 80;
+  camera.look_from = Point3(0, 0, 9);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  scene.world = world;
+  return scene;
+}
+
+inline Scene cornellBox()
+{
+  HittableList world;
+  auto red = make_shared<Lambertian>(Color(0.65, 0.05, 0.05));
+  auto white = make_shared<Lambertian>(Color(0.73, 0.73, 0.73));
+  auto green = make_shared<Lambertian>(Color(0.12, 0.45, 0.15));
+  auto light = make_shared<DiffuseLight>(Color(15, 15, 15));
+
+  // The light faces down, into the box.
+  auto ceiling_light = make_shared<Quad>(Point3(343, 554, 332), Vector3(-130, 0, 0), Vector3(0, 0, -105), light);
+
+  world.add(make_shared<Quad>(Point3(555, 0, 0), Vector3(0, 555, 0), Vector3(0, 0, 555), green));
+  world.add(make_shared<Quad>(Point3(0, 0, 0), Vector3(0, 555, 0), Vector3(0, 0, 555), red));
+  world.add(ceiling_light);
+  world.add(make_shared<Quad>(Point3(0, 0, 0), Vector3(555, 0, 0), Vector3(0, 0, 555), white));
+  world.add(make_shared<Quad>(Point3(555, 555, 555), Vector3(-555, 0, 0), Vector3(0, 0, -555), white));
+  world.add(make_shared<Quad>(Point3(0, 0, 555), Vector3(555, 0, 0), Vector3(0, 555, 0), white));
+  for (const auto& side : box(Point3(130, 0, 65), Point3(295, 165, 230), white).objects) world.add(side);
+  for (const auto& side : box(Point3(265, 0, 295), Point3(430, 330, 460), white).objects) world.add(side);
+
+  Scene scene;
+  scene.name = "cornell_box";
+  scene.output_file = "../render/cornell_box.ppm";
+  scene.lights.add(ceiling_light);
+  Camera& camera = scene.camera;
+
+  camera.image_height = 600;
+  camera.image_width = 600;
+  camera.sample_per_pixel = 64;
+  camera.max_depth = 50;
+  camera.sky_background = false;
+  camera.background_color = Color(0, 0, 0);
+
+  camera.vertical_field_of_view = 40;
+  camera.look_from = Point3(278, 278, -800);
+  camera.look_at = Point3(278, 278, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  auto bvh = make_shared<BVHNode>(world, BVHSplitMethod::BinnedSAH);
+  scene.world = HittableList(make_shared<WideBVH>(LinearBVH(*bvh)));
+  return scene;
+}
+
+inline Scene instancedForest()
+{
+  // The bouncing spheres field turned into a forest: four variants of a tree, each a BVH
+  // over a few primitives, placed 62500 times by an InstanceBVH, turned and scaled at random.
+  auto bark = make_shared<Lambertian>(Color(0.35, 0.2, 0.1));
+  std::vector<shared_ptr<Hittable>> trees;
+  for (int variant = 0; variant < 4; variant++)
+  {
+    auto leaves = make_shared<Lambertian>(Color(0.1 + 0.05 * variant, 0.35 + 0.05 * variant, 0.1));
+    HittableList tree = box(Point3(-0.05, 0, -0.05), Point3(0.05, 0.5, 0.05), bark);
+    tree.add(make_shared<Sphere>(Point3(0, 0.55, 0), 0.3, leaves));
+    tree.add(make_shared<Sphere>(Point3(0, 0.85, 0), 0.22, leaves));
+    tree.add(make_shared<Sphere>(Point3(0, 1.08, 0), 0.13, leaves));
+    trees.push_back(make_shared<LinearBVH>(tree));
+  }
+
+  std::vector<InstanceBVH::Placement> placements;
+  for (int a = -125; a < 125; a++)
+  {
+    for (int b = -125; b < 125; b++)
+    {
+      Point3 position(a + 0.8 * randomDouble(), 0, b + 0.8 * randomDouble());
+      Transform place = Transform::translate(position) * Transform::rotate(Vector3(0, 1, 0), randomDouble(0, 360))
+                      * Transform::scale(randomDouble(0.6, 1.4));
+      placements.push_back({ uint32_t(randomInt(0, int(trees.size()) - 1)), place });
+    }
+  }
+  auto forest = make_shared<InstanceBVH>(trees, placements);
+
+  HittableList world;
+  world.add(make_shared<Quad>(Point3(-200, 0, -200), Vector3(0, 0, 400), Vector3(400, 0, 0),
+                              make_shared<Lambertian>(Color(0.4, 0.35, 0.25))));
+  world.add(forest);
+
+  Scene scene;
+  scene.name = "instanced_forest";
+  scene.output_file = "../render/instanced_forest.ppm";
+  Camera& camera = scene.camera;
+
+  camera.image_width = 800;
+  camera.image_height = 400;
+  camera.sample_per_pixel = 64;
+  camera.max_depth = 50;
+
+  camera.vertical_field_of_view = 40;
+  camera.look_from = Point3(0, 6, 20);
+  camera.look_at = Point3(0, 0, 0);
+  camera.view_up = Vector3(0, 1, 0);
+
+  camera.defocus_angle = 0;
+  scene.world = world;
+  return scene;
+}
+
+const int scene_count = 7;
+
+inline Scene makeScene(int index)
+{
+  // Scenes are numbered from 1, in the order of the book.
+  switch (index)
+  {
+    case 1: return bouncingSpheres();
+    case 2: return checkeredSpheres();
+    case 3: return earth();
+    case 4: return perlinSphere();
+    case 6: return cornellBox();
+    case 7: return instancedForest();
+    default: return quads();
+  }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingScheduler
+{
+  public:
+    // Signature of a task : task(task_index, worker_index).
+    using Task = std::function<void(size_t, int)>;
+
+    static int resolveThreadCount(int thread_count)
+    {
+      // A thread count <= 0 means "use every hardware thread".
+      if(thread_count > 0) return thread_count;
+      int hardware_threads = int(std::thread::hardware_concurrency());
+      return hardware_threads > 0 ? hardware_threads : 1;
+    }
+
+    static void run(size_t task_count, int thread_count, const Task& task)
+    {
+      // Run task() once for every index in [0, task_count) on thread_count threads. The indices
+      // are dealt round-robin into one queue per worker. Each worker drains its own queue from
+      // the front, and once it is empty steals from the back of the other queues, so a worker
+      // that got the cheap tasks keeps helping until every queue is empty. Tasks never create
+      // new tasks, so a worker that finds every queue empty can safely exit.
+
+      thread_count = resolveThreadCount(thread_count);
+      thread_count = int(std::min<size_t>(size_t(thread_count), std::max<size_t>(task_count, 1)));
+
+      if(thread_count == 1)
+      {
+        for(size_t task_index = 0; task_index < task_count; task_index++)
+        {
+          task(task_index, 0);
+        }
+        return;
+      }
+
+      std::vector<WorkQueue> queues(thread_count);
+      for(size_t task_index = 0; task_index < task_count; task_index++)
+      {
+        queues[task_index % thread_count].tasks.push_back(task_index);
+      }
+
+      auto worker = [&](int worker_index)
+      {
+        size_t task_index;
+        while(popOrSteal(queues, worker_index, task_index))
+        {
+          task(task_index, worker_index);
+        }
+      };
+
+      // The calling thread is worker 0.
+      std::vector<std::thread> threads;
+      for(int worker_index = 1; worker_index < thread_count; worker_index++)
+      {
+        threads.emplace_back(worker, worker_index);
+      }
+      worker(0);
+
+      for(auto& thread : threads)
+      {
+        thread.join();
+      }
+    }
+
+  private:
+    struct WorkQueue
+    {
+      std::mutex mutex;
+      std::deque<size_t> tasks;
+    };
+
+    static bool popOrSteal(std::vector<WorkQueue>& queues, int worker_index, size_t& task_index)
+    {
+      {
+        WorkQueue& own = queues[worker_index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty())
+        {
+          task_index = own.tasks.front();
+          own.tasks.pop_front();
+          return true;
+        }
+      }
+
+      int queue_count = int(queues.size());
+      for(int offset = 1; offset < queue_count; offset++)
+      {
+        WorkQueue& victim = queues[(worker_index + offset) % queue_count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.tasks.empty())
+        {
+          task_index = victim.tasks.back();
+          victim.tasks.pop_back();
+          return true;
+        }
+      }
+      return false;
+    }
+};
@@ -25,7 +25,19 @@ class Sphere : public Hittable
 
     bool hit(const Ray &ray, Interval ray_t, HitRecord &record) const override 
     {
-      Point3 current_center = center.at(ray.time());
+      RTW_COUNT(SphereTests);
+      if (!intersect(center.at(ray.time()), radius, ray, ray_t, record))
+      {
+        return false;
+      }
+      record.material = material.get();
+      return true;
+    }
+
+    static bool intersect(const Point3 &current_center, double radius, const Ray &ray, Interval ray_t, HitRecord &record)
+    {
+      // Intersect the ray with a sphere and, on a hit, fill every field of the record but the
+      // material. Shared with the packed primitives of cached scenes.
       Vector3 oc = current_center - ray.origin();
       auto a = ray.direction().length_squared();
       auto h = dot(ray.direction(), oc);
@@ -55,7 +67,7 @@ class Sphere : public Hittable
       Vector3 outward_normal = (record.hit_impact- current_center) / radius;
       record.setFaceNormal(ray, outward_normal);
       getSphereUV(outward_normal, record.u, record.v);
-      record.material = material;
+      record.uv_scale = 1.0 / (2 * PI * radius); // u along the equator
 
       return true;
     }
@@ -64,8 +76,47 @@ class Sphere : public Hittable
     {
       return bbox;
     }
+
+    AABB boundingBoxAt(double time) const override
+    {
+      auto rvec = Vector3(radius, radius, radius);
+      return AABB(center.at(time) - rvec, center.at(time) + rvec);
+    }
+
+    Vector3 sampleDirection(const Point3& origin, double time, double u, double v) const override
+    {
+      // Uniform over the cone of directions the sphere subtends from origin, so every sample
+      // reaches the visible cap (solid angle sampling).
+      Vector3 to_center = center.at(time) - origin;
+      double distance_squared = to_center.length_squared();
+      double cos_theta_max = std::sqrt(std::fmax(0.0, 1 - radius * radius / distance_squared));
+      double cos_theta = 1 + u * (cos_theta_max - 1);
+      double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+      double phi = 2 * PI * v;
+
+      Vector3 axis = to_center / std::sqrt(distance_squared), b1, b2;
+      orthonormalBasis(axis, b1, b2);
+      return std::cos(phi) * sin_theta * b1 + std::sin(phi) * sin_theta * b2 + cos_theta * axis;
+    }
+
+    double directionPdf(const Point3& origin, const Vector3& direction, double time) const override
+    {
+      // Zero from inside the sphere, where the cone is undefined, and for directions missing it.
+      Point3 current_center = center.at(time);
+      double distance_squared = (current_center - origin).length_squared();
+      HitRecord record;
+      if (distance_squared <= radius * radius
+          || !intersect(current_center, radius, Ray(origin, direction, time), Interval(0.001, infinity), record))
+      {
+        return 0;
+      }
+      double cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+      return 1 / (2 * PI * (1 - cos_theta_max));
+    }
   
   private:
+    friend class SphereBatch;
+
     Ray center;
     double radius;
     shared_ptr<Material> material;
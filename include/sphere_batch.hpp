@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+#include "cpu_features.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+
+class SphereBatch : public Hittable
+{
+  // A group of spheres stored as a structure of arrays (centers at time 0, center motion,
+  // squared radii), intersected several spheres per instruction: 4 with AVX2, 2 with SSE2,
+  // one at a time otherwise. Moving spheres are supported, their center is moved to the ray
+  // time in the kernel. The kernel only finds the closest sphere hit by the ray; the hit record
+  // is then filled by that sphere's own hit(), so a batch gives exactly the results of the
+  // spheres it groups. A batch is meant to be a BVH leaf: see groupSpheres(), which scenes
+  // use before building their BVH (the sphere_batch setting of scene files).
+
+  public:
+    enum class Kernel
+    {
+      Scalar,
+      SSE2, // 2 spheres per instruction
+      AVX2  // 4 spheres per instruction
+    };
+
+    static Kernel bestKernel()
+    {
+      if(cpuSupportsAVX2()) return Kernel::AVX2;
+      return RTW_X86_SIMD ? Kernel::SSE2 : Kernel::Scalar;
+    }
+
+    SphereBatch(const std::vector<shared_ptr<Sphere>>& spheres, Kernel kernel = bestKernel())
+      : spheres(spheres), kernel(kernel)
+    {
+      if(!RTW_X86_SIMD) this->kernel = Kernel::Scalar;
+      if(kernel == Kernel::AVX2 && !cpuSupportsAVX2()) this->kernel = RTW_X86_SIMD ? Kernel::SSE2 : Kernel::Scalar;
+
+      // Pad to a whole number of AVX2 lanes with NaN spheres, which never report a hit.
+      size_t padded_count = (spheres.size() + lane_count - 1) / lane_count * lane_count;
+      const double nan = std::numeric_limits<double>::quiet_NaN();
+      for(int axis = 0; axis < 3; axis++)
+      {
+        center[axis].assign(padded_count, nan);
+        motion[axis].assign(padded_count, 0.0);
+      }
+      radius_squared.assign(padded_count, nan);
+
+      for(size_t index = 0; index < spheres.size(); index++)
+      {
+        const Sphere& sphere = *spheres[index];
+        Point3 center0 = sphere.center.origin();
+        Vector3 center_motion = sphere.center.direction();
+        for(int axis = 0; axis < 3; axis++)
+        {
+          center[axis][index] = center0[axis];
+          motion[axis][index] = center_motion[axis];
+        }
+        radius_squared[index] = sphere.radius * sphere.radius;
+        bbox = AABB(bbox, sphere.boundingBox());
+      }
+    }
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      RTW_COUNT(SphereBatchTests);
+      size_t closest;
+      switch(kernel)
+      {
+#if RTW_X86_SIMD
+        case Kernel::AVX2: closest = closestAVX2(ray, ray_t); break;
+        case Kernel::SSE2: closest = closestSSE2(ray, ray_t); break;
+#endif
+        default: closest = closestScalar(ray, ray_t); break;
+      }
+
+      if(closest == no_hit) return false;
+      return spheres[closest]->hit(ray, ray_t, record);
+    }
+
+    AABB boundingBox() const override
+    {
+      return bbox;
+    }
+
+    AABB boundingBoxAt(double time) const override
+    {
+      // Only where the spheres are at that time, so MotionBVH can split a batch of moving
+      // spheres in time instead of bounding their whole paths.
+      AABB box = AABB::empty;
+      for(const auto& sphere : spheres) box = AABB(box, sphere->boundingBoxAt(time));
+      return box;
+    }
+
+    size_t size() const { return spheres.size(); }
+    Kernel activeKernel() const { return kernel; }
+
+    static HittableList groupSpheres(const HittableList& list, size_t batch_size = 8)
+    {
+      // Replace the spheres of the list by batches of up to batch_size spatially close spheres,
+      // splitting them at the median of their longest axis until the groups are small enough.
+      // Other objects are kept as they are. Building a BVH over the result makes every batch a
+      // leaf.
+      std::vector<shared_ptr<Sphere>> spheres;
+      HittableList grouped;
+      for(const auto& object : list.objects)
+      {
+        auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+        if(sphere) spheres.push_back(sphere);
+        else grouped.add(object);
+      }
+
+      groupRecursive(spheres, 0, spheres.size(), std::max<size_t>(batch_size, 1), grouped);
+      return grouped;
+    }
+
+  private:
+    static const size_t lane_count = 4;
+    static const size_t no_hit = ~size_t(0);
+
+    std::vector<shared_ptr<Sphere>> spheres;
+    std::vector<double> center[3];
+    std::vector<double> motion[3];
+    std::vector<double> radius_squared;
+    AABB bbox;
+    Kernel kernel;
+
+    static void groupRecursive(std::vector<shared_ptr<Sphere>>& spheres, size_t start, size_t end,
+                               size_t batch_size, HittableList& grouped)
+    {
+      if(end - start <= batch_size)
+      {
+        if(end > start)
+        {
+          std::vector<shared_ptr<Sphere>> batch(spheres.begin() + start, spheres.begin() + end);
+          grouped.add(make_shared<SphereBatch>(batch));
+        }
+        return;
+      }
+
+      AABB box = AABB::empty;
+      for(size_t index = start; index < end; index++) box = AABB(box, spheres[index]->boundingBox());
+
+      size_t mid = BVHPartition::median(spheres, start, end, box.longestAxis(),
+        [](const shared_ptr<Sphere>& sphere) { return sphere->boundingBox(); });
+      groupRecursive(spheres, start, mid, batch_size, grouped);
+      groupRecursive(spheres, mid, end, batch_size, grouped);
+    }
+
+    size_t closestScalar(const Ray& ray, Interval ray_t) const
+    {
+      // Same arithmetic as Sphere::hit(), for every sphere of the batch.
+      const Point3& origin = ray.origin();
+      const Vector3& direction = ray.direction();
+      double time = ray.time();
+      double a = direction.length_squared();
+
+      size_t closest = no_hit;
+      for(size_t index = 0; index < spheres.size(); index++)
+      {
+        double oc[3];
+        for(int axis = 0; axis < 3; axis++)
+        {
+          oc[axis] = (center[axis][index] + time * motion[axis][index]) - origin[axis];
+        }
+        double h = direction[0] * oc[0] + direction[1] * oc[1] + direction[2] * oc[2];
+        double c = (oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2]) - radius_squared[index];
+        double discriminant = h * h - a * c;
+        if(discriminant < 0) continue;
+
+        double sqrtd = std::sqrt(discriminant);
+        double root = (h - sqrtd) / a;
+        if(!ray_t.surrounds(root))
+        {
+          root = (h + sqrtd) / a;
+          if(!ray_t.surrounds(root)) continue;
+        }
+        ray_t.max = root;
+        closest = index;
+      }
+      return closest;
+    }
+
+#if RTW_X86_SIMD
+    size_t closestSSE2(const Ray& ray, Interval ray_t) const
+    {
+      const Point3& origin = ray.origin();
+      const Vector3& direction = ray.direction();
+      __m128d time = _mm_set1_pd(ray.time());
+      __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+      __m128d ox = _mm_set1_pd(origin[0]), oy = _mm_set1_pd(origin[1]), oz = _mm_set1_pd(origin[2]);
+      __m128d a = _mm_set1_pd(direction.length_squared());
+      __m128d t_min = _mm_set1_pd(ray_t.min);
+      __m128d zero = _mm_setzero_pd();
+
+      size_t closest = no_hit;
+      double closest_t = ray_t.max;
+      for(size_t index = 0; index < radius_squared.size(); index += 2)
+      {
+        __m128d ocx = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(&center[0][index]), _mm_mul_pd(time, _mm_loadu_pd(&motion[0][index]))), ox);
+        __m128d ocy = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(&center[1][index]), _mm_mul_pd(time, _mm_loadu_pd(&motion[1][index]))), oy);
+        __m128d ocz = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(&center[2][index]), _mm_mul_pd(time, _mm_loadu_pd(&motion[2][index]))), oz);
+        __m128d h = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)), _mm_mul_pd(dz, ocz));
+        __m128d oc_squared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz));
+        __m128d c = _mm_sub_pd(oc_squared, _mm_loadu_pd(&radius_squared[index]));
+        __m128d discriminant = _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+        __m128d has_roots = _mm_cmpge_pd(discriminant, zero);
+        if(_mm_movemask_pd(has_roots) == 0) continue;
+
+        __m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(discriminant, zero));
+        __m128d t_max = _mm_set1_pd(closest_t);
+        __m128d near_root = _mm_div_pd(_mm_sub_pd(h, sqrtd), a);
+        __m128d far_root = _mm_div_pd(_mm_add_pd(h, sqrtd), a);
+        __m128d near_ok = _mm_and_pd(_mm_cmpgt_pd(near_root, t_min), _mm_cmplt_pd(near_root, t_max));
+        __m128d far_ok = _mm_and_pd(_mm_cmpgt_pd(far_root, t_min), _mm_cmplt_pd(far_root, t_max));
+        __m128d root = _mm_or_pd(_mm_and_pd(near_ok, near_root), _mm_andnot_pd(near_ok, far_root));
+        int hit_mask = _mm_movemask_pd(_mm_and_pd(has_roots, _mm_or_pd(near_ok, far_ok)));
+        if(hit_mask == 0) continue;
+
+        alignas(16) double roots[2];
+        _mm_store_pd(roots, root);
+        pickClosest(roots, hit_mask, 2, index, closest_t, closest);
+      }
+      return closest;
+    }
+
+    RTW_TARGET_AVX2
+    size_t closestAVX2(const Ray& ray, Interval ray_t) const
+    {
+      const Point3& origin = ray.origin();
+      const Vector3& direction = ray.direction();
+      __m256d time = _mm256_set1_pd(ray.time());
+      __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+      __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+      __m256d a = _mm256_set1_pd(direction.length_squared());
+      __m256d t_min = _mm256_set1_pd(ray_t.min);
+      __m256d zero = _mm256_setzero_pd();
+
+      size_t closest = no_hit;
+      double closest_t = ray_t.max;
+      for(size_t index = 0; index < radius_squared.size(); index += 4)
+      {
+        __m256d ocx = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center[0][index]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion[0][index]))), ox);
+        __m256d ocy = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center[1][index]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion[1][index]))), oy);
+        __m256d ocz = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center[2][index]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion[2][index]))), oz);
+        __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+        __m256d oc_squared = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+        __m256d c = _mm256_sub_pd(oc_squared, _mm256_loadu_pd(&radius_squared[index]));
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+        __m256d has_roots = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+        if(_mm256_movemask_pd(has_roots) == 0) continue;
+
+        __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+        __m256d t_max = _mm256_set1_pd(closest_t);
+        __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+        __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+        __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_root, t_min, _CMP_GT_OQ), _mm256_cmp_pd(near_root, t_max, _CMP_LT_OQ));
+        __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_root, t_min, _CMP_GT_OQ), _mm256_cmp_pd(far_root, t_max, _CMP_LT_OQ));
+        __m256d root = _mm256_blendv_pd(far_root, near_root, near_ok);
+        int hit_mask = _mm256_movemask_pd(_mm256_and_pd(has_roots, _mm256_or_pd(near_ok, far_ok)));
+        if(hit_mask == 0) continue;
+
+        alignas(32) double roots[4];
+        _mm256_store_pd(roots, root);
+        pickClosest(roots, hit_mask, 4, index, closest_t, closest);
+      }
+      return closest;
+    }
+#endif
+
+    static void pickClosest(const double* roots, int hit_mask, int lanes, size_t first_index,
+                            double& closest_t, size_t& closest)
+    {
+      // Lanes are scanned in order with a strict comparison, so on equal distances the first
+      // sphere wins, as it would in a HittableList.
+      for(int lane = 0; lane < lanes; lane++)
+      {
+        if((hit_mask & (1 << lane)) && roots[lane] < closest_t)
+        {
+          closest_t = roots[lane];
+          closest = first_index + lane;
+        }
+      }
+    }
+};
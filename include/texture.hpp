@@ -1,7 +1,15 @@
 #pragma once
 
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
 #include "perlin.hpp"
 #include "rtw_stb_image.h"
+#include "scheduler.hpp"
+#include "texture_cache.hpp"
+#include "texture_file.hpp"
 
 class Texture
 {
@@ -9,6 +17,13 @@ class Texture
     virtual ~Texture() = default;
 
     virtual Color value(double u, double v, const Point3& point) const = 0;
+
+    // Value averaged over a footprint of the given width in texture (u, v) space, for the
+    // textures that can filter. The others return their point value.
+    virtual Color filteredValue(double u, double v, const Point3& point, double footprint) const
+    {
+      return value(u, v, point);
+    }
 };
 
 class SolidColor : public Texture
@@ -37,6 +52,21 @@ class CheckerTexture : public Texture
       : CheckerTexture(scale, make_shared<SolidColor>(c1), make_shared<SolidColor>(c2)) {}
     
     Color value(double u, double v, const Point3& point) const override
+    {
+      return textureAt(point).value(u, v, point);
+    }
+
+    Color filteredValue(double u, double v, const Point3& point, double footprint) const override
+    {
+      return textureAt(point).filteredValue(u, v, point, footprint);
+    }
+
+  private:
+    double inv_scale;
+    shared_ptr<Texture> even;
+    shared_ptr<Texture> odd;
+
+    const Texture& textureAt(const Point3& point) const
     {
       auto x_integer = int(std::floor(inv_scale * point.x()));
       auto y_integer = int(std::floor(inv_scale * point.y()));
@@ -44,39 +74,182 @@ class CheckerTexture : public Texture
 
       bool is_even = (x_integer + y_integer + z_integer) % 2 == 0;
 
-      return is_even ? even->value(u, v, point) : odd->value(u, v, point);
+      return is_even ? *even : *odd;
+    }
+};
+
+class ImageTileSource : public TileSource
+{
+  // Tiles of the mip pyramid of a decoded image. Level 0 is the image itself; each texel of a
+  // coarser level is the box filtered average of the image texels it covers, computed when its
+  // tile is first requested. Only the decoded image stays resident, the levels live in the
+  // tile cache.
+
+  public:
+    ImageTileSource(const char* filename) : image(filename)
+    {
+      level_count = image.height() > 0 ? levelCountFor(image.width(), image.height()) : 0;
+    }
+
+    int levelCount() const override { return level_count; }
+    int levelWidth(int level) const override { return std::max(1, image.width() >> level); }
+    int levelHeight(int level) const override { return std::max(1, image.height() >> level); }
+
+    void loadTile(int level, int tile_x, int tile_y, unsigned char* rgb) const override
+    {
+      // Filter the texels of the tile that are inside the level, then pad the rest by copying
+      // the last column and row, so each texel is filtered once.
+      int columns = std::min(tile_size, levelWidth(level) - tile_x * tile_size);
+      int rows = std::min(tile_size, levelHeight(level) - tile_y * tile_size);
+      for(int j = 0; j < rows; j++)
+      {
+        for(int i = 0; i < columns; i++)
+        {
+          filterTexel(level, tile_x * tile_size + i, tile_y * tile_size + j, rgb + (size_t(j) * tile_size + i) * 3);
+        }
+        for(int i = columns; i < tile_size; i++)
+        {
+          std::memcpy(rgb + (size_t(j) * tile_size + i) * 3, rgb + (size_t(j) * tile_size + columns - 1) * 3, 3);
+        }
+      }
+      for(int j = rows; j < tile_size; j++)
+      {
+        std::memcpy(rgb + size_t(j) * tile_size * 3, rgb + size_t(rows - 1) * tile_size * 3, size_t(tile_size) * 3);
+      }
     }
 
   private:
-    double inv_scale;
-    shared_ptr<Texture> even;
-    shared_ptr<Texture> odd;
+    RTWImage image;
+    int level_count;
+
+    void filterTexel(int level, int x, int y, unsigned char* rgb) const
+    {
+      // Average of the image texels covered by texel x, y of the level.
+      int y_begin = int(int64_t(y) * image.height() / levelHeight(level));
+      int y_end = std::max(y_begin + 1, int(int64_t(y + 1) * image.height() / levelHeight(level)));
+      int x_begin = int(int64_t(x) * image.width() / levelWidth(level));
+      int x_end = std::max(x_begin + 1, int(int64_t(x + 1) * image.width() / levelWidth(level)));
+
+      uint64_t sum[3] = { 0, 0, 0 };
+      for(int source_y = y_begin; source_y < y_end; source_y++)
+      {
+        const unsigned char* texel = image.pixelData(x_begin, source_y);
+        for(int source_x = x_begin; source_x < x_end; source_x++, texel += 3)
+        {
+          sum[0] += texel[0];
+          sum[1] += texel[1];
+          sum[2] += texel[2];
+        }
+      }
+
+      uint64_t count = uint64_t(x_end - x_begin) * (y_end - y_begin);
+      for(int channel = 0; channel < 3; channel++) rgb[channel] = uint8_t((sum[channel] + count / 2) / count);
+    }
+};
+
+class TextureLoader
+{
+  // Opens the tile sources of image textures. An image converted beforehand (see the
+  // TextureConverter tool) is mapped from its .rtwt file, found next to the image or in the
+  // image directories, unless the image is more recent. Other images are decoded. Every load
+  // is logged with its time.
+
+  public:
+    static shared_ptr<TileSource> open(const std::string& filename)
+    {
+      auto start = std::chrono::steady_clock::now();
+      std::string converted = convertedFile(filename);
+      shared_ptr<TileSource> source;
+      const char* how = "mapped";
+      if(!converted.empty())
+      {
+        auto file = make_shared<TiledTextureFile>();
+        if(file->open(converted)) source = file;
+      }
+      if(!source)
+      {
+        source = make_shared<ImageTileSource>(filename.c_str());
+        how = "decoded";
+      }
+
+      double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      if(source->levelCount() > 0)
+      {
+        // One write per line, the textures may be loading on several threads.
+        std::ostringstream line;
+        line << "Texture " << filename << ' ' << source->levelWidth(0) << 'x' << source->levelHeight(0)
+             << ' ' << how << " in " << milliseconds << " ms\n";
+        std::clog << line.str();
+      }
+      return source;
+    }
+
+    static std::vector<shared_ptr<TileSource>> openAll(const std::vector<std::string>& filenames, int thread_count = 0)
+    {
+      // Open several textures at once, decoding them in parallel.
+      std::vector<shared_ptr<TileSource>> sources(filenames.size());
+      WorkStealingScheduler::run(filenames.size(), thread_count, [&](size_t index, int)
+      {
+        sources[index] = open(filenames[index]);
+      });
+      return sources;
+    }
+
+    static std::string convertedFile(const std::string& filename)
+    {
+      // The up to date .rtwt file of an image, or an empty string if there is none.
+      namespace fs = std::filesystem;
+      if(fs::path(filename).extension() == ".rtwt") return RTWImage::locate(filename);
+
+      std::string image = RTWImage::locate(filename);
+      std::string converted = RTWImage::locate(fs::path(filename).replace_extension(".rtwt").string());
+      if(!image.empty())
+      {
+        std::string beside = fs::path(image).replace_extension(".rtwt").string();
+        if(std::ifstream(beside)) converted = beside;
+      }
+      if(converted.empty() || image.empty()) return converted;
+
+      std::error_code error;
+      if(fs::last_write_time(converted, error) < fs::last_write_time(image, error)) return std::string();
+      return converted;
+    }
 };
 
 class ImageTexture : public Texture
 {
   public:
-    ImageTexture(const char* filename) : image(filename) {}
+    ImageTexture(const char* filename) : ImageTexture(TextureLoader::open(filename)) {}
+
+    ImageTexture(shared_ptr<TileSource> source) : texels(source) {}
+
+    // Set the texels of a texture created without them, for textures loaded in a batch (see
+    // TextureLoader::openAll). Must happen before rendering.
+    void setSource(shared_ptr<TileSource> source) { texels = MipmappedTexels(source); }
 
     Color value(double u, double v, const Point3& point) const override
+    {
+      return filteredValue(u, v, point, 0.0);
+    }
+
+    Color filteredValue(double u, double v, const Point3& point, double footprint) const override
     {
       // If we have no texture data, then return solid cyan as a debugging aid.
-      if(image.height() <= 0) return Color(0, 1, 1);
+      if(texels.levelCount() <= 0) return Color(0, 1, 1);
 
       // Clamp input texture coordinates to [0, 1] x [1, 0]
       u = Interval(0, 1).clamp(u);
       v = 1.0 - Interval(0, 1).clamp(v); // Flip V to image coordinates
 
-      auto i = int(u * image.width()-1);
-      auto j = int(v * image.height()-1);
-      auto pixel = image.pixelData(i, j);
+      float rgb[3];
+      texels.trilinear(u, v, footprint, rgb);
 
       auto color_scale = 1.0 / 255.0;
-      return Color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+      return Color(color_scale * rgb[0], color_scale * rgb[1], color_scale * rgb[2]);
     }
 
   private:
-    RTWImage image;
+    MipmappedTexels texels;
 };
 
 class NoiseTexture : public Texture
@@ -84,13 +257,24 @@ class NoiseTexture : public Texture
   public:
     NoiseTexture(double scale) : scale(scale) {}
 
+    // Precompute the turbulence over a box holding the textured objects, see NoiseVolume.
+    void precompute(const Point3& low, const Point3& high, double samples_per_unit = 16)
+    {
+      volume = make_shared<NoiseVolume>(noise, turbulence_depth, low, high, samples_per_unit);
+    }
+
     Color value(double u, double v, const Point3& point) const override
     {
-      return Color(0.5, 0.5, 0.5) * (1 + std::sin(scale * point.z() + 10 * noise.turbulence(point, 7)));
+      double turbulence;
+      if (!volume || !volume->lookup(point, turbulence)) turbulence = noise.turbulence(point, turbulence_depth);
+      return Color(0.5, 0.5, 0.5) * (1 + std::sin(scale * point.z() + 10 * turbulence));
       // return Color(0.5, 0.5, 0.5) * noise.turbulence(point, 7);
     }
   
   private:
+    static constexpr int turbulence_depth = 7;
+
     Perlin noise;
     double scale;
+    shared_ptr<NoiseVolume> volume;
 };
\ No newline at end of file
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Mipmapped textures are read through fixed size tiles of texels, which a process-wide cache
+// keeps in memory up to a byte budget. A TileSource produces the tiles on a miss: computed
+// from a decoded image, or read from a tiled texture file.
+
+class TileSource
+{
+  public:
+    // Tiles are square, tile_size texels on a side, three bytes (linear RGB) per texel. Tiles
+    // on the right and bottom edges of a level are padded by repeating the last texel.
+    static constexpr int tile_size = 64;
+    static constexpr size_t tile_bytes = size_t(tile_size) * tile_size * 3;
+
+    TileSource() : source_id(next_id++) {}
+    virtual ~TileSource() = default;
+
+    virtual int levelCount() const = 0;
+    virtual int levelWidth(int level) const = 0;
+    virtual int levelHeight(int level) const = 0;
+
+    // Write the texels of a tile to rgb (tile_bytes bytes). Called by the cache on a miss,
+    // possibly from several threads at once.
+    virtual void loadTile(int level, int tile_x, int tile_y, unsigned char* rgb) const = 0;
+
+    // Sources whose tiles already sit in memory, like a mapped texture file, return them here.
+    // Their texels are then read in place: the cache, and its memory limit, are bypassed.
+    virtual const unsigned char* residentTile(int level, int tile_x, int tile_y) const { return nullptr; }
+
+    uint32_t id() const { return source_id; }
+
+    static int levelCountFor(int width, int height)
+    {
+      // A full pyramid, down to a single texel.
+      int levels = 1;
+      while((width >> (levels - 1)) > 1 || (height >> (levels - 1)) > 1) levels++;
+      return levels;
+    }
+
+  private:
+    uint32_t source_id;
+    static inline std::atomic<uint32_t> next_id{0};
+};
+
+class TextureTileCache
+{
+  // Least recently used tiles are evicted once the cache holds more than its memory limit.
+  // The cache is split into shards, each with its own lock and LRU list, so render threads
+  // missing on different tiles rarely wait on each other. Tiles are handed out as shared
+  // pointers: a tile evicted while a thread still reads it stays alive until it is done.
+
+  public:
+    using Tile = std::vector<unsigned char>;
+
+    static TextureTileCache& global()
+    {
+      static TextureTileCache cache;
+      return cache;
+    }
+
+    void setMemoryLimit(size_t bytes)
+    {
+      memory_limit = std::max(bytes, TileSource::tile_bytes * shard_count);
+      for(Shard& shard : shards)
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        evict(shard);
+      }
+    }
+
+    size_t memoryLimit() const { return memory_limit; }
+
+    size_t memoryUsed() const
+    {
+      size_t bytes = 0;
+      for(const Shard& shard : shards) bytes += shard.bytes;
+      return bytes;
+    }
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+    std::shared_ptr<const Tile> tile(const TileSource& source, int level, int tile_x, int tile_y)
+    {
+      uint64_t key = tileKey(source.id(), level, tile_x, tile_y);
+      Shard& shard = shards[mixKey(key) % shard_count];
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.entries.find(key);
+        if(found != shard.entries.end())
+        {
+          shard.order.splice(shard.order.begin(), shard.order, found->second.position);
+          hit_count.fetch_add(1, std::memory_order_relaxed);
+          return found->second.tile;
+        }
+      }
+
+      // Load outside of the lock; if another thread loaded the same tile meanwhile, keep theirs.
+      miss_count.fetch_add(1, std::memory_order_relaxed);
+      auto loaded = std::make_shared<Tile>(TileSource::tile_bytes);
+      source.loadTile(level, tile_x, tile_y, loaded->data());
+
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto found = shard.entries.find(key);
+      if(found != shard.entries.end()) return found->second.tile;
+
+      shard.order.push_front(key);
+      shard.entries[key] = { loaded, shard.order.begin() };
+      shard.bytes += TileSource::tile_bytes;
+      evict(shard);
+      return loaded;
+    }
+
+    static uint64_t tileKey(uint32_t source, int level, int tile_x, int tile_y)
+    {
+      // 24 bits of source, 8 of level, and 16 for each tile coordinate.
+      return (uint64_t(source & 0xffffff) << 40) | (uint64_t(level & 0xff) << 32)
+           | (uint64_t(tile_y & 0xffff) << 16) | uint64_t(tile_x & 0xffff);
+    }
+
+    static uint64_t mixKey(uint64_t key)
+    {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdull;
+      key ^= key >> 33;
+      return key;
+    }
+
+  private:
+    static constexpr int shard_count = 16;
+
+    struct Entry
+    {
+      std::shared_ptr<const Tile> tile;
+      std::list<uint64_t>::iterator position;
+    };
+
+    struct Shard
+    {
+      std::mutex mutex;
+      std::list<uint64_t> order; // Most recently used first
+      std::unordered_map<uint64_t, Entry> entries;
+      size_t bytes = 0;
+    };
+
+    Shard shards[shard_count];
+    std::atomic<size_t> memory_limit{size_t(256) << 20};
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+
+    void evict(Shard& shard)
+    {
+      size_t shard_limit = memory_limit / shard_count;
+      while(shard.bytes > shard_limit && shard.order.size() > 1)
+      {
+        shard.entries.erase(shard.order.back());
+        shard.order.pop_back();
+        shard.bytes -= TileSource::tile_bytes;
+      }
+    }
+};
+
+class MipmappedTexels
+{
+  // Filtered reads from a TileSource through the tile cache. Each thread keeps the last tiles
+  // it read in a small direct-mapped table in front of the shared cache, so most lookups take
+  // no lock. Those tiles stay alive while a thread holds them, evicted or not, which bounds the
+  // overshoot of the memory limit to recent_tile_count tiles per render thread.
+
+  public:
+    MipmappedTexels(std::shared_ptr<TileSource> source) : source(std::move(source))
+    {
+      if(!this->source) return;
+      for(int level = 0; level < this->source->levelCount(); level++)
+      {
+        level_sizes.push_back({ this->source->levelWidth(level), this->source->levelHeight(level) });
+      }
+      resident = !level_sizes.empty() && this->source->residentTile(0, 0, 0) != nullptr;
+    }
+
+    int levelCount() const { return int(level_sizes.size()); }
+
+    void bilinear(int level, double x, double y, float rgb[3]) const
+    {
+      // Bilinear interpolation at continuous texel coordinates x, y of a level, where texel
+      // (i, j) covers [i, i + 1) x [j, j + 1). Coordinates outside the level clamp to its edge.
+      const LevelSize& size = level_sizes[level];
+      // x and y are at least -0.5 once centered on the texels, so the truncation of x + 1 is
+      // the floor of x + 1, without a call to floor().
+      x = std::max(x, 0.0) + 0.5;
+      y = std::max(y, 0.0) + 0.5;
+      int x0 = int(x) - 1;
+      int y0 = int(y) - 1;
+      float fx = float(x - (x0 + 1));
+      float fy = float(y - (y0 + 1));
+      int x1 = std::clamp(x0 + 1, 0, size.width - 1);
+      int y1 = std::clamp(y0 + 1, 0, size.height - 1);
+      x0 = std::clamp(x0, 0, size.width - 1);
+      y0 = std::clamp(y0, 0, size.height - 1);
+
+      const unsigned char *t00, *t10, *t01, *t11;
+      int tile_x = x0 / TileSource::tile_size, tile_y = y0 / TileSource::tile_size;
+      if(x1 / TileSource::tile_size == tile_x && y1 / TileSource::tile_size == tile_y)
+      {
+        // All four texels in one tile, the common case.
+        const unsigned char* data = tileData(level, tile_x, tile_y);
+        t00 = data + texelOffset(x0, y0);
+        t10 = data + texelOffset(x1, y0);
+        t01 = data + texelOffset(x0, y1);
+        t11 = data + texelOffset(x1, y1);
+      }
+      else
+      {
+        t00 = texel(level, x0, y0);
+        t10 = texel(level, x1, y0);
+        t01 = texel(level, x0, y1);
+        t11 = texel(level, x1, y1);
+      }
+      for(int channel = 0; channel < 3; channel++)
+      {
+        float top = t00[channel] + fx * (t10[channel] - t00[channel]);
+        float bottom = t01[channel] + fx * (t11[channel] - t01[channel]);
+        rgb[channel] = top + fy * (bottom - top);
+      }
+    }
+
+    void trilinear(double u, double v, double footprint, float rgb[3]) const
+    {
+      // Filtered read at texture coordinates u, v (v downwards, both in [0, 1]) for a footprint
+      // of the given width in texture space: the two levels whose texels are closest to the
+      // footprint are read bilinearly and blended.
+      double texels = footprint * std::max(level_sizes[0].width, level_sizes[0].height);
+      double level = texels > 1 ? std::log2(texels) : 0.0;
+      int last_level = levelCount() - 1;
+      if(level >= last_level)
+      {
+        bilinear(last_level, u * level_sizes[last_level].width, v * level_sizes[last_level].height, rgb);
+        return;
+      }
+
+      int fine = int(level);
+      float blend = float(level - fine);
+      bilinear(fine, u * level_sizes[fine].width, v * level_sizes[fine].height, rgb);
+      if(blend > 0)
+      {
+        float coarse[3];
+        bilinear(fine + 1, u * level_sizes[fine + 1].width, v * level_sizes[fine + 1].height, coarse);
+        for(int channel = 0; channel < 3; channel++) rgb[channel] += blend * (coarse[channel] - rgb[channel]);
+      }
+    }
+
+  private:
+    static constexpr int recent_tile_count = 256;
+
+    struct LevelSize
+    {
+      int width, height;
+    };
+
+    struct RecentTiles
+    {
+      uint64_t keys[recent_tile_count];
+      const unsigned char* data[recent_tile_count] = {};
+      std::shared_ptr<const TextureTileCache::Tile> tiles[recent_tile_count];
+    };
+
+    std::shared_ptr<TileSource> source;
+    std::vector<LevelSize> level_sizes;
+    bool resident = false;
+
+    const unsigned char* tileData(int level, int tile_x, int tile_y) const
+    {
+      if(resident) return source->residentTile(level, tile_x, tile_y);
+
+      uint64_t key = TextureTileCache::tileKey(source->id(), level, tile_x, tile_y);
+
+      thread_local RecentTiles recent;
+      size_t slot = size_t(TextureTileCache::mixKey(key) % recent_tile_count);
+      if(recent.data[slot] == nullptr || recent.keys[slot] != key)
+      {
+        recent.tiles[slot] = TextureTileCache::global().tile(*source, level, tile_x, tile_y);
+        recent.data[slot] = recent.tiles[slot]->data();
+        recent.keys[slot] = key;
+      }
+      return recent.data[slot];
+    }
+
+    static size_t texelOffset(int x, int y)
+    {
+      return (size_t(y % TileSource::tile_size) * TileSource::tile_size + x % TileSource::tile_size) * 3;
+    }
+
+    const unsigned char* texel(int level, int x, int y) const
+    {
+      // The three bytes of a texel, x and y inside the level.
+      return tileData(level, x / TileSource::tile_size, y / TileSource::tile_size) + texelOffset(x, y);
+    }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "texture_cache.hpp"
+
+// Converted textures (.rtwt): the whole mip pyramid of an image, stored as the tiles the texture
+// cache works with, so a texture is ready to render as soon as its file is mapped. The header
+// is followed by the tiles of each level in turn, row by row, starting on a page boundary. A
+// tile is 64 * 64 * 3 = 12288 bytes, a multiple of the page size, so every tile stays page
+// aligned and the file is read in place, without decoding or copying.
+
+struct TextureFileHeader
+{
+  static constexpr const char* magic_value = "RTWTEXTR";
+  static const uint32_t current_version = 1;
+  static const uint32_t byte_order_mark = 0x01020304;
+  static const int max_levels = 32;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t width, height;
+  uint32_t level_count;
+  uint32_t tile_size;
+  uint64_t level_offsets[max_levels]; // File offset of the first tile of each level
+};
+
+class TiledTextureFile : public TileSource
+{
+  public:
+    bool open(const std::string& filename)
+    {
+      // Map a converted texture and check that it is complete. Returns false, after reporting
+      // why, if it cannot be used.
+      if(map(filename)) return true;
+      file.close();
+      return false;
+    }
+
+    int levelCount() const override { return file.isOpen() ? int(header.level_count) : 0; }
+    int levelWidth(int level) const override { return std::max(1, int(header.width) >> level); }
+    int levelHeight(int level) const override { return std::max(1, int(header.height) >> level); }
+
+    void loadTile(int level, int tile_x, int tile_y, unsigned char* rgb) const override
+    {
+      std::memcpy(rgb, residentTile(level, tile_x, tile_y), tile_bytes);
+    }
+
+    const unsigned char* residentTile(int level, int tile_x, int tile_y) const override
+    {
+      uint64_t tile = uint64_t(tile_y) * tilesFor(levelWidth(level)) + tile_x;
+      return file.data() + header.level_offsets[level] + tile * tile_bytes;
+    }
+
+    static bool write(const std::string& filename, const TileSource& source)
+    {
+      // Convert a tile source, reading every tile of every level once.
+      TextureFileHeader header = {};
+      std::memcpy(header.magic, TextureFileHeader::magic_value, sizeof(header.magic));
+      header.version = TextureFileHeader::current_version;
+      header.byte_order = TextureFileHeader::byte_order_mark;
+      header.width = uint32_t(source.levelWidth(0));
+      header.height = uint32_t(source.levelHeight(0));
+      header.level_count = uint32_t(source.levelCount());
+      header.tile_size = uint32_t(tile_size);
+      if(header.level_count == 0 || header.level_count > uint32_t(TextureFileHeader::max_levels)) return false;
+
+      uint64_t offset = page_size;
+      for(int level = 0; level < int(header.level_count); level++)
+      {
+        header.level_offsets[level] = offset;
+        offset += uint64_t(tilesFor(source.levelWidth(level))) * tilesFor(source.levelHeight(level)) * tile_bytes;
+      }
+
+      std::ofstream out(filename, std::ios::binary);
+      if(!out) return false;
+
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      std::vector<char> padding(page_size - sizeof(header), 0);
+      out.write(padding.data(), std::streamsize(padding.size()));
+
+      std::vector<unsigned char> tile(tile_bytes);
+      for(int level = 0; level < int(header.level_count); level++)
+      {
+        for(int tile_y = 0; tile_y < tilesFor(source.levelHeight(level)); tile_y++)
+        {
+          for(int tile_x = 0; tile_x < tilesFor(source.levelWidth(level)); tile_x++)
+          {
+            source.loadTile(level, tile_x, tile_y, tile.data());
+            out.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size()));
+          }
+        }
+      }
+      return bool(out);
+    }
+
+  private:
+    static const uint64_t page_size = 4096;
+
+    MappedFile file;
+    TextureFileHeader header = {};
+
+    bool map(const std::string& filename)
+    {
+      if(!file.open(filename))
+      {
+        std::cerr << "ERROR: Could not open texture file '" << filename << "'.\n";
+        return false;
+      }
+
+      if(file.size() < sizeof(TextureFileHeader))
+      {
+        std::cerr << "ERROR: '" << filename << "' is not a texture file.\n";
+        return false;
+      }
+
+      std::memcpy(&header, file.data(), sizeof(header));
+      if(std::memcmp(header.magic, TextureFileHeader::magic_value, sizeof(header.magic)) != 0
+         || header.version != TextureFileHeader::current_version
+         || header.byte_order != TextureFileHeader::byte_order_mark
+         || header.tile_size != uint32_t(tile_size))
+      {
+        std::cerr << "ERROR: '" << filename << "' is not a texture file of this version and byte order.\n";
+        return false;
+      }
+
+      // Sizes that fit an int, tile count included, and no more levels than the pyramid has.
+      const uint32_t max_extent = uint32_t(std::numeric_limits<int>::max() - tile_size);
+      if(header.width == 0 || header.height == 0 || header.width > max_extent || header.height > max_extent
+         || header.level_count == 0
+         || header.level_count > uint32_t(levelCountFor(int(header.width), int(header.height))))
+      {
+        std::cerr << "ERROR: Texture file '" << filename << "' has an invalid size or level count.\n";
+        return false;
+      }
+
+      // Every level must start on a page after the header and hold all its tiles within the
+      // file; checked without overflowing offset + tiles * tile_bytes.
+      for(int level = 0; level < int(header.level_count); level++)
+      {
+        uint64_t offset = header.level_offsets[level];
+        if(offset < page_size || offset % page_size != 0 || offset > file.size()
+           || tileCount(level) > (file.size() - offset) / tile_bytes)
+        {
+          std::cerr << "ERROR: Texture file '" << filename << "' is truncated or damaged.\n";
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static int tilesFor(int texels) { return (texels + tile_size - 1) / tile_size; }
+
+    uint64_t tileCount(int level) const
+    {
+      return uint64_t(tilesFor(levelWidth(level))) * tilesFor(levelHeight(level));
+    }
+};
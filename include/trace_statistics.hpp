@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+// Counters of the work done while tracing: rays, BVH node visits, bounding box and primitive
+// tests, scatter events, and the distribution of path lengths. They are only compiled in when
+// RTW_ENABLE_STATS is defined to 1 (the RTW_ENABLE_STATS CMake option). Otherwise the
+// RTW_COUNT macros expand to nothing and the hot path is exactly what it is without them.
+//
+// Every thread counts into its own TraceStatistics, so the counters need no atomics; the
+// camera merges them into the render total as the tiles complete.
+
+#ifndef RTW_ENABLE_STATS
+  #define RTW_ENABLE_STATS 0
+#endif
+
+class TraceStatistics
+{
+  public:
+    enum Counter
+    {
+      PrimaryRays,
+      SecondaryRays,
+      ShadowRays,
+      BVHNodesVisited,
+      AABBTests,
+      SphereTests,
+      QuadTests,
+      TriangleTests,
+      SphereBatchTests,
+      LambertianScatters,
+      MetalScatters,
+      DielectricScatters,
+      CounterCount
+    };
+
+    // Path lengths, in rays, are counted up to the last bucket, which also holds the longer ones.
+    static const int path_length_buckets = 64;
+
+    uint64_t counters[CounterCount] = {};
+    uint64_t path_lengths[path_length_buckets] = {};
+
+    void recordPathLength(int length)
+    {
+      path_lengths[length < path_length_buckets ? length : path_length_buckets - 1]++;
+    }
+
+    void merge(const TraceStatistics& other)
+    {
+      for(int counter = 0; counter < CounterCount; counter++) counters[counter] += other.counters[counter];
+      for(int bucket = 0; bucket < path_length_buckets; bucket++) path_lengths[bucket] += other.path_lengths[bucket];
+    }
+
+    void clear()
+    {
+      *this = TraceStatistics();
+    }
+
+    static const char* counterName(int counter)
+    {
+      static const char* const names[CounterCount] = {
+        "primary_rays", "secondary_rays", "shadow_rays", "bvh_nodes_visited", "aabb_tests", "sphere_tests", "quad_tests",
+        "triangle_tests", "sphere_batch_tests", "lambertian_scatters", "metal_scatters", "dielectric_scatters"
+      };
+      return names[counter];
+    }
+
+    void writeJSON(std::ostream& out, const char* indent = "") const
+    {
+      // A JSON object with one member per counter, and the path length histogram trimmed
+      // after its last non-empty bucket.
+      out << "{\n";
+      for(int counter = 0; counter < CounterCount; counter++)
+      {
+        out << indent << "  \"" << counterName(counter) << "\": " << counters[counter] << ",\n";
+      }
+
+      int used_buckets = path_length_buckets;
+      while(used_buckets > 0 && path_lengths[used_buckets - 1] == 0) used_buckets--;
+      out << indent << "  \"path_length_histogram\": [";
+      for(int bucket = 0; bucket < used_buckets; bucket++)
+      {
+        out << (bucket > 0 ? ", " : "") << path_lengths[bucket];
+      }
+      out << "]\n" << indent << "}";
+    }
+};
+
+inline TraceStatistics& threadTraceStatistics()
+{
+  thread_local TraceStatistics statistics;
+  return statistics;
+}
+
+#if RTW_ENABLE_STATS
+  #define RTW_COUNT(counter) (threadTraceStatistics().counters[TraceStatistics::counter]++)
+  #define RTW_COUNT_N(counter, n) (threadTraceStatistics().counters[TraceStatistics::counter] += (n))
+  #define RTW_COUNT_PATH_LENGTH(length) (threadTraceStatistics().recordPathLength(length))
+#else
+  #define RTW_COUNT(counter) ((void)0)
+  #define RTW_COUNT_N(counter, n) ((void)0)
+  #define RTW_COUNT_PATH_LENGTH(length) ((void)0)
+#endif
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hittable.hpp"
+#include "linear_bvh.hpp"
+
+// Triangle meshes: shared, indexed vertex arrays in single precision, and one BVH over the
+// triangles of the mesh, which its leaves reference by index. A triangle costs its three
+// vertex indices, its share of the vertices (about half a vertex each in a closed mesh) and of
+// the BVH nodes, instead of a heap allocated object with its own material and bounding box.
+
+struct TriangleMeshData
+{
+  std::vector<float> positions;  // x, y, z per vertex
+  std::vector<float> normals;    // x, y, z per vertex, or empty
+  std::vector<float> uvs;        // u, v per vertex, or empty
+  std::vector<uint32_t> indices; // Three vertices per triangle, counter-clockwise seen from its front
+
+  size_t vertexCount() const { return positions.size() / 3; }
+  size_t triangleCount() const { return indices.size() / 3; }
+};
+
+class TriangleMesh : public Hittable
+{
+  public:
+    TriangleMesh(TriangleMeshData mesh_data, shared_ptr<Material> material, int max_leaf_size = 4)
+      : mesh(std::move(mesh_data)), material(material)
+    {
+      std::vector<AABB> boxes(mesh.triangleCount());
+      for(size_t triangle = 0; triangle < boxes.size(); triangle++)
+      {
+        boxes[triangle] = AABB(AABB(vertex(triangle, 0), vertex(triangle, 1)), AABB(vertex(triangle, 2), vertex(triangle, 2)));
+      }
+      tree.build(boxes, BVHSplitMethod::BinnedSAH, std::min(max_leaf_size, 65535));
+
+      // Store the triangles in leaf order, so the leaves index them directly.
+      std::vector<uint32_t> indices(mesh.indices.size());
+      for(size_t slot = 0; slot < tree.primitive_order.size(); slot++)
+      {
+        std::copy_n(&mesh.indices[size_t(tree.primitive_order[slot]) * 3], 3, &indices[slot * 3]);
+      }
+      mesh.indices.swap(indices);
+      tree.primitive_order = std::vector<uint32_t>();
+
+      mesh.positions.shrink_to_fit();
+      mesh.normals.shrink_to_fit();
+      mesh.uvs.shrink_to_fit();
+      tree.nodes.shrink_to_fit();
+    }
+
+    static shared_ptr<TriangleMesh> loadOBJ(const std::string& filename, shared_ptr<Material> material)
+    {
+      // Load a Wavefront OBJ file, and log its size and load time. Returns nullptr, after
+      // reporting why, if the file cannot be read.
+      auto start = std::chrono::steady_clock::now();
+      TriangleMeshData data;
+      if(!readOBJ(filename, data)) return nullptr;
+      auto mesh = make_shared<TriangleMesh>(std::move(data), material);
+      double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+      // One write per line, the meshes may be loading on several threads.
+      std::ostringstream line;
+      line << "Mesh " << filename << ' ' << mesh->triangleCount() << " triangles, " << mesh->vertexCount()
+           << " vertices, " << double(mesh->memoryUsage()) / std::max<size_t>(mesh->triangleCount(), 1)
+           << " bytes per triangle, loaded in " << milliseconds << " ms\n";
+      std::clog << line.str();
+      return mesh;
+    }
+
+    static bool readOBJ(const std::string& filename, TriangleMeshData& data);
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      // Find the closest triangle first, then fill the record once, for that triangle only.
+      WatertightRay watertight(ray);
+      uint32_t closest = 0;
+      double closest_b1 = 0, closest_b2 = 0;
+      bool hit_anything = tree.traverse(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& interval)
+      {
+        bool hit_leaf = false;
+        for(uint32_t slot = first; slot < first + count; slot++)
+        {
+          RTW_COUNT(TriangleTests);
+          double t, b1, b2;
+          if(intersectTriangle(vertex(slot, 0), vertex(slot, 1), vertex(slot, 2), ray, watertight, interval, t, b1, b2))
+          {
+            interval.max = t;
+            closest = slot;
+            closest_b1 = b1;
+            closest_b2 = b2;
+            hit_leaf = true;
+          }
+        }
+        return hit_leaf;
+      });
+      if(!hit_anything) return false;
+
+      fillRecord(ray, closest, ray_t.max, closest_b1, closest_b2, record);
+      return true;
+    }
+
+    AABB boundingBox() const override
+    {
+      return tree.boundingBox();
+    }
+
+    size_t vertexCount() const { return mesh.vertexCount(); }
+    size_t triangleCount() const { return mesh.triangleCount(); }
+    size_t nodeCount() const { return tree.nodes.size(); }
+
+    size_t memoryUsage() const
+    {
+      // Bytes held by the vertex arrays, the indices and the BVH.
+      return (mesh.positions.size() + mesh.normals.size() + mesh.uvs.size()) * sizeof(float)
+           + mesh.indices.size() * sizeof(uint32_t) + tree.nodes.size() * sizeof(LinearBVHNode);
+    }
+
+    struct WatertightRay
+    {
+      // The ray direction's largest axis (kz) and the shear that maps the ray onto the +z axis
+      // through the origin, computed once per ray.
+      int kx, ky, kz;
+      double shear_x, shear_y, shear_z;
+
+      WatertightRay(const Ray& ray)
+      {
+        const Vector3& direction = ray.direction();
+        kz = 0;
+        if(std::fabs(direction[1]) > std::fabs(direction[kz])) kz = 1;
+        if(std::fabs(direction[2]) > std::fabs(direction[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if(direction[kz] < 0) std::swap(kx, ky); // Keep the winding of the triangles
+        shear_x = direction[kx] / direction[kz];
+        shear_y = direction[ky] / direction[kz];
+        shear_z = 1.0 / direction[kz];
+      }
+    };
+
+    static bool intersectTriangle(const Point3& a, const Point3& b, const Point3& c, const Ray& ray,
+                                  const WatertightRay& watertight, const Interval& ray_t,
+                                  double& t, double& b1, double& b2)
+    {
+      // Watertight ray-triangle intersection (Woop, Benthin and Wald, "Watertight Ray/Triangle
+      // Intersection", 2013). In the sheared space of the ray, the ray is the z axis, and the
+      // signed areas of the triangles it forms with each edge decide the hit. Two triangles
+      // sharing an edge compute the same area for it, from the same vertices, so a ray through
+      // the edge hits at least one of them: no ray slips through the cracks between triangles.
+      // Returns the distance and the barycentric weights of b and c.
+      const Point3& origin = ray.origin();
+      Vector3 A = a - origin, B = b - origin, C = c - origin;
+      int kx = watertight.kx, ky = watertight.ky, kz = watertight.kz;
+      double ax = A[kx] - watertight.shear_x * A[kz], ay = A[ky] - watertight.shear_y * A[kz];
+      double bx = B[kx] - watertight.shear_x * B[kz], by = B[ky] - watertight.shear_y * B[kz];
+      double cx = C[kx] - watertight.shear_x * C[kz], cy = C[ky] - watertight.shear_y * C[kz];
+
+      double U = cx * by - cy * bx;
+      double V = ax * cy - ay * cx;
+      double W = bx * ay - by * ax;
+      if((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+
+      double determinant = U + V + W;
+      if(determinant == 0) return false;
+
+      double T = U * watertight.shear_z * A[kz] + V * watertight.shear_z * B[kz] + W * watertight.shear_z * C[kz];
+      t = T / determinant;
+      if(!ray_t.surrounds(t)) return false;
+
+      b1 = V / determinant;
+      b2 = W / determinant;
+      return true;
+    }
+
+  private:
+    TriangleMeshData mesh;
+    shared_ptr<Material> material;
+    LinearBVHTree tree;
+
+    Point3 vertex(size_t triangle, int corner) const
+    {
+      const float* position = &mesh.positions[size_t(mesh.indices[triangle * 3 + corner]) * 3];
+      return Point3(position[0], position[1], position[2]);
+    }
+
+    void fillRecord(const Ray& ray, uint32_t triangle, double t, double b1, double b2, HitRecord& record) const
+    {
+      const uint32_t* corners = &mesh.indices[size_t(triangle) * 3];
+      Point3 a = vertex(triangle, 0), b = vertex(triangle, 1), c = vertex(triangle, 2);
+      Vector3 n = cross(b - a, c - a);
+      double b0 = 1 - b1 - b2;
+
+      record.t = t;
+      record.hit_impact = ray.at(t);
+      record.material = material.get();
+      record.setFaceNormal(ray, unit_vector(n));
+      if(!mesh.normals.empty())
+      {
+        // The interpolated vertex normal, on the side of the surface the ray comes from.
+        Vector3 shading;
+        for(int corner = 0; corner < 3; corner++)
+        {
+          const float* normal = &mesh.normals[size_t(corners[corner]) * 3];
+          double weight = corner == 0 ? b0 : corner == 1 ? b1 : b2;
+          shading += weight * Vector3(normal[0], normal[1], normal[2]);
+        }
+        if(shading.length_squared() > 0)
+        {
+          shading = unit_vector(shading);
+          record.normal = dot(shading, record.normal) < 0 ? -shading : shading;
+        }
+      }
+
+      double area = n.length();
+      if(!mesh.uvs.empty())
+      {
+        const float* uv0 = &mesh.uvs[size_t(corners[0]) * 2];
+        const float* uv1 = &mesh.uvs[size_t(corners[1]) * 2];
+        const float* uv2 = &mesh.uvs[size_t(corners[2]) * 2];
+        record.u = b0 * uv0[0] + b1 * uv1[0] + b2 * uv2[0];
+        record.v = b0 * uv0[1] + b1 * uv1[1] + b2 * uv2[1];
+        double uv_area = std::fabs((uv1[0] - uv0[0]) * (uv2[1] - uv0[1]) - (uv2[0] - uv0[0]) * (uv1[1] - uv0[1]));
+        record.uv_scale = area > 0 ? std::sqrt(uv_area / area) : 0;
+      }
+      else
+      {
+        record.u = b1;
+        record.v = b2;
+        record.uv_scale = area > 0 ? 1 / std::sqrt(area) : 0;
+      }
+    }
+};
+
+class OBJReader
+{
+  // Streaming Wavefront OBJ reader: the file is read in fixed size chunks and parsed line by
+  // line, so only the mesh being built, and not the text, is ever held in memory. Reads the
+  // positions, texture coordinates and normals, and the faces, which are split into triangle
+  // fans. Every other statement (groups, materials, smoothing) is ignored.
+  //
+  // OBJ faces index positions, texture coordinates and normals separately. The mesh has one
+  // index per corner, so each distinct combination becomes one vertex; corners sharing a
+  // position are chained from that position to find the combinations already made.
+
+  public:
+    bool read(const std::string& filename, TriangleMeshData& data)
+    {
+      FILE* file = std::fopen(filename.c_str(), "rb");
+      if(!file)
+      {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return false;
+      }
+
+      this->filename = filename;
+      mesh = &data;
+      *mesh = TriangleMeshData();
+      std::vector<char> buffer(chunk_size);
+      size_t used = 0;
+      bool success = true, end_of_file = false;
+      while(success && !end_of_file)
+      {
+        if(used == buffer.size()) buffer.resize(buffer.size() * 2); // A line longer than the buffer
+        size_t count = std::fread(buffer.data() + used, 1, buffer.size() - used, file);
+        used += count;
+        end_of_file = count == 0;
+        if(end_of_file && used > 0 && buffer[used - 1] != '\n')
+        {
+          if(used == buffer.size()) buffer.resize(buffer.size() + 1);
+          buffer[used++] = '\n';
+        }
+
+        // Parse the complete lines, and keep the last, partial one for the next chunk.
+        size_t line_start = 0;
+        for(size_t index = 0; index < used && success; index++)
+        {
+          if(buffer[index] != '\n') continue;
+          buffer[index] = '\0';
+          line_number++;
+          success = parseLine(&buffer[line_start]);
+          line_start = index + 1;
+        }
+        used -= line_start;
+        std::memmove(buffer.data(), buffer.data() + line_start, used);
+      }
+      std::fclose(file);
+      if(!success) return false;
+
+      // Attributes only some corners have are dropped.
+      if(!all_normals) mesh->normals.clear();
+      if(!all_uvs) mesh->uvs.clear();
+      return true;
+    }
+
+  private:
+    static constexpr size_t chunk_size = size_t(1) << 20;
+    static constexpr uint32_t none = ~uint32_t(0);
+
+    struct Corner
+    {
+      uint32_t position, uv, normal;
+    };
+
+    std::string filename;
+    int line_number = 0;
+    TriangleMeshData* mesh = nullptr;
+    std::vector<float> positions, uvs, normals; // As listed in the file
+    std::vector<uint32_t> first_vertex;         // Per position, its first vertex, or none
+    std::vector<uint32_t> next_vertex;          // Per vertex, the next vertex with the same position, or none
+    std::vector<Corner> vertex_corners;         // Per vertex, the combination it stands for
+    std::vector<uint32_t> face;                 // Vertices of the face being read
+    bool all_normals = true, all_uvs = true;
+
+    bool error(const std::string& message) const
+    {
+      std::cerr << "ERROR: " << filename << ':' << line_number << ": " << message << '\n';
+      return false;
+    }
+
+    static bool readFloats(const char*& text, float* values, int count)
+    {
+      for(int index = 0; index < count; index++)
+      {
+        char* end;
+        values[index] = std::strtof(text, &end);
+        if(end == text) return false;
+        text = end;
+      }
+      return true;
+    }
+
+    static const char* skipSpaces(const char* text)
+    {
+      while(*text == ' ' || *text == '\t' || *text == '\r') text++;
+      return text;
+    }
+
+    bool parseLine(const char* line)
+    {
+      line = skipSpaces(line);
+      if(line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+      {
+        float position[3];
+        if(!readFloats(++line, position, 3)) return error("expected v X Y Z");
+        positions.insert(positions.end(), position, position + 3);
+        first_vertex.push_back(none);
+      }
+      else if(line[0] == 'v' && line[1] == 't' && (line[2] == ' ' || line[2] == '\t'))
+      {
+        float uv[2];
+        if(!readFloats(line += 2, uv, 2)) return error("expected vt U V");
+        uvs.insert(uvs.end(), uv, uv + 2);
+      }
+      else if(line[0] == 'v' && line[1] == 'n' && (line[2] == ' ' || line[2] == '\t'))
+      {
+        float normal[3];
+        if(!readFloats(line += 2, normal, 3)) return error("expected vn X Y Z");
+        normals.insert(normals.end(), normal, normal + 3);
+      }
+      else if(line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+      {
+        return parseFace(line + 1);
+      }
+      return true;
+    }
+
+    bool parseFace(const char* text)
+    {
+      face.clear();
+      while(*(text = skipSpaces(text)) != '\0')
+      {
+        Corner corner;
+        if(!readIndex(text, positions.size() / 3, corner.position)) return error("invalid face vertex");
+        corner.uv = corner.normal = none;
+        if(*text == '/')
+        {
+          text++;
+          if(*text != '/' && !readIndex(text, uvs.size() / 2, corner.uv)) return error("invalid face texture coordinate");
+          if(*text == '/' && !readIndex(++text, normals.size() / 3, corner.normal)) return error("invalid face normal");
+        }
+        if(*text != '\0' && *text != ' ' && *text != '\t' && *text != '\r') return error("invalid face vertex");
+        face.push_back(vertexFor(corner));
+      }
+      if(face.size() < 3) return error("a face needs at least three vertices");
+
+      for(size_t index = 1; index + 1 < face.size(); index++)
+      {
+        mesh->indices.push_back(face[0]);
+        mesh->indices.push_back(face[index]);
+        mesh->indices.push_back(face[index + 1]);
+      }
+      return true;
+    }
+
+    static bool readIndex(const char*& text, size_t count, uint32_t& index)
+    {
+      // One-based, or negative to count back from the last element read so far.
+      char* end;
+      long value = std::strtol(text, &end, 10);
+      if(end == text) return false;
+      text = end;
+      long resolved = value < 0 ? long(count) + value : value - 1;
+      if(value == 0 || resolved < 0 || resolved >= long(count)) return false;
+      index = uint32_t(resolved);
+      return true;
+    }
+
+    uint32_t vertexFor(const Corner& corner)
+    {
+      for(uint32_t vertex = first_vertex[corner.position]; vertex != none; vertex = next_vertex[vertex])
+      {
+        const Corner& existing = vertex_corners[vertex];
+        if(existing.uv == corner.uv && existing.normal == corner.normal) return vertex;
+      }
+
+      uint32_t vertex = uint32_t(vertex_corners.size());
+      vertex_corners.push_back(corner);
+      next_vertex.push_back(first_vertex[corner.position]);
+      first_vertex[corner.position] = vertex;
+
+      const float* position = &positions[size_t(corner.position) * 3];
+      mesh->positions.insert(mesh->positions.end(), position, position + 3);
+      all_uvs = all_uvs && corner.uv != none;
+      all_normals = all_normals && corner.normal != none;
+      if(all_uvs)
+      {
+        const float* uv = &uvs[size_t(corner.uv) * 2];
+        mesh->uvs.insert(mesh->uvs.end(), uv, uv + 2);
+      }
+      if(all_normals)
+      {
+        const float* normal = &normals[size_t(corner.normal) * 3];
+        mesh->normals.insert(mesh->normals.end(), normal, normal + 3);
+      }
+      return vertex;
+    }
+};
+
+inline bool TriangleMesh::readOBJ(const std::string& filename, TriangleMeshData& data)
+{
+  // Read a Wavefront OBJ file into mesh arrays. Returns false, after reporting why, if it
+  // cannot be read.
+  return OBJReader().read(filename, data);
+}
\ No newline at end of file
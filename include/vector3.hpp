@@ -121,6 +121,17 @@ inline Vector3 unit_vector(const Vector3& v)
   return v / v.length();
 }
 
+inline void orthonormalBasis(const Vector3& n, Vector3& b1, Vector3& b2)
+{
+  // Two unit vectors completing the unit vector n into an orthonormal basis, without branches
+  // on the direction of n (Duff et al., "Building an Orthonormal Basis, Revisited", 2017).
+  double sign = std::copysign(1.0, n.z());
+  double a = -1.0 / (sign + n.z());
+  double b = n.x() * n.y() * a;
+  b1 = Vector3(1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+  b2 = Vector3(b, sign + n.y() * n.y() * a, -n.y());
+}
+
 inline Vector3 randomUnitVector()
 {
   // Find a good vector candidate.
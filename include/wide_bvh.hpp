@@ -0,0 +1,344 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "cpu_features.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+
+template <int Width>
+struct alignas(32) WideBVHNode
+{
+  // A node with up to Width children whose boxes are stored axis by axis, one float per child,
+  // so one SIMD register holds the same slab of every child. A child is either an interior
+  // node ('count' == 0, 'child' is a node index), a leaf ('count' primitives starting at slot
+  // 'child'), or an empty slot (a box at infinity, which every slab test misses).
+
+  float bounds_min[3][Width];
+  float bounds_max[3][Width];
+  uint32_t child[Width];
+  uint32_t count[Width];
+
+  void clear()
+  {
+    for(int slot = 0; slot < Width; slot++)
+    {
+      for(int axis = 0; axis < 3; axis++)
+      {
+        bounds_min[axis][slot] = std::numeric_limits<float>::infinity();
+        bounds_max[axis][slot] = std::numeric_limits<float>::infinity();
+      }
+      child[slot] = empty_slot;
+      count[slot] = 0;
+    }
+  }
+
+  static constexpr uint32_t empty_slot = 0xffffffffu;
+};
+
+struct WideBVHRay
+{
+  // The ray in the precision of the node boxes, with the inverse direction precomputed once.
+  float origin[3];
+  float inverse_direction[3];
+};
+
+class WideBVH : public Hittable
+{
+  // 4-wide or 8-wide BVH, collapsed from a binary LinearBVH. Each visited node tests the boxes
+  // of all of its children at once with branch-free min/max slab tests: SSE for 4 children,
+  // AVX2 for 8 children. The kernel is chosen at construction from the CPU features, with a
+  // scalar fallback for other CPUs and compilers. Leaves are the leaves of the binary BVH and
+  // reference the same primitive array.
+
+  public:
+    enum class Kernel
+    {
+      Scalar4, // 4 children, plain loops
+      Scalar8, // 8 children, plain loops
+      SSE4,    // 4 children, SSE
+      AVX2x8   // 8 children, AVX2
+    };
+
+    static Kernel bestKernel()
+    {
+      if(cpuSupportsAVX2()) return Kernel::AVX2x8;
+      return RTW_X86_SIMD ? Kernel::SSE4 : Kernel::Scalar4;
+    }
+
+    WideBVH(const LinearBVH& binary_bvh) : WideBVH(binary_bvh, bestKernel()) {}
+
+    WideBVH(const LinearBVH& binary_bvh, Kernel kernel) : kernel(kernel), primitives(binary_bvh.primitives)
+    {
+#if !RTW_X86_SIMD
+      if(kernel == Kernel::SSE4) this->kernel = Kernel::Scalar4;
+      if(kernel == Kernel::AVX2x8) this->kernel = Kernel::Scalar8;
+#endif
+      if(kernel == Kernel::AVX2x8 && !cpuSupportsAVX2()) this->kernel = Kernel::Scalar8;
+
+      bbox = binary_bvh.boundingBox();
+      if(width() == 4) collapse(binary_bvh.tree, nodes4);
+      else collapse(binary_bvh.tree, nodes8);
+    }
+
+    WideBVH(const HittableList& list) : WideBVH(LinearBVH(list)) {}
+
+    bool hit(const Ray& ray, Interval ray_t, HitRecord& record) const override
+    {
+      switch(kernel)
+      {
+        case Kernel::Scalar4: return traverse(nodes4, ray, ray_t, record, intersectScalar<4>);
+        case Kernel::Scalar8: return traverse(nodes8, ray, ray_t, record, intersectScalar<8>);
+#if RTW_X86_SIMD
+        case Kernel::SSE4: return traverse(nodes4, ray, ray_t, record, intersectSSE);
+        case Kernel::AVX2x8: return traverse(nodes8, ray, ray_t, record, intersectAVX2);
+#else
+        default: break;
+#endif
+      }
+      return false;
+    }
+
+    AABB boundingBox() const override
+    {
+      return bbox;
+    }
+
+    Kernel activeKernel() const { return kernel; }
+    int width() const { return (kernel == Kernel::Scalar4 || kernel == Kernel::SSE4) ? 4 : 8; }
+    size_t nodeCount() const { return width() == 4 ? nodes4.size() : nodes8.size(); }
+
+  private:
+    Kernel kernel;
+    std::vector<WideBVHNode<4>> nodes4;
+    std::vector<WideBVHNode<8>> nodes8;
+    std::vector<shared_ptr<Hittable>> primitives;
+    AABB bbox;
+
+    // Slack on the far slab distance. Float rounding of the ray and the slab distances could
+    // otherwise make a ray graze past a box it actually touches.
+    static constexpr float far_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+    struct StackEntry
+    {
+      uint32_t index; // Node index, or first primitive slot for a leaf
+      uint32_t count; // 0 for a node, primitive count for a leaf
+      float t_near;   // Entry distance into the box
+    };
+
+    template <int Width>
+    static void collapse(const LinearBVHTree& tree, std::vector<WideBVHNode<Width>>& nodes)
+    {
+      nodes.clear();
+      if(tree.nodes.empty()) return;
+      nodes.reserve(tree.nodes.size() / 2 + 1);
+      collapseNode(tree, 0, nodes);
+    }
+
+    template <int Width>
+    static uint32_t collapseNode(const LinearBVHTree& tree, uint32_t binary_index, std::vector<WideBVHNode<Width>>& nodes)
+    {
+      // Gather up to Width descendants of the binary node by repeatedly opening the interior
+      // child with the largest surface area, the one most likely to be hit.
+      uint32_t children[Width];
+      int child_count = 0;
+      const LinearBVHNode& binary_node = tree.nodes[binary_index];
+      if(binary_node.isLeaf())
+      {
+        children[child_count++] = binary_index;
+      }
+      else
+      {
+        children[child_count++] = binary_index + 1;
+        children[child_count++] = binary_node.offset;
+      }
+
+      while(child_count < Width)
+      {
+        int best = -1;
+        double best_area = -1;
+        for(int slot = 0; slot < child_count; slot++)
+        {
+          const LinearBVHNode& candidate = tree.nodes[children[slot]];
+          if(candidate.isLeaf()) continue;
+          double area = candidate.boundingBox().surfaceArea();
+          if(area > best_area)
+          {
+            best_area = area;
+            best = slot;
+          }
+        }
+        if(best < 0) break;
+
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[child_count++] = tree.nodes[opened].offset;
+      }
+
+      uint32_t node_index = uint32_t(nodes.size());
+      nodes.emplace_back();
+      nodes[node_index].clear();
+
+      for(int slot = 0; slot < child_count; slot++)
+      {
+        const LinearBVHNode& child = tree.nodes[children[slot]];
+        for(int axis = 0; axis < 3; axis++)
+        {
+          nodes[node_index].bounds_min[axis][slot] = child.bounds_min[axis];
+          nodes[node_index].bounds_max[axis][slot] = child.bounds_max[axis];
+        }
+
+        uint32_t child_index = child.offset;
+        uint32_t count = child.primitive_count;
+        if(!child.isLeaf())
+        {
+          child_index = collapseNode(tree, children[slot], nodes);
+        }
+        // nodes may have been reallocated by the recursion.
+        nodes[node_index].child[slot] = child_index;
+        nodes[node_index].count[slot] = count;
+      }
+      return node_index;
+    }
+
+    template <int Width, typename Intersect>
+    bool traverse(const std::vector<WideBVHNode<Width>>& wide_nodes, const Ray& ray, Interval ray_t,
+                  HitRecord& record, Intersect intersect) const
+    {
+      if(wide_nodes.empty()) return false;
+
+      WideBVHRay wide_ray;
+      for(int axis = 0; axis < 3; axis++)
+      {
+        wide_ray.origin[axis] = float(ray.origin()[axis]);
+        wide_ray.inverse_direction[axis] = float(1.0 / ray.direction()[axis]);
+      }
+
+      // The far limit is kept finite, so that the empty slots (boxes at infinity) always miss.
+      float t_max = float(std::fmin(ray_t.max, std::numeric_limits<float>::max()));
+
+      StackEntry stack[LinearBVHTree::max_depth * (Width - 1) + 1];
+      int stack_size = 0;
+      stack[stack_size++] = { 0, 0, float(ray_t.min) };
+      bool hit_anything = false;
+
+      while(stack_size > 0)
+      {
+        StackEntry entry = stack[--stack_size];
+        if(entry.t_near > ray_t.max) continue; // A closer hit was found since it was pushed
+
+        if(entry.count > 0)
+        {
+          for(uint32_t slot = entry.index; slot < entry.index + entry.count; slot++)
+          {
+            if(primitives[slot]->hit(ray, ray_t, record))
+            {
+              hit_anything = true;
+              ray_t.max = record.t;
+              t_max = float(record.t);
+            }
+          }
+          continue;
+        }
+
+        const WideBVHNode<Width>& node = wide_nodes[entry.index];
+        RTW_COUNT(BVHNodesVisited);
+        RTW_COUNT_N(AABBTests, Width);
+        float t_near[Width];
+        unsigned int mask = intersect(node, wide_ray, float(ray_t.min), t_max, t_near);
+        if(mask == 0) continue;
+
+        // Push the hit children from the farthest to the nearest, so the nearest is popped
+        // first. Width is small, an insertion sort of the hit slots is enough.
+        int order[Width];
+        int hit_count = 0;
+        for(int slot = 0; slot < Width; slot++)
+        {
+          if(!(mask & (1u << slot))) continue;
+          int position = hit_count++;
+          while(position > 0 && t_near[order[position - 1]] < t_near[slot])
+          {
+            order[position] = order[position - 1];
+            position--;
+          }
+          order[position] = slot;
+        }
+
+        for(int k = 0; k < hit_count; k++)
+        {
+          int slot = order[k];
+          stack[stack_size++] = { node.child[slot], node.count[slot], t_near[slot] };
+        }
+      }
+      return hit_anything;
+    }
+
+    template <int Width>
+    static unsigned int intersectScalar(const WideBVHNode<Width>& node, const WideBVHRay& ray,
+                                        float t_min, float t_max, float* t_near)
+    {
+      unsigned int mask = 0;
+      for(int slot = 0; slot < Width; slot++)
+      {
+        float near_t = t_min;
+        float far_t = std::numeric_limits<float>::infinity();
+        for(int axis = 0; axis < 3; axis++)
+        {
+          float t0 = (node.bounds_min[axis][slot] - ray.origin[axis]) * ray.inverse_direction[axis];
+          float t1 = (node.bounds_max[axis][slot] - ray.origin[axis]) * ray.inverse_direction[axis];
+          near_t = std::max(near_t, std::min(t0, t1));
+          far_t = std::min(far_t, std::max(t0, t1));
+        }
+        far_t = std::min(far_t * far_scale, t_max);
+        t_near[slot] = near_t;
+        if(near_t <= far_t) mask |= 1u << slot;
+      }
+      return mask;
+    }
+
+#if RTW_X86_SIMD
+    static unsigned int intersectSSE(const WideBVHNode<4>& node, const WideBVHRay& ray,
+                                     float t_min, float t_max, float* t_near)
+    {
+      __m128 near_t = _mm_set1_ps(t_min);
+      __m128 far_t = _mm_set1_ps(std::numeric_limits<float>::infinity());
+      for(int axis = 0; axis < 3; axis++)
+      {
+        __m128 origin = _mm_set1_ps(ray.origin[axis]);
+        __m128 inverse_direction = _mm_set1_ps(ray.inverse_direction[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min[axis]), origin), inverse_direction);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max[axis]), origin), inverse_direction);
+        near_t = _mm_max_ps(near_t, _mm_min_ps(t0, t1));
+        far_t = _mm_min_ps(far_t, _mm_max_ps(t0, t1));
+      }
+      _mm_storeu_ps(t_near, near_t);
+      far_t = _mm_min_ps(_mm_mul_ps(far_t, _mm_set1_ps(far_scale)), _mm_set1_ps(t_max));
+      __m128 hit = _mm_cmple_ps(near_t, far_t);
+      return unsigned(_mm_movemask_ps(hit));
+    }
+
+    RTW_TARGET_AVX2
+    static unsigned int intersectAVX2(const WideBVHNode<8>& node, const WideBVHRay& ray,
+                                      float t_min, float t_max, float* t_near)
+    {
+      __m256 near_t = _mm256_set1_ps(t_min);
+      __m256 far_t = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+      for(int axis = 0; axis < 3; axis++)
+      {
+        __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+        __m256 inverse_direction = _mm256_set1_ps(ray.inverse_direction[axis]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_min[axis]), origin), inverse_direction);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_max[axis]), origin), inverse_direction);
+        near_t = _mm256_max_ps(near_t, _mm256_min_ps(t0, t1));
+        far_t = _mm256_min_ps(far_t, _mm256_max_ps(t0, t1));
+      }
+      _mm256_storeu_ps(t_near, near_t);
+      far_t = _mm256_min_ps(_mm256_mul_ps(far_t, _mm256_set1_ps(far_scale)), _mm256_set1_ps(t_max));
+      __m256 hit = _mm256_cmp_ps(near_t, far_t, _CMP_LE_OQ);
+      return unsigned(_mm256_movemask_ps(hit));
+    }
+#endif
+};
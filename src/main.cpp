@@ -1,212 +1,72 @@
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
-
-#include "rtweekend.hpp"
-
-#include "bvh.hpp"
-#include "camera.hpp"
-#include "hittable.hpp"
-#include "hittable_list.hpp"
-#include "material.hpp"
-#include "quadrilaterals.hpp"
-#include "sphere.hpp"
-#include "texture.hpp"
-
-void bouncingSpheres() 
+#include <string>
+
+#include "scene_file.hpp"
+#include "scenes.hpp"
+
+// Usage: RayTracerInOneWeekend [scene number | scene file] [--write-cache file.rtwb] [--workers n]
+//                              [--texture-cache-mb n] [--sampler name] [--denoise]
+//                              [--features prefix]
+//   A number selects one of the built-in scenes, see makeScene(). A scene file is either a
+//   text scene (.rtw) or a binary cache (.rtwb), see scene_file.hpp. With --write-cache, the
+//   text scene is built and written as a cache instead of being rendered. With --workers, the
+//   tiles are rendered by n worker processes, unless the camera has a time budget, which always
+//   renders progressively in this process. --texture-cache-mb caps the memory used by the
+//   image texture tiles (256 MB by default). --sampler overrides the sampler of the scene:
+//   independent, stratified, halton, sobol or bluenoise, see sampler.hpp. --denoise filters
+//   the image guided by albedo, normal and depth buffers, which --features writes to
+//   prefix_albedo.pfm, prefix_normal.pfm and prefix_depth.pfm, see denoiser.hpp.
+
+int main(int argc, char* argv[])
 {
-  // World
-
-  HittableList world;
+  std::string scene_argument = "5";
+  std::string cache_file;
+  int worker_processes = 0;
+  std::string sampler_name;
+  bool denoise = false;
+  std::string feature_file_prefix;
+  for (int index = 1; index < argc; index++)
+  {
+    if (std::strcmp(argv[index], "--write-cache") == 0 && index + 1 < argc) cache_file = argv[++index];
+    else if (std::strcmp(argv[index], "--workers") == 0 && index + 1 < argc) worker_processes = std::atoi(argv[++index]);
+    else if (std::strcmp(argv[index], "--sampler") == 0 && index + 1 < argc) sampler_name = argv[++index];
+    else if (std::strcmp(argv[index], "--denoise") == 0) denoise = true;
+    else if (std::strcmp(argv[index], "--features") == 0 && index + 1 < argc) feature_file_prefix = argv[++index];
+    else if (std::strcmp(argv[index], "--texture-cache-mb") == 0 && index + 1 < argc)
+      TextureTileCache::global().setMemoryLimit(size_t(std::atoll(argv[++index])) << 20);
+    else scene_argument = argv[index];
+  }
 
-  auto material_ground = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
-  auto checker_texture = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-  auto material_checker = make_shared<Lambertian>(checker_texture);
-  world.add(make_shared<Sphere>(Point3(0.0, -1000, 0.0), 1000, material_checker));
+  bool is_number = scene_argument.find_first_not_of("0123456789") == std::string::npos;
 
-  for(int a = -11; a < 11; a++)
+  if (!cache_file.empty())
   {
-    for(int b = -11; b < 11; b++)
+    SceneDescription description;
+    if (is_number || !description.parseFile(scene_argument)) return 1;
+    if (!description.writeCache(cache_file))
     {
-      auto choose_mat = randomDouble();
-      Point3 center(a + 0.9 * randomDouble(), 0.2, b + 0.9 * randomDouble());
-
-      if ((center - Point3(4, 0.2, 0)).length() > 0.9)
-      {
-        shared_ptr<Material> sphere_material;
-
-        if(choose_mat < 0.8)
-        {
-          // diffuse
-          auto albedo = Color::random() * Color::random();
-          sphere_material = make_shared<Lambertian>(albedo);
-          Vector3 center2 = center + Vector3(0, randomDouble(0.0, 0.5), 0);
-          world.add(make_shared<Sphere>(center, center2, 0.2, sphere_material));
-        }
-        else if(choose_mat < 0.95)
-        {
-          // metal
-          auto albedo = Color::random(0.5, 1);
-          auto fuzz = randomDouble(0, 0.5);
-          sphere_material = make_shared<Metal>(albedo, fuzz);
-          world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-        }
-        else
-        {
-          // glass
-          sphere_material = make_shared<Dielectric>(1.5);
-          world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-        }
-      }
+      std::cerr << "ERROR: Could not write scene cache '" << cache_file << "'.\n";
+      return 1;
     }
+    return 0;
   }
 
-  auto material1 = make_shared<Dielectric>(1.5);
-  world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
-
-  auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-  world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
-
-  auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-  world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
-
-  world = HittableList(make_shared<BVHNode>(world));
-
-  Camera camera;
-  // Create a PPM image file
-  std::ofstream render_image("../render/checker_texture.ppm");
-
-  camera.image_width = 1600;
-  camera.image_height = 800;
-  camera.sample_per_pixel = 100;
-  camera.max_depth = 50;
-
-  camera.vertical_field_of_view = 20;
-  camera.look_from = Point3(13, 2, 3);
-  camera.look_at = Point3(0, 0, 0);
-  camera.view_up = Vector3(0, 1, 0);
-
-  camera.defocus_angle = 0.6;
-  camera.focus_distance = 10.0;
-
-  camera.render(render_image, world);
-}
-
-void checkeredSpheres()
-{
-  HittableList world;
-
-  auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-
-  world.add(make_shared<Sphere>(Point3(0, -10, 0), 10, make_shared<Lambertian>(checker)));
-  world.add(make_shared<Sphere>(Point3(0, 10, 0), 10, make_shared<Lambertian>(checker)));
-
-  Camera camera;
-  // Create a PPM image file
-  std::ofstream render_image("../render/checker_texture.ppm");
-
-  camera.image_height = 400;
-  camera.image_width = 800;
-  camera.sample_per_pixel = 100;
-  camera.max_depth = 50;
-
-  camera.vertical_field_of_view = 20;
-  camera.look_from = Point3(13, 2, 3);
-  camera.look_at = Point3(0, 0, 0);
-  camera.view_up = Vector3(0, 1, 0);
-
-  camera.defocus_angle = 0;
-  camera.render(render_image, world);
-}
+  Scene scene;
+  if (is_number) scene = makeScene(std::atoi(scene_argument.c_str()));
+  else if (!loadSceneFile(scene_argument, scene)) return 1;
 
-void earth()
-{
-  auto earth_texture = make_shared<ImageTexture>("earthmap.jpg");
-  auto earth_surface = make_shared<Lambertian>(earth_texture);
-  auto globe = make_shared<Sphere>(Point3(0, 0, 0), 2, earth_surface);
-
-  Camera camera;
-  // Create a PPM image file
-  std::ofstream render_image("../render/earth_render.ppm");
-
-  camera.image_height = 400;
-  camera.image_width = 800;
-  camera.sample_per_pixel = 10;
-  camera.max_depth = 50;
-
-  camera.vertical_field_of_view = 20;
-  camera.look_from = Point3(0, 0, 12);
-  camera.look_at = Point3(0, 0, 0);
-  camera.view_up = Vector3(0, 1, 0);
-
-  camera.defocus_angle = 0;
-  camera.render(render_image, HittableList(globe));
-}
-
-void perlinSphere()
-{
-  HittableList world;
-  auto perlin_texture = make_shared<NoiseTexture>(4);
-  world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(perlin_texture)));
-  world.add(make_shared<Sphere>(Point3(0, 2, 0), 2, make_shared<Lambertian>(perlin_texture)));
-
-  Camera camera;
-  // Create a PPM image file
-  std::ofstream render_image("../render/perlin_noise.ppm");
-
-  camera.image_height = 200;
-  camera.image_width = 400;
-  camera.sample_per_pixel = 100;
-  camera.max_depth = 50;
-
-  camera.vertical_field_of_view = 20;
-  camera.look_from = Point3(13, 2, 3);
-  camera.look_at = Point3(0, 0, 0);
-  camera.view_up = Vector3(0, 1, 0);
-
-  camera.defocus_angle = 0;
-  camera.render(render_image, world);
-}
-
-void quads()
-{
-  HittableList world;
-  auto left_red = make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
-  auto back_green = make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
-  auto right_blue = make_shared<Lambertian>(Color(0.2, 0.2, 1.0));
-  auto upper_orange = make_shared<Lambertian>(Color(1.0, 0.5, 0.0));
-  auto lower_teal = make_shared<Lambertian>(Color(0.2, 0.8, 0.8));
-
-  world.add(make_shared<Quad>(Point3(-3, -2, 5), Vector3(0, 0, -4), Vector3(0, 4, 0), left_red));
-  world.add(make_shared<Quad>(Point3(-2, -2, 0), Vector3(4, 0, 0), Vector3(0, 4, 0), back_green));
-  world.add(make_shared<Quad>(Point3(3, -2, 1), Vector3(0, 0, 4), Vector3(0, 4, 0), right_blue));
-  world.add(make_shared<Quad>(Point3(-2, 3, 1), Vector3(4, 0, 0), Vector3(0, 0, 4), upper_orange));
-  world.add(make_shared<Quad>(Point3(-2, -3, 5), Vector3(4, 0, 0), Vector3(0, 0, -4), lower_teal));
+  scene.camera.worker_processes = worker_processes;
+  if (denoise) scene.camera.denoise = true;
+  if (!feature_file_prefix.empty()) scene.camera.feature_file_prefix = feature_file_prefix;
+  if (!sampler_name.empty() && !parseSamplerType(sampler_name, scene.camera.sampler_type))
+  {
+    std::cerr << "ERROR: Unknown sampler '" << sampler_name << "'.\n";
+    return 1;
+  }
 
-  Camera camera;
   // Create a PPM image file
-  std::ofstream render_image("../render/quads.ppm");
-
-  camera.image_height = 400;
-  camera.image_width = 800;
-  camera.sample_per_pixel = 100;
-  camera.max_depth = 50;
-
-  camera.vertical_field_of_view = 80;
-  camera.look_from = Point3(0, 0, 9);
-  camera.look_at = Point3(0, 0, 0);
-  camera.view_up = Vector3(0, 1, 0);
-
-  camera.defocus_angle = 0;
-  camera.render(render_image, world);
+  std::ofstream render_image(scene.output_file, std::ios::binary);
+  scene.camera.render(render_image, scene.world, scene.lights);
 }
-
-int main()
-{
-  switch (5)
-  {
-    case 1: bouncingSpheres(); break;
-    case 2: checkeredSpheres(); break;
-    case 3: earth(); break;
-    case 4: perlinSphere(); break;
-    case 5: quads(); break;
-  }
-}
\ No newline at end of file
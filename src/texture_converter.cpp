@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.hpp"
+#include "texture.hpp"
+
+// Usage: TextureConverter [--threads n] image...
+//   Converts each image to a mipmapped, tiled texture file (.rtwt) written next to it, which
+//   ImageTexture then maps instead of decoding the image, see texture_file.hpp. The images are
+//   converted in parallel, on every hardware thread unless --threads says otherwise.
+
+int main(int argc, char* argv[])
+{
+  int thread_count = 0;
+  std::vector<std::string> images;
+  for (int index = 1; index < argc; index++)
+  {
+    if (std::strcmp(argv[index], "--threads") == 0 && index + 1 < argc) thread_count = std::atoi(argv[++index]);
+    else images.push_back(argv[index]);
+  }
+
+  if (images.empty())
+  {
+    std::cerr << "Usage: TextureConverter [--threads n] image...\n";
+    return 1;
+  }
+
+  std::vector<char> converted(images.size(), 0);
+  WorkStealingScheduler::run(images.size(), thread_count, [&](size_t index, int)
+  {
+    auto start = std::chrono::steady_clock::now();
+    ImageTileSource image(images[index].c_str());
+    if (image.levelCount() == 0) return;
+
+    std::string output = std::filesystem::path(images[index]).replace_extension(".rtwt").string();
+    if (!TiledTextureFile::write(output, image))
+    {
+      std::cerr << "ERROR: Could not write texture file '" + output + "'.\n";
+      return;
+    }
+    converted[index] = 1;
+
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::ostringstream line;
+    line << images[index] << " -> " << output << " (" << image.levelWidth(0) << 'x' << image.levelHeight(0)
+         << ", " << image.levelCount() << " levels) in " << milliseconds << " ms\n";
+    std::clog << line.str();
+  });
+
+  for (char success : converted)
+  {
+    if (!success) return 1;
+  }
+  return 0;
+}